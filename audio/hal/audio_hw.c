@@ -15,6 +15,7 @@
  */
 
 #define LOG_TAG "audio_hw_primary"
+#define ATRACE_TAG ATRACE_TAG_AUDIO
 /*#define LOG_NDEBUG 0*/
 /*#define VERY_VERY_VERBOSE_LOGGING*/
 #ifdef VERY_VERY_VERBOSE_LOGGING
@@ -26,18 +27,29 @@
 #include <errno.h>
 #include <pthread.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <sys/time.h>
 #include <stdlib.h>
+#include <strings.h>
 #include <math.h>
 #include <dlfcn.h>
 #include <sys/resource.h>
 #include <sys/prctl.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
 
 #include <cutils/log.h>
 #include <cutils/str_parms.h>
 #include <cutils/properties.h>
 #include <cutils/atomic.h>
 #include <cutils/sched_policy.h>
+#include <cutils/trace.h>
+
+#include <expat.h>
+
+#if defined(__ARM_NEON__) || defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 #include <hardware/audio_effect.h>
 #include <system/thread_defs.h>
@@ -45,11 +57,14 @@
 #include <audio_effects/effect_ns.h>
 #include "audio_hw.h"
 
+#include <sound/asound.h>
 #include "sound/compress_params.h"
+#include <sound/compress_offload.h>
 
 #define MIXER_CTL_COMPRESS_PLAYBACK_VOLUME "Compress Playback Volume"
 
-/* TODO: the following PCM device profiles could be read from a config file */
+/* Default PCM device profiles, tuned from PCM_PROFILES_FILE_PATH by
+ * pcm_profiles_load() */
 struct pcm_device_profile pcm_device_playback_hs = {
     .config = {
         .channels = PLAYBACK_DEFAULT_CHANNEL_COUNT,
@@ -160,6 +175,45 @@ struct pcm_device_profile pcm_device_capture_sco = {
     .devices = AUDIO_DEVICE_IN_BLUETOOTH_SCO_HEADSET,
 };
 
+/* wideband variants of the SCO profiles, selected by get_sco_pcm_device() */
+struct pcm_device_profile pcm_device_playback_sco_wb = {
+    .config = {
+        .channels = SCO_DEFAULT_CHANNEL_COUNT,
+        .rate = SCO_WB_SAMPLING_RATE,
+        .period_size = SCO_WB_PERIOD_SIZE,
+        .period_count = SCO_PERIOD_COUNT,
+        .format = PCM_FORMAT_S16_LE,
+        .start_threshold = SCO_WB_START_THRESHOLD,
+        .stop_threshold = SCO_WB_STOP_THRESHOLD,
+        .silence_threshold = 0,
+        .avail_min = SCO_AVAILABLE_MIN,
+    },
+    .card = SOUND_CARD,
+    .id = 2,
+    .type = PCM_PLAYBACK,
+    .devices =
+            AUDIO_DEVICE_OUT_BLUETOOTH_SCO|AUDIO_DEVICE_OUT_BLUETOOTH_SCO_HEADSET|
+            AUDIO_DEVICE_OUT_BLUETOOTH_SCO_CARKIT,
+};
+
+struct pcm_device_profile pcm_device_capture_sco_wb = {
+    .config = {
+        .channels = SCO_DEFAULT_CHANNEL_COUNT,
+        .rate = SCO_WB_SAMPLING_RATE,
+        .period_size = SCO_WB_PERIOD_SIZE,
+        .period_count = SCO_PERIOD_COUNT,
+        .format = PCM_FORMAT_S16_LE,
+        .start_threshold = CAPTURE_START_THRESHOLD,
+        .stop_threshold = 0,
+        .silence_threshold = 0,
+        .avail_min = 0,
+    },
+    .card = SOUND_CARD,
+    .id = 2,
+    .type = PCM_CAPTURE,
+    .devices = AUDIO_DEVICE_IN_BLUETOOTH_SCO_HEADSET,
+};
+
 struct pcm_device_profile pcm_device_hotword_streaming = {
     .config = {
         .channels = 1,
@@ -189,11 +243,22 @@ struct pcm_device_profile *pcm_devices[] = {
     NULL,
 };
 
+/* Delay added between the point where the AP (or the offload DSP for compressed
+ * playback) hands samples over and the codec input, in us. The codec and amplifier
+ * part is per sound device and read from the mixer paths, see mixer_load_paths() */
+static const int32_t usecase_pipeline_latency_us[AUDIO_USECASE_MAX] = {
+    [USECASE_AUDIO_PLAYBACK] = PLAYBACK_PIPELINE_LATENCY_US,
+    [USECASE_AUDIO_PLAYBACK_MULTI_CH] = PLAYBACK_HDMI_PIPELINE_LATENCY_US,
+    [USECASE_AUDIO_PLAYBACK_OFFLOAD] = COMPRESS_OFFLOAD_PIPELINE_LATENCY_US,
+    [USECASE_AUDIO_PLAYBACK_DEEP_BUFFER] = PLAYBACK_PIPELINE_LATENCY_US,
+};
+
 static const char * const use_case_table[AUDIO_USECASE_MAX] = {
     [USECASE_AUDIO_PLAYBACK] = "playback",
     [USECASE_AUDIO_PLAYBACK_MULTI_CH] = "playback multi-channel",
     [USECASE_AUDIO_PLAYBACK_OFFLOAD] = "compress-offload-playback",
     [USECASE_AUDIO_CAPTURE] = "capture",
+    [USECASE_AUDIO_CAPTURE_LOW_LATENCY] = "low-latency-capture",
     [USECASE_AUDIO_CAPTURE_HOTWORD] = "capture-hotword",
     [USECASE_VOICE_CALL] = "voice-call",
 };
@@ -209,9 +274,9 @@ struct pcm_config pcm_config_deep_buffer = {
     .period_size = DEEP_BUFFER_OUTPUT_PERIOD_SIZE,
     .period_count = DEEP_BUFFER_OUTPUT_PERIOD_COUNT,
     .format = PCM_FORMAT_S16_LE,
-    .start_threshold = DEEP_BUFFER_OUTPUT_PERIOD_SIZE / 4,
+    .start_threshold = DEEP_BUFFER_OUTPUT_START_THRESHOLD,
     .stop_threshold = INT_MAX,
-    .avail_min = DEEP_BUFFER_OUTPUT_PERIOD_SIZE / 4,
+    .avail_min = DEEP_BUFFER_OUTPUT_AVAILABLE_MIN,
 };
 
 struct string_to_enum {
@@ -226,6 +291,120 @@ static const struct string_to_enum out_channels_name_to_enum_table[] = {
 };
 
 static void dummybuf_thread_close(struct audio_device *adev);
+static void warm_standby_thread_close(struct audio_device *adev);
+static void adev_init_thread_close(struct audio_device *adev);
+
+/* Fills ts with the CLOCK_MONOTONIC time timeout_ms from now, for use with
+ * conditions initialized with pthread_condattr_setclock(CLOCK_MONOTONIC) */
+static void get_deadline(struct timespec *ts, int64_t timeout_ms)
+{
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    ts->tv_sec += timeout_ms / 1000;
+    ts->tv_nsec += (timeout_ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+static int64_t get_monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void latency_hist_add(struct latency_hist *hist, int64_t duration_ns)
+{
+    int64_t us = duration_ns / 1000;
+    int32_t max_us;
+    int bucket;
+
+    if (us > INT32_MAX)
+        us = INT32_MAX;
+    bucket = us <= 0 ? 0 : 32 - __builtin_clz((uint32_t)us);
+    if (bucket >= LATENCY_HIST_BUCKETS)
+        bucket = LATENCY_HIST_BUCKETS - 1;
+    android_atomic_inc(&hist->buckets[bucket]);
+
+    do {
+        max_us = hist->max_us;
+    } while (us > max_us && android_atomic_cmpxchg(max_us, (int32_t)us, &hist->max_us) != 0);
+}
+
+/* Prints the count, median, 99th percentile and maximum of the histogram,
+ * then its non empty buckets as "<upper bound in us>:<count>" */
+static void latency_hist_dump(int fd, const char *name, struct latency_hist *hist)
+{
+    int32_t buckets[LATENCY_HIST_BUCKETS];
+    int64_t count = 0;
+    int64_t sum = 0;
+    int32_t max_us = hist->max_us;
+    int32_t p50_us = -1;
+    int32_t p99_us = -1;
+    int i;
+
+    for (i = 0; i < LATENCY_HIST_BUCKETS; i++) {
+        buckets[i] = android_atomic_acquire_load(&hist->buckets[i]);
+        count += buckets[i];
+    }
+    if (count == 0) {
+        dprintf(fd, "  %s: none\n", name);
+        return;
+    }
+    /* the percentiles are bucket upper bounds, capped by the maximum */
+    for (i = 0; i < LATENCY_HIST_BUCKETS; i++) {
+        sum += buckets[i];
+        if (p50_us < 0 && sum * 2 >= count)
+            p50_us = 1 << i;
+        if (p99_us < 0 && sum * 100 >= count * 99)
+            p99_us = 1 << i;
+    }
+    dprintf(fd, "  %s: count %lld, p50 %d us, p99 %d us, max %d us\n    ", name,
+            (long long)count, p50_us < max_us ? p50_us : max_us,
+            p99_us < max_us ? p99_us : max_us, max_us);
+    for (i = 0; i < LATENCY_HIST_BUCKETS; i++) {
+        if (buckets[i] != 0)
+            dprintf(fd, " %s%d:%d", i == LATENCY_HIST_BUCKETS - 1 ? ">=" : "<",
+                    i == LATENCY_HIST_BUCKETS - 1 ? 1 << (i - 1) : 1 << i, buckets[i]);
+    }
+    dprintf(fd, "\n");
+}
+
+/* Locks the mutex and adds the time spent waiting for it to the histogram.
+ * An uncontended lock costs no clock read. */
+static void mutex_lock_timed(pthread_mutex_t *lock, struct latency_hist *hist)
+{
+    int64_t begin_ns;
+
+    if (pthread_mutex_trylock(lock) == 0) {
+        latency_hist_add(hist, 0);
+        return;
+    }
+    ATRACE_BEGIN("lock wait");
+    begin_ns = get_monotonic_ns();
+    pthread_mutex_lock(lock);
+    latency_hist_add(hist, get_monotonic_ns() - begin_ns);
+    ATRACE_END();
+}
+
+/* Waits for adev_init_thread() to reach the given phase and returns its status.
+ * May be called with the audio_device mutex held. */
+static int adev_wait_for_init(struct audio_device *adev, int phase)
+{
+    int status;
+
+    pthread_mutex_lock(&adev->init_lock);
+    if (adev->init_phase < phase) {
+        ALOGD("%s: waiting for init phase %d", __func__, phase);
+        while (adev->init_phase < phase)
+            pthread_cond_wait(&adev->init_cond, &adev->init_lock);
+    }
+    status = adev->init_status;
+    pthread_mutex_unlock(&adev->init_lock);
+    return status;
+}
 
 static bool is_supported_format(audio_format_t format)
 {
@@ -236,6 +415,107 @@ static bool is_supported_format(audio_format_t format)
     return false;
 }
 
+static uint32_t get_offload_bit_rate(const audio_offload_info_t *info)
+{
+    uint32_t channels;
+
+    if (info->bit_rate != 0)
+        return info->bit_rate;
+
+    /* unknown bit rate: assume the worst case for the codec */
+    if ((info->format & AUDIO_FORMAT_MAIN_MASK) == AUDIO_FORMAT_MP3)
+        return COMPRESS_OFFLOAD_MP3_MAX_BIT_RATE;
+
+    channels = audio_channel_count_from_out_mask(info->channel_mask);
+    if (channels == 0)
+        channels = 2;
+    return info->sample_rate * channels * COMPRESS_OFFLOAD_AAC_BITS_PER_SAMPLE;
+}
+
+/* Reads the fragment limits of the compress device, as tinycompress does to
+ * check codecs: the playback node is opened for writing, the driver refuses
+ * other modes. The compiled limits are used if the driver cannot be queried,
+ * e.g. while another offloaded stream holds the device. */
+static void get_offload_caps(struct snd_compr_caps *caps)
+{
+    char path[32];
+    int err = 0;
+    int fd;
+
+    memset(caps, 0, sizeof(*caps));
+    snprintf(path, sizeof(path), "/dev/snd/comprC%uD%u", COMPRESS_CARD, COMPRESS_DEVICE);
+    fd = open(path, O_WRONLY);
+    if (fd < 0)
+        err = errno;
+    else if (ioctl(fd, SNDRV_COMPRESS_GET_CAPS, caps) != 0)
+        err = errno;
+    else if (caps->min_fragment_size == 0 ||
+             caps->max_fragment_size < caps->min_fragment_size ||
+             caps->min_fragments == 0 || caps->max_fragments < caps->min_fragments)
+        err = EINVAL;
+    if (fd >= 0)
+        close(fd);
+
+    if (err != 0) {
+        ALOGW("%s: cannot read the limits of %s (%s), using defaults", __func__, path,
+              strerror(err));
+        caps->min_fragment_size = COMPRESS_OFFLOAD_MIN_FRAGMENT_SIZE;
+        caps->max_fragment_size = COMPRESS_OFFLOAD_MAX_FRAGMENT_SIZE;
+        caps->min_fragments = COMPRESS_OFFLOAD_NUM_FRAGMENTS;
+        caps->max_fragments = COMPRESS_OFFLOAD_MAX_NUM_FRAGMENTS;
+    }
+}
+
+/* Sizes the DSP buffer from the codec, bit rate and sample rate of an offloaded
+ * stream. Fragments are as long as the latency budget allows so that the AP is
+ * woken up as rarely as possible: the client is signaled when half of the
+ * fragments are free, see offload_wait_for_watermark(). The result is clamped
+ * to the fragment size and count limits reported by the DSP. */
+static void set_offload_buffer_config(struct stream_out *out,
+                                      const audio_offload_info_t *info,
+                                      const struct snd_compr_caps *caps)
+{
+    uint32_t byte_rate = get_offload_bit_rate(info) / 8;
+    uint32_t duration_ms = info->has_video ? COMPRESS_OFFLOAD_VIDEO_FRAGMENT_DURATION_MS :
+                                             COMPRESS_OFFLOAD_FRAGMENT_DURATION_MS;
+    uint32_t target = (uint32_t)((uint64_t)byte_rate * duration_ms / 1000);
+    uint32_t fragment_size = COMPRESS_OFFLOAD_MIN_FRAGMENT_SIZE;
+    uint32_t max_fragment_size = COMPRESS_OFFLOAD_MAX_FRAGMENT_SIZE;
+    uint32_t fragments;
+
+    if (caps->max_fragment_size < max_fragment_size)
+        max_fragment_size = caps->max_fragment_size;
+    while (fragment_size < caps->min_fragment_size)
+        fragment_size <<= 1;
+
+    /* DSP fragments must be a power of 2 */
+    while (fragment_size < target && fragment_size < max_fragment_size)
+        fragment_size <<= 1;
+    if (fragment_size > max_fragment_size)
+        fragment_size = max_fragment_size;
+
+    fragments = COMPRESS_OFFLOAD_MAX_BUFFER_SIZE / fragment_size;
+    if (info->has_video || fragments < COMPRESS_OFFLOAD_NUM_FRAGMENTS)
+        fragments = COMPRESS_OFFLOAD_NUM_FRAGMENTS;
+    else if (fragments > COMPRESS_OFFLOAD_MAX_NUM_FRAGMENTS)
+        fragments = COMPRESS_OFFLOAD_MAX_NUM_FRAGMENTS;
+    if (fragments < caps->min_fragments)
+        fragments = caps->min_fragments;
+    else if (fragments > caps->max_fragments)
+        fragments = caps->max_fragments;
+
+    out->compr_config.fragment_size = fragment_size;
+    out->compr_config.fragments = fragments;
+    out->offload_write_watermark = fragment_size * (fragments / 2);
+    out->offload_byte_rate = byte_rate;
+    out->offload_wakeup_interval_ms = byte_rate == 0 ? 0 :
+            (unsigned int)((uint64_t)out->offload_write_watermark * 1000 / byte_rate);
+
+    ALOGD("%s: format %#x bit rate %u sample rate %u: %u fragments of %u bytes, "
+          "expected wakeup interval %u ms", __func__, info->format, info->bit_rate,
+          info->sample_rate, fragments, fragment_size, out->offload_wakeup_interval_ms);
+}
+
 static int get_snd_codec_id(audio_format_t format)
 {
     int id = 0;
@@ -301,6 +581,9 @@ struct mixer_card *adev_get_mixer_for_card(struct audio_device *adev, int card)
     struct mixer_card *mixer_card;
     struct listnode *node;
 
+    if (card >= 0 && card < MIXER_CARD_MAX)
+        return adev->mixer_cards[card];
+
     list_for_each(node, &adev->mixer_list) {
         mixer_card = node_to_item(node, struct mixer_card, adev_list_node);
         if (mixer_card->card == card)
@@ -314,6 +597,9 @@ struct mixer_card *uc_get_mixer_for_card(struct audio_usecase *usecase, int card
     struct mixer_card *mixer_card;
     struct listnode *node;
 
+    if (card >= 0 && card < MIXER_CARD_MAX)
+        return usecase->mixer_cards[card];
+
     list_for_each(node, &usecase->mixer_list) {
         mixer_card = node_to_item(node, struct mixer_card, uc_list_node[usecase->id]);
         if (mixer_card->card == card)
@@ -322,6 +608,25 @@ struct mixer_card *uc_get_mixer_for_card(struct audio_usecase *usecase, int card
     return NULL;
 }
 
+static void uc_add_mixer_card(struct audio_usecase *usecase, struct mixer_card *mixer_card)
+{
+    list_add_tail(&usecase->mixer_list, &mixer_card->uc_list_node[usecase->id]);
+    if (mixer_card->card >= 0 && mixer_card->card < MIXER_CARD_MAX)
+        usecase->mixer_cards[mixer_card->card] = mixer_card;
+}
+
+static void mixer_route_free(struct mixer_route *route)
+{
+    snd_device_t snd_device;
+
+    if (route == NULL)
+        return;
+    for (snd_device = SND_DEVICE_MIN; snd_device < SND_DEVICE_MAX; snd_device++)
+        free(route->paths[snd_device].settings);
+    free(route->ctls);
+    free(route);
+}
+
 void free_mixer_list(struct audio_device *adev)
 {
     struct mixer_card *mixer_card;
@@ -331,11 +636,415 @@ void free_mixer_list(struct audio_device *adev)
     list_for_each_safe(node, next, &adev->mixer_list) {
         mixer_card = node_to_item(node, struct mixer_card, adev_list_node);
         list_remove(node);
+        if (mixer_card->card >= 0 && mixer_card->card < MIXER_CARD_MAX)
+            adev->mixer_cards[mixer_card->card] = NULL;
+        mixer_route_free(mixer_card->route);
         audio_route_free(mixer_card->audio_route);
         free(mixer_card);
     }
 }
 
+/* Returns the index of the control in route->ctls, adding it if needed. The
+ * reset value is read back from the driver: mixer_paths_start_tag() runs after
+ * audio_route_init() has applied the initial settings of the file. */
+static int mixer_route_get_ctl(struct mixer_route *route, struct mixer *mixer,
+                               const char *name)
+{
+    struct mixer_ctl *ctl;
+    struct mixer_route_ctl *ctls;
+    unsigned int i;
+
+    ctl = mixer_get_ctl_by_name(mixer, name);
+    if (ctl == NULL)
+        return -ENOENT;
+
+    for (i = 0; i < route->num_ctls; i++) {
+        if (route->ctls[i].ctl == ctl)
+            return i;
+    }
+
+    switch (mixer_ctl_get_type(ctl)) {
+    case MIXER_CTL_TYPE_BOOL:
+    case MIXER_CTL_TYPE_INT:
+    case MIXER_CTL_TYPE_ENUM:
+        break;
+    default:
+        ALOGW("%s: unsupported type for control %s", __func__, name);
+        return -EINVAL;
+    }
+
+    ctls = realloc(route->ctls, (route->num_ctls + 1) * sizeof(struct mixer_route_ctl));
+    if (ctls == NULL)
+        return -ENOMEM;
+    route->ctls = ctls;
+
+    ctls[i].ctl = ctl;
+    ctls[i].num_values = mixer_ctl_get_num_values(ctl);
+    ctls[i].reset_value = mixer_ctl_get_value(ctl, 0);
+    ctls[i].cur_value = ctls[i].reset_value;
+    ctls[i].new_value = ctls[i].reset_value;
+    return route->num_ctls++;
+}
+
+/* Enum values are resolved to their index once, here, instead of by string
+ * at every device switch. */
+static int mixer_route_parse_value(struct mixer_ctl *ctl, const char *str, int *value)
+{
+    unsigned int i;
+    const char *enum_str;
+    char *end;
+
+    if (mixer_ctl_get_type(ctl) == MIXER_CTL_TYPE_ENUM) {
+        for (i = 0; i < mixer_ctl_get_num_enums(ctl); i++) {
+            enum_str = mixer_ctl_get_enum_string(ctl, i);
+            if (enum_str != NULL && strcmp(enum_str, str) == 0) {
+                *value = i;
+                return 0;
+            }
+        }
+        return -EINVAL;
+    }
+
+    *value = strtol(str, &end, 0);
+    if (end == str || *end != '\0')
+        return -EINVAL;
+    return 0;
+}
+
+static int mixer_route_path_set(struct mixer_paths_parser *parser,
+                                unsigned int ctl, int value)
+{
+    struct mixer_route_path *path = &parser->path;
+    struct mixer_route_setting *settings;
+    unsigned int i;
+
+    for (i = 0; i < path->num_settings; i++) {
+        if (path->settings[i].ctl == ctl) {
+            path->settings[i].value = value;
+            return 0;
+        }
+    }
+    if (path->num_settings == parser->path_capacity) {
+        settings = realloc(path->settings,
+                           (parser->path_capacity + 8) * sizeof(struct mixer_route_setting));
+        if (settings == NULL)
+            return -ENOMEM;
+        path->settings = settings;
+        parser->path_capacity += 8;
+    }
+    path->settings[path->num_settings].ctl = ctl;
+    path->settings[path->num_settings].value = value;
+    path->num_settings++;
+    return 0;
+}
+
+static snd_device_t mixer_paths_find_device(const char *name)
+{
+    snd_device_t snd_device;
+
+    for (snd_device = SND_DEVICE_MIN; snd_device < SND_DEVICE_MAX; snd_device++) {
+        if (device_table[snd_device] != NULL && strcmp(device_table[snd_device], name) == 0)
+            return snd_device;
+    }
+    return SND_DEVICE_NONE;
+}
+
+static void mixer_paths_compile_ctl(struct mixer_paths_parser *parser,
+                                    const XML_Char **attr)
+{
+    struct mixer_route *route = parser->route;
+    const XML_Char *name = NULL;
+    const XML_Char *value = NULL;
+    int ctl;
+    int val;
+    int i;
+
+    for (i = 0; attr[i]; i += 2) {
+        if (strcmp(attr[i], "name") == 0) {
+            name = attr[i + 1];
+        } else if (strcmp(attr[i], "value") == 0) {
+            value = attr[i + 1];
+        } else {
+            /* per value index settings ("id") are left to audio_route */
+            ALOGW("%s: unsupported attribute %s", __func__, attr[i]);
+            parser->error = -EINVAL;
+            return;
+        }
+    }
+    if (name == NULL || value == NULL) {
+        parser->error = -EINVAL;
+        return;
+    }
+
+    ctl = mixer_route_get_ctl(route, parser->mixer, name);
+    if (ctl == -ENOENT) {
+        /* audio_route skips unknown controls too */
+        ALOGE("%s: control %s not found", __func__, name);
+        return;
+    }
+    if (ctl < 0) {
+        parser->error = ctl;
+        return;
+    }
+    if (mixer_route_parse_value(route->ctls[ctl].ctl, value, &val) != 0) {
+        ALOGE("%s: invalid value %s for control %s", __func__, value, name);
+        parser->error = -EINVAL;
+        return;
+    }
+    parser->error = mixer_route_path_set(parser, ctl, val);
+}
+
+static void mixer_paths_start_tag(void *data, const XML_Char *tag_name,
+                                  const XML_Char **attr)
+{
+    struct mixer_paths_parser *parser = (struct mixer_paths_parser *)data;
+    struct audio_device *adev = parser->adev;
+    struct mixer_route_path *path;
+    const XML_Char *name = NULL;
+    const XML_Char *latency = NULL;
+    snd_device_t snd_device;
+    unsigned int j;
+    int i;
+
+    if (strcmp(tag_name, "ctl") == 0) {
+        /* the initial settings are applied by audio_route_init() */
+        if (parser->route != NULL && parser->error == 0 && parser->path_depth > 0)
+            mixer_paths_compile_ctl(parser, attr);
+        return;
+    }
+
+    if (strcmp(tag_name, "path") != 0)
+        return;
+
+    for (i = 0; attr[i]; i += 2) {
+        if (strcmp(attr[i], "name") == 0)
+            name = attr[i + 1];
+        else if (strcmp(attr[i], "latency_us") == 0)
+            latency = attr[i + 1];
+    }
+
+    parser->path_depth++;
+    if (parser->path_depth == 1)
+        parser->path_device = SND_DEVICE_NONE;
+    if (name == NULL)
+        return;
+
+    if (parser->path_depth > 1) {
+        /* a path included in another one, compiled earlier in the file */
+        if (parser->route == NULL || parser->error != 0)
+            return;
+        snd_device = mixer_paths_find_device(name);
+        if (snd_device == SND_DEVICE_NONE) {
+            ALOGW("%s: cannot include path %s", __func__, name);
+            parser->error = -EINVAL;
+            return;
+        }
+        path = &parser->route->paths[snd_device];
+        for (j = 0; j < path->num_settings && parser->error == 0; j++)
+            parser->error = mixer_route_path_set(parser, path->settings[j].ctl,
+                                                 path->settings[j].value);
+        return;
+    }
+
+    parser->path_device = mixer_paths_find_device(name);
+    parser->path.num_settings = 0;
+
+    if (latency == NULL)
+        return;
+
+    /* several sound devices can share the same path */
+    for (snd_device = SND_DEVICE_MIN; snd_device < SND_DEVICE_MAX; snd_device++) {
+        if (device_table[snd_device] != NULL && strcmp(device_table[snd_device], name) == 0) {
+            adev->snd_dev_latency_us[snd_device] = atoi(latency);
+            ALOGV("%s: snd_device(%d: %s) latency %d us", __func__,
+                  snd_device, name, adev->snd_dev_latency_us[snd_device]);
+        }
+    }
+}
+
+static void mixer_paths_end_tag(void *data, const XML_Char *tag_name)
+{
+    struct mixer_paths_parser *parser = (struct mixer_paths_parser *)data;
+    struct mixer_route *route = parser->route;
+    struct mixer_route_path *path;
+    snd_device_t snd_device;
+    size_t size;
+
+    if (strcmp(tag_name, "path") != 0)
+        return;
+    if (--parser->path_depth > 0)
+        return;
+    if (route == NULL || parser->error != 0 || parser->path_device == SND_DEVICE_NONE)
+        return;
+
+    size = parser->path.num_settings * sizeof(struct mixer_route_setting);
+    for (snd_device = parser->path_device; snd_device < SND_DEVICE_MAX; snd_device++) {
+        if (device_table[snd_device] == NULL ||
+                strcmp(device_table[snd_device], device_table[parser->path_device]) != 0)
+            continue;
+        path = &route->paths[snd_device];
+        free(path->settings);
+        path->settings = NULL;
+        path->num_settings = 0;
+        if (size == 0)
+            continue;
+        path->settings = malloc(size);
+        if (path->settings == NULL) {
+            parser->error = -ENOMEM;
+            return;
+        }
+        memcpy(path->settings, parser->path.settings, size);
+        path->num_settings = parser->path.num_settings;
+    }
+}
+
+/* Reads the mixer paths once at init:
+ * - the codec and amplifier delay of each sound device, from the optional
+ *   latency_us attribute of the <path> elements. audio_route ignores it.
+ * - the control settings of each path, with the controls and enum values
+ *   resolved, so that a device switch only compares integers and writes the
+ *   controls whose value changes. If the file uses something the compiler
+ *   does not handle, the card keeps applying its paths through audio_route. */
+static int mixer_load_paths(struct audio_device *adev, struct mixer_card *mixer_card,
+                            const char *mixer_path)
+{
+    struct mixer_paths_parser parser;
+    struct mixer_route *route;
+    XML_Parser xml_parser;
+    FILE *file;
+    char buf[1024];
+    size_t bytes_read;
+    snd_device_t snd_device;
+    int ret = 0;
+
+    file = fopen(mixer_path, "r");
+    if (file == NULL) {
+        ALOGW("%s: could not open %s", __func__, mixer_path);
+        return -ENOENT;
+    }
+
+    xml_parser = XML_ParserCreate(NULL);
+    if (xml_parser == NULL) {
+        fclose(file);
+        return -ENOMEM;
+    }
+
+    memset(&parser, 0, sizeof(parser));
+    parser.adev = adev;
+    parser.mixer = mixer_card->mixer;
+    parser.route = calloc(1, sizeof(struct mixer_route));
+    parser.path_device = SND_DEVICE_NONE;
+    XML_SetUserData(xml_parser, &parser);
+    XML_SetElementHandler(xml_parser, mixer_paths_start_tag, mixer_paths_end_tag);
+
+    do {
+        bytes_read = fread(buf, 1, sizeof(buf), file);
+        if (XML_Parse(xml_parser, buf, bytes_read, bytes_read == 0) == XML_STATUS_ERROR) {
+            ALOGE("%s: error in %s at line %lu", __func__, mixer_path,
+                  XML_GetCurrentLineNumber(xml_parser));
+            ret = -EINVAL;
+            break;
+        }
+    } while (bytes_read != 0);
+
+    XML_ParserFree(xml_parser);
+    fclose(file);
+    free(parser.path.settings);
+
+    route = parser.route;
+    if (route == NULL || ret != 0 || parser.error != 0) {
+        ALOGW("%s: card %d paths not compiled (%d), using audio_route", __func__,
+              mixer_card->card, ret != 0 ? ret : parser.error);
+        mixer_route_free(route);
+        return ret;
+    }
+
+    for (snd_device = SND_DEVICE_MIN; snd_device < SND_DEVICE_MAX; snd_device++) {
+        if (route->paths[snd_device].num_settings != 0)
+            route->routed[route->num_routed++] = snd_device;
+    }
+    mixer_card->route = route;
+    ALOGV("%s: card %d: %u controls, %u routed devices", __func__,
+          mixer_card->card, route->num_ctls, route->num_routed);
+    return 0;
+}
+
+static void mixer_card_apply_path(struct mixer_card *mixer_card, snd_device_t snd_device,
+                                  const char *snd_device_name, bool enable)
+{
+    if (mixer_card->route != NULL)
+        mixer_card->route->enabled[snd_device] = enable;
+    else if (enable)
+        audio_route_apply_path(mixer_card->audio_route, snd_device_name);
+    else
+        audio_route_reset_path(mixer_card->audio_route, snd_device_name);
+}
+
+/* values of an INT or BOOL control written with a single mixer_ctl_set_array() */
+#define MIXER_ROUTE_MAX_ARRAY_VALUES 16
+
+/* Sets all the values of a control. tinyalsa reads and writes the whole control
+ * for each mixer_ctl_set_value() call, so INT and BOOL controls are written at
+ * once. Enum and larger controls are written value by value. */
+static int mixer_route_ctl_write(struct mixer_route_ctl *ctl, int value)
+{
+    long values[MIXER_ROUTE_MAX_ARRAY_VALUES];
+    unsigned int i;
+
+    if (mixer_ctl_get_type(ctl->ctl) != MIXER_CTL_TYPE_ENUM &&
+            ctl->num_values <= MIXER_ROUTE_MAX_ARRAY_VALUES) {
+        for (i = 0; i < ctl->num_values; i++)
+            values[i] = value;
+        return mixer_ctl_set_array(ctl->ctl, values, ctl->num_values);
+    }
+
+    for (i = 0; i < ctl->num_values; i++) {
+        if (mixer_ctl_set_value(ctl->ctl, i, value) != 0)
+            return -EINVAL;
+    }
+    return 0;
+}
+
+/* Writes the controls whose value differs from the one the enabled paths ask
+ * for, in a single pass. ALSA has no call setting several controls at once. */
+static void mixer_card_update(struct mixer_card *mixer_card)
+{
+    struct mixer_route *route = mixer_card->route;
+    struct mixer_route_ctl *ctl;
+    struct mixer_route_path *path;
+    unsigned int i;
+    unsigned int j;
+
+    if (route == NULL) {
+        audio_route_update_mixer(mixer_card->audio_route);
+        return;
+    }
+
+    for (i = 0; i < route->num_ctls; i++)
+        route->ctls[i].new_value = route->ctls[i].reset_value;
+
+    for (i = 0; i < route->num_routed; i++) {
+        if (!route->enabled[route->routed[i]])
+            continue;
+        path = &route->paths[route->routed[i]];
+        for (j = 0; j < path->num_settings; j++)
+            route->ctls[path->settings[j].ctl].new_value = path->settings[j].value;
+    }
+
+    for (i = 0; i < route->num_ctls; i++) {
+        ctl = &route->ctls[i];
+        if (ctl->new_value == ctl->cur_value)
+            continue;
+        if (mixer_route_ctl_write(ctl, ctl->new_value) != 0) {
+            /* retried at the next update */
+            ALOGE("%s: failed to set %s to %d", __func__,
+                  mixer_ctl_get_name(ctl->ctl), ctl->new_value);
+            continue;
+        }
+        ctl->cur_value = ctl->new_value;
+    }
+}
+
 int mixer_init(struct audio_device *adev)
 {
     int i;
@@ -347,8 +1056,6 @@ int mixer_init(struct audio_device *adev)
     struct mixer_card *mixer_card;
     struct listnode *node;
 
-    list_init(&adev->mixer_list);
-
     for (i = 0; pcm_devices[i] != NULL; i++) {
         card = pcm_devices[i]->card;
         if (adev_get_mixer_for_card(adev, card) == NULL) {
@@ -365,7 +1072,7 @@ int mixer_init(struct audio_device *adev)
                 }
             } while (mixer == NULL);
 
-            sprintf(mixer_path, "/system/etc/mixer_paths_%d.xml", card);
+            snprintf(mixer_path, sizeof(mixer_path), MIXER_PATHS_FILE_FORMAT, card);
             audio_route = audio_route_init(card, mixer_path);
             if (!audio_route) {
                 ALOGE("%s: Failed to init audio route controls for card %d, aborting.",
@@ -376,7 +1083,10 @@ int mixer_init(struct audio_device *adev)
             mixer_card->card = card;
             mixer_card->mixer = mixer;
             mixer_card->audio_route = audio_route;
+            mixer_load_paths(adev, mixer_card, mixer_path);
             list_add_tail(&adev->mixer_list, &mixer_card->adev_list_node);
+            if (card >= 0 && card < MIXER_CARD_MAX)
+                adev->mixer_cards[card] = mixer_card;
         }
     }
 
@@ -409,47 +1119,344 @@ const char *get_snd_device_display_name(snd_device_t snd_device)
     return name;
 }
 
-struct pcm_device_profile *get_pcm_device(usecase_type_t uc_type, audio_devices_t devices)
+/* Configs that can be tuned from PCM_PROFILES_FILE_PATH, by the name attribute
+ * of the <profile> elements. The sound card and device of a profile can be
+ * changed too, its usecase type and audio devices cannot. A config without a PCM
+ * only sets the periods of the PCM of another profile: its rate and channels are
+ * those of the stream and are fixed as well. */
+static const struct {
+    const char *name;
+    struct pcm_device_profile *profile; /* NULL for a config without a PCM */
+    struct pcm_config *config;
+} pcm_profile_names[] = {
+    { "playback_hs", &pcm_device_playback_hs, &pcm_device_playback_hs.config },
+    { "playback_spk", &pcm_device_playback_spk, &pcm_device_playback_spk.config },
+    { "playback_sco", &pcm_device_playback_sco, &pcm_device_playback_sco.config },
+    { "playback_sco_wb", &pcm_device_playback_sco_wb, &pcm_device_playback_sco_wb.config },
+    { "playback_deep_buffer", NULL, &pcm_config_deep_buffer },
+    { "capture", &pcm_device_capture, &pcm_device_capture.config },
+    { "capture_sco", &pcm_device_capture_sco, &pcm_device_capture_sco.config },
+    { "capture_sco_wb", &pcm_device_capture_sco_wb, &pcm_device_capture_sco_wb.config },
+    { "capture_loopback_aec", &pcm_device_capture_loopback_aec,
+      &pcm_device_capture_loopback_aec.config },
+    { "hotword_streaming", &pcm_device_hotword_streaming,
+      &pcm_device_hotword_streaming.config },
+};
+
+static int pcm_profiles_parse_uint(const XML_Char *value, unsigned int *result)
 {
-    int i;
+    char *end;
+    unsigned long val;
 
-    devices &= ~AUDIO_DEVICE_BIT_IN;
-    for (i = 0; pcm_devices[i] != NULL; i++) {
-        if ((pcm_devices[i]->type == uc_type) &&
-                (devices & pcm_devices[i]->devices))
-            break;
-    }
-    return pcm_devices[i];
+    errno = 0;
+    val = strtoul(value, &end, 0);
+    if (errno != 0 || end == value || *end != '\0' || val > INT_MAX)
+        return -EINVAL;
+    *result = val;
+    return 0;
 }
 
-static struct audio_usecase *get_usecase_from_id(struct audio_device *adev,
-                                                   audio_usecase_t uc_id)
+/* Rejects the configs the streams cannot run: the code sizes its buffers from
+ * the channels and periods, and assumes 16 bit samples */
+static int pcm_profiles_check(const char *name, const struct pcm_config *config)
 {
-    struct audio_usecase *usecase;
-    struct listnode *node;
+    unsigned int buffer_size = config->period_size * config->period_count;
 
-    list_for_each(node, &adev->usecase_list) {
-        usecase = node_to_item(node, struct audio_usecase, adev_list_node);
-        if (usecase->id == uc_id)
-            return usecase;
+    if (config->channels < 1 || config->channels > 2 || config->rate < 8000 ||
+            config->rate > 48000 || config->format != PCM_FORMAT_S16_LE) {
+        ALOGE("%s: %s: unsupported format", __func__, name);
+        return -EINVAL;
     }
-    return NULL;
+    if (config->period_size == 0 || config->period_size > 0x10000 ||
+            config->period_count < 2 || config->period_count > 32) {
+        ALOGE("%s: %s: %u periods of %u frames", __func__, name,
+              config->period_count, config->period_size);
+        return -EINVAL;
+    }
+    if (config->start_threshold > buffer_size ||
+            (unsigned int)config->avail_min > buffer_size ||
+            (config->stop_threshold != 0 && config->stop_threshold < buffer_size)) {
+        ALOGE("%s: %s: thresholds out of a %u frames buffer", __func__, name, buffer_size);
+        return -EINVAL;
+    }
+    return 0;
 }
 
-static struct audio_usecase *get_usecase_from_type(struct audio_device *adev,
-                                                        usecase_type_t type)
+/* <profile name="..." card="0" device="1" period_size="256" .../>: attributes
+ * that are not set keep their compiled value. A profile that does not validate
+ * is left untouched as a whole. */
+static void pcm_profiles_parse_profile(struct pcm_profiles_parser *parser,
+                                       const XML_Char **attr)
 {
-    struct audio_usecase *usecase;
-    struct listnode *node;
+    const char *name = NULL;
+    struct pcm_device_profile *profile = NULL;
+    struct pcm_config *target;
+    struct pcm_config config;
+    unsigned int card = 0;
+    unsigned int id = 0;
+    unsigned int avail_min;
+    unsigned int val;
+    unsigned int *field;
+    size_t i;
+
+    for (i = 0; attr[i]; i += 2) {
+        if (strcmp(attr[i], "name") == 0)
+            name = attr[i + 1];
+    }
+    for (i = 0; name != NULL && i < ARRAY_SIZE(pcm_profile_names); i++) {
+        if (strcmp(pcm_profile_names[i].name, name) == 0)
+            break;
+    }
+    if (name == NULL || i == ARRAY_SIZE(pcm_profile_names)) {
+        ALOGE("%s: unknown profile %s", __func__, name != NULL ? name : "(no name)");
+        parser->rejected++;
+        return;
+    }
+    profile = pcm_profile_names[i].profile;
+    target = pcm_profile_names[i].config;
+    config = *target;
+    avail_min = config.avail_min;
+    if (profile != NULL) {
+        card = profile->card;
+        id = profile->id;
+    }
+
+    for (i = 0; attr[i]; i += 2) {
+        field = NULL;
+        if (strcmp(attr[i], "name") == 0)
+            continue;
+        else if (strcmp(attr[i], "card") == 0 && profile != NULL)
+            field = &card;
+        else if (strcmp(attr[i], "device") == 0 && profile != NULL)
+            field = &id;
+        else if (strcmp(attr[i], "channels") == 0 && profile != NULL)
+            field = &config.channels;
+        else if (strcmp(attr[i], "rate") == 0 && profile != NULL)
+            field = &config.rate;
+        else if (strcmp(attr[i], "period_size") == 0)
+            field = &config.period_size;
+        else if (strcmp(attr[i], "period_count") == 0)
+            field = &config.period_count;
+        else if (strcmp(attr[i], "start_threshold") == 0)
+            field = &config.start_threshold;
+        else if (strcmp(attr[i], "stop_threshold") == 0)
+            field = &config.stop_threshold;
+        else if (strcmp(attr[i], "avail_min") == 0)
+            field = &avail_min;
+
+        if (field == NULL || pcm_profiles_parse_uint(attr[i + 1], &val) != 0) {
+            ALOGE("%s: %s: invalid attribute %s=\"%s\"", __func__, name,
+                  attr[i], attr[i + 1]);
+            parser->rejected++;
+            return;
+        }
+        *field = val;
+    }
+    config.avail_min = avail_min;
+
+    if (pcm_profiles_check(name, &config) != 0) {
+        parser->rejected++;
+        return;
+    }
+    *target = config;
+    if (profile != NULL) {
+        profile->card = card;
+        profile->id = id;
+    }
+    parser->loaded++;
+}
+
+static void pcm_profiles_start_tag(void *data, const XML_Char *tag_name,
+                                   const XML_Char **attr)
+{
+    struct pcm_profiles_parser *parser = data;
+    unsigned int version;
+    int i;
+
+    if (strcmp(tag_name, "pcm_profiles") == 0) {
+        for (i = 0; attr[i]; i += 2) {
+            if (strcmp(attr[i], "version") == 0 &&
+                    pcm_profiles_parse_uint(attr[i + 1], &version) == 0)
+                parser->version = version;
+        }
+        if (parser->version != PCM_PROFILES_VERSION)
+            ALOGE("%s: version %d, expected %d: profiles ignored", __func__,
+                  parser->version, PCM_PROFILES_VERSION);
+    } else if (strcmp(tag_name, "profile") == 0 &&
+            parser->version == PCM_PROFILES_VERSION) {
+        pcm_profiles_parse_profile(parser, attr);
+    }
+}
+
+/* Applies the tuning of the PCM device profiles. Called once, before any
+ * stream can read the profiles. A missing file keeps the compiled profiles. */
+static int pcm_profiles_load(const char *path)
+{
+    struct pcm_profiles_parser parser;
+    XML_Parser xml_parser;
+    FILE *file;
+    char buf[1024];
+    size_t bytes_read;
+    int ret = 0;
+
+    file = fopen(path, "r");
+    if (file == NULL) {
+        ALOGV("%s: no %s, using the default profiles", __func__, path);
+        return -ENOENT;
+    }
+
+    xml_parser = XML_ParserCreate(NULL);
+    if (xml_parser == NULL) {
+        fclose(file);
+        return -ENOMEM;
+    }
+
+    memset(&parser, 0, sizeof(parser));
+    parser.version = -1;
+    XML_SetUserData(xml_parser, &parser);
+    XML_SetElementHandler(xml_parser, pcm_profiles_start_tag, NULL);
+
+    do {
+        bytes_read = fread(buf, 1, sizeof(buf), file);
+        if (XML_Parse(xml_parser, buf, bytes_read, bytes_read == 0) == XML_STATUS_ERROR) {
+            ALOGE("%s: error in %s at line %lu", __func__, path,
+                  XML_GetCurrentLineNumber(xml_parser));
+            ret = -EINVAL;
+            break;
+        }
+    } while (bytes_read != 0);
+
+    XML_ParserFree(xml_parser);
+    fclose(file);
+
+    ALOGI("%s: %s version %d: %u profiles tuned, %u rejected", __func__, path,
+          parser.version, parser.loaded, parser.rejected);
+    return ret;
+}
+
+/* Index in pcm_devices[] of the first profile of each usecase type using each
+ * audio device bit, or -1. Built by init_pcm_device_table(). */
+static int8_t pcm_device_table[USECASE_TYPE_MAX][32];
+
+static void init_pcm_device_table(void)
+{
+    int type;
+    int bit;
+    int i;
+
+    memset(pcm_device_table, -1, sizeof(pcm_device_table));
+    for (i = 0; pcm_devices[i] != NULL; i++) {
+        type = ffs(pcm_devices[i]->type) - 1;
+        if (type < 0 || type >= USECASE_TYPE_MAX)
+            continue;
+        for (bit = 0; bit < 32; bit++) {
+            if (((pcm_devices[i]->devices & ~AUDIO_DEVICE_BIT_IN) & (1u << bit)) &&
+                    pcm_device_table[type][bit] < 0)
+                pcm_device_table[type][bit] = i;
+        }
+    }
+}
+
+/* Returns the first profile of pcm_devices[] of the usecase type using any
+ * of the devices */
+struct pcm_device_profile *get_pcm_device(usecase_type_t uc_type, audio_devices_t devices)
+{
+    int type = ffs(uc_type) - 1;
+    int first = -1;
+    int bit;
+    int i;
 
-    list_for_each(node, &adev->usecase_list) {
-        usecase = node_to_item(node, struct audio_usecase, adev_list_node);
-        if (usecase->type & type)
-            return usecase;
+    if (type < 0 || type >= USECASE_TYPE_MAX || uc_type != (usecase_type_t)(1 << type))
+        return NULL;
+
+    devices &= ~AUDIO_DEVICE_BIT_IN;
+    while (devices != 0) {
+        bit = ffs(devices) - 1;
+        devices &= devices - 1;
+        i = pcm_device_table[type][bit];
+        if (i >= 0 && (first < 0 || i < first))
+            first = i;
+    }
+    return first < 0 ? NULL : pcm_devices[first];
+}
+
+/* Returns the wideband variant of a SCO profile when wideband speech is enabled.
+ * must be called with adev->lock locked */
+static struct pcm_device_profile *get_sco_pcm_device(struct audio_device *adev,
+                                                     struct pcm_device_profile *pcm_profile)
+{
+    if (!adev->bt_wb_speech_enabled)
+        return pcm_profile;
+    if (pcm_profile == &pcm_device_playback_sco)
+        return &pcm_device_playback_sco_wb;
+    if (pcm_profile == &pcm_device_capture_sco)
+        return &pcm_device_capture_sco_wb;
+    return pcm_profile;
+}
+
+/* Publishes a control plane change (routing, echo reference, amplifier mode...)
+ * to the output streams. A stream whose cached control_generation matches
+ * adev->control_generation can write to its PCM devices without looking at
+ * any other audio_device state.
+ * Always called with adev lock held or from a thread owning the state it changed.
+ */
+static void publish_control_change(struct audio_device *adev)
+{
+    android_atomic_inc(&adev->control_generation);
+}
+
+static struct audio_usecase *get_usecase_from_id(struct audio_device *adev,
+                                                   audio_usecase_t uc_id)
+{
+    if (uc_id < 0 || uc_id >= AUDIO_USECASE_MAX)
+        return NULL;
+    return adev->usecases[uc_id];
+}
+
+/* Returns a usecase of one of the types set in the type mask, checking
+ * the types in the order of their bits */
+static struct audio_usecase *get_usecase_from_type(struct audio_device *adev,
+                                                        usecase_type_t type)
+{
+    int i;
+
+    for (i = 0; i < USECASE_TYPE_MAX; i++) {
+        if ((type & (1 << i)) && adev->usecase_of_type[i] != NULL)
+            return adev->usecase_of_type[i];
     }
     return NULL;
 }
 
+static void add_usecase_l(struct audio_device *adev, struct audio_usecase *usecase)
+{
+    int type = ffs(usecase->type) - 1;
+
+    list_add_tail(&adev->usecase_list, &usecase->adev_list_node);
+    adev->usecases[usecase->id] = usecase;
+    if (adev->usecase_of_type[type] == NULL)
+        adev->usecase_of_type[type] = usecase;
+}
+
+static void remove_usecase_l(struct audio_device *adev, struct audio_usecase *usecase)
+{
+    int type = ffs(usecase->type) - 1;
+    int i;
+
+    list_remove(&usecase->adev_list_node);
+    adev->usecases[usecase->id] = NULL;
+    if (adev->usecase_of_type[type] != usecase)
+        return;
+
+    /* only on removal: look for another usecase of the same type */
+    adev->usecase_of_type[type] = NULL;
+    for (i = 0; i < AUDIO_USECASE_MAX; i++) {
+        if (adev->usecases[i] != NULL && adev->usecases[i]->type == usecase->type) {
+            adev->usecase_of_type[type] = adev->usecases[i];
+            break;
+        }
+    }
+}
+
 /* always called with adev lock held */
 static int set_voice_volume_l(struct audio_device *adev, float volume)
 {
@@ -706,11 +1713,28 @@ int edid_get_max_channels(struct audio_device *adev)
 }
 
 /* Delay in Us */
-int64_t render_latency(audio_usecase_t usecase)
+int64_t render_latency(struct audio_device *adev, audio_usecase_t usecase)
 {
-    (void)usecase;
-    /* TODO */
-    return 0;
+    return android_atomic_acquire_load(&adev->render_latency_us[usecase]);
+}
+
+/* Calibrates the render latency of a playback usecase when it is routed to a new
+ * output sound device.
+ * always called with adev lock held */
+static void update_render_latency_l(struct audio_device *adev,
+                                    struct audio_usecase *usecase)
+{
+    int32_t latency_us;
+
+    if (usecase->type != PCM_PLAYBACK || usecase->out_snd_device == SND_DEVICE_NONE)
+        return;
+
+    latency_us = usecase_pipeline_latency_us[usecase->id] +
+                 adev->snd_dev_latency_us[usecase->out_snd_device];
+    ALOGV("%s: usecase(%d: %s) snd_device(%s) latency %d us", __func__,
+          usecase->id, use_case_table[usecase->id],
+          get_snd_device_display_name(usecase->out_snd_device), latency_us);
+    android_atomic_release_store(latency_us, &adev->render_latency_us[usecase->id]);
 }
 
 static int enable_snd_device(struct audio_device *adev,
@@ -737,9 +1761,9 @@ static int enable_snd_device(struct audio_device *adev,
 
     list_for_each(node, &uc_info->mixer_list) {
         mixer_card = node_to_item(node, struct mixer_card, uc_list_node[uc_info->id]);
-        audio_route_apply_path(mixer_card->audio_route, snd_device_name);
+        mixer_card_apply_path(mixer_card, snd_device, snd_device_name, true);
         if (update_mixer)
-            audio_route_update_mixer(mixer_card->audio_route);
+            mixer_card_update(mixer_card);
     }
 
     return 0;
@@ -767,9 +1791,9 @@ static int disable_snd_device(struct audio_device *adev,
               snd_device, snd_device_name);
         list_for_each(node, &uc_info->mixer_list) {
             mixer_card = node_to_item(node, struct mixer_card, uc_list_node[uc_info->id]);
-            audio_route_reset_path(mixer_card->audio_route, snd_device_name);
+            mixer_card_apply_path(mixer_card, snd_device, snd_device_name, false);
             if (update_mixer)
-                audio_route_update_mixer(mixer_card->audio_route);
+                mixer_card_update(mixer_card);
         }
     }
     return 0;
@@ -881,11 +1905,13 @@ static int select_devices(struct audio_device *adev,
 
     list_for_each(node, &usecase->mixer_list) {
          mixer_card = node_to_item(node, struct mixer_card, uc_list_node[usecase->id]);
-         audio_route_update_mixer(mixer_card->audio_route);
+         mixer_card_update(mixer_card);
     }
 
     usecase->in_snd_device = in_snd_device;
     usecase->out_snd_device = out_snd_device;
+    update_render_latency_l(adev, usecase);
+    publish_control_change(adev);
 
     if (out_snd_device != SND_DEVICE_NONE)
         if (usecase->devices & (AUDIO_DEVICE_OUT_WIRED_HEADSET | AUDIO_DEVICE_OUT_WIRED_HEADPHONE))
@@ -981,6 +2007,10 @@ static void get_capture_delay(struct stream_in *in,
     kernel_delay = (long)(((int64_t)kernel_frames * 1000000000) / in->config.rate);
 
     delay_ns = kernel_delay + buf_delay + rsmp_delay;
+    /* the headset captured the samples before the SCO link delay */
+    if (pcm_device->pcm_profile->devices & AUDIO_DEVICE_IN_BLUETOOTH_SCO_HEADSET &
+            ~AUDIO_DEVICE_BIT_IN)
+        delay_ns += (long)in->dev->snd_dev_latency_us[SND_DEVICE_IN_BT_SCO_MIC] * 1000;
 
     buffer->time_stamp = tstamp;
     buffer->delay_ns   = delay_ns;
@@ -992,28 +2022,19 @@ static void get_capture_delay(struct stream_in *in,
          in->read_buf_frames, in->proc_buf_frames, frames);
 }
 
-static int32_t update_echo_reference(struct stream_in *in, size_t frames)
+static int64_t update_echo_reference(struct stream_in *in, size_t frames)
 {
     ALOGVV("%s: enter:), in->config.channels(%d)", __func__,in->config.channels);
     struct echo_reference_buffer b;
     b.delay_ns = 0;
-    struct pcm_device *pcm_device;
-
-    pcm_device = node_to_item(list_head(&in->pcm_dev_list),
-                              struct pcm_device, stream_list_node);
 
     ALOGVV("update_echo_reference, in->config.channels(%d), frames = [%zd], in->ref_buf_frames = [%zd],  "
           "b.frame_count = [%zd]",
           in->config.channels, frames, in->ref_buf_frames, frames - in->ref_buf_frames);
+    /* ref_buf is sized in in_alloc_buffers_l() */
+    if (frames > in->ref_buf_size)
+        frames = in->ref_buf_size;
     if (in->ref_buf_frames < frames) {
-        if (in->ref_buf_size < frames) {
-            in->ref_buf_size = frames;
-            in->ref_buf = (int16_t *)realloc(in->ref_buf, pcm_frames_to_bytes(pcm_device->pcm, frames));
-            ALOG_ASSERT((in->ref_buf != NULL),
-                        "update_echo_reference() failed to reallocate ref_buf");
-            ALOGVV("update_echo_reference(): ref_buf %p extended to %d bytes",
-                      in->ref_buf, pcm_frames_to_bytes(pcm_device->pcm, frames));
-        }
         b.frame_count = frames - in->ref_buf_frames;
         b.raw = (void *)(in->ref_buf + in->ref_buf_frames * in->config.channels);
 
@@ -1068,22 +2089,145 @@ static int set_preprocessor_echo_delay(effect_handle_t handle,
     return set_preprocessor_param(handle, &buf.param);
 }
 
+/* Echo reference alignment.
+ * Both reference sources (playback written by out_write() and HW loopback read by
+ * get_next_buffer()) are timestamped with pcm_get_htimestamp() and merged by the
+ * echo_reference module, which reports the echo delay of each block read. When the
+ * reference and capture clocks differ, this delay drifts until the module slips
+ * frames and the AEC has to converge again. The drift is tracked by a PI loop on the
+ * low-passed alignment error (reported delay minus the delay when the reference was
+ * locked) and the reference is resampled by the resulting ratio to hold the delay
+ * steady. */
+static void echo_ref_sync_reset(struct echo_ref_sync *sync)
+{
+    sync->locked = false;
+    sync->target_delay_ns = 0;
+    sync->error_ns = 0;
+    sync->max_error_ns = 0;
+    sync->drift = 0;
+    sync->ratio = 1.0f;
+    sync->phase = 0;
+    sync->relocks = 0;
+}
+
+/* Number of reference frames needed to produce frames at the current ratio */
+static size_t echo_ref_sync_input_frames(const struct echo_ref_sync *sync, size_t frames)
+{
+    return (size_t)(sync->phase + frames * sync->ratio) + 2;
+}
+
+/* elapsed_ns: capture time covered since the previous update */
+static void echo_ref_sync_update(struct echo_ref_sync *sync, int64_t delay_ns,
+                                 int64_t elapsed_ns)
+{
+    int64_t error_ns;
+    float elapsed_s;
+    float error_s;
+    float correction;
+
+    if (delay_ns == 0)
+        return;
+
+    if (!sync->locked) {
+        sync->target_delay_ns = delay_ns;
+        sync->error_ns = 0;
+        sync->locked = true;
+        return;
+    }
+
+    error_ns = delay_ns - sync->target_delay_ns;
+    if (error_ns > ECHO_REF_SYNC_RELOCK_NS || error_ns < -ECHO_REF_SYNC_RELOCK_NS) {
+        /* the reference was interrupted or slipped: start again from this delay */
+        ALOGV("%s: relock, alignment error %lld us", __func__, (long long)(error_ns / 1000));
+        sync->target_delay_ns = delay_ns;
+        sync->error_ns = 0;
+        sync->drift = 0;
+        sync->ratio = 1.0f;
+        sync->relocks++;
+        return;
+    }
+
+    if (llabs(error_ns) > sync->max_error_ns)
+        sync->max_error_ns = llabs(error_ns);
+    sync->error_ns += (error_ns - sync->error_ns) * elapsed_ns /
+            (ECHO_REF_SYNC_FILTER_NS + elapsed_ns);
+
+    /* a growing delay means the reference is consumed too slowly */
+    error_s = (float)sync->error_ns / 1000000000.0f;
+    elapsed_s = (float)elapsed_ns / 1000000000.0f;
+    sync->drift += ECHO_REF_SYNC_KI * error_s * elapsed_s;
+    if (sync->drift > ECHO_REF_SYNC_MAX_DRIFT)
+        sync->drift = ECHO_REF_SYNC_MAX_DRIFT;
+    else if (sync->drift < -ECHO_REF_SYNC_MAX_DRIFT)
+        sync->drift = -ECHO_REF_SYNC_MAX_DRIFT;
+
+    correction = sync->drift + ECHO_REF_SYNC_KP * error_s;
+    if (correction > ECHO_REF_SYNC_MAX_DRIFT)
+        correction = ECHO_REF_SYNC_MAX_DRIFT;
+    else if (correction < -ECHO_REF_SYNC_MAX_DRIFT)
+        correction = -ECHO_REF_SYNC_MAX_DRIFT;
+    sync->ratio = 1.0f + correction;
+}
+
+/* Linear interpolation of src into dst at sync->ratio source frames per output frame.
+ * Returns the number of frames produced and the number consumed in *consumed */
+static size_t echo_ref_sync_resample(struct echo_ref_sync *sync,
+                                     const int16_t *src, size_t src_frames,
+                                     int16_t *dst, size_t dst_frames,
+                                     size_t channels, size_t *consumed)
+{
+    float pos = sync->phase;
+    size_t produced;
+    size_t idx;
+    size_t c;
+
+    for (produced = 0; produced < dst_frames; produced++) {
+        const int16_t *s0;
+        float frac;
+
+        idx = (size_t)pos;
+        if (idx + 1 >= src_frames)
+            break;
+        frac = pos - idx;
+        s0 = src + idx * channels;
+        for (c = 0; c < channels; c++)
+            *dst++ = (int16_t)(s0[c] + frac * (s0[channels + c] - s0[c]));
+        pos += sync->ratio;
+    }
+
+    idx = (size_t)pos;
+    if (idx > src_frames)
+        idx = src_frames;
+    sync->phase = pos - (size_t)pos;
+    *consumed = idx;
+    return produced;
+}
+
 static void push_echo_reference(struct stream_in *in, size_t frames)
 {
     ALOGVV("%s: enter:)", __func__);
     /* read frames from echo reference buffer and update echo delay
      * in->ref_buf_frames is updated with frames available in in->ref_buf */
 
-    int32_t delay_us = update_echo_reference(in, frames)/1000;
-    int32_t size_in_bytes = 0;
+    size_t frames_in = echo_ref_sync_input_frames(&in->echo_ref_sync,
+                                                  frames > in->ref_out_size ?
+                                                        in->ref_out_size : frames);
+    int64_t delay_ns = update_echo_reference(in, frames_in);
+    int32_t delay_us = delay_ns / 1000;
+    size_t consumed;
     int i;
     audio_buffer_t buf;
 
-    if (in->ref_buf_frames < frames)
-        frames = in->ref_buf_frames;
+    echo_ref_sync_update(&in->echo_ref_sync, delay_ns,
+                         (int64_t)frames * 1000000000 / in->config.rate);
 
-    buf.frameCount = frames;
-    buf.raw = in->ref_buf;
+    if (frames > in->ref_out_size)
+        frames = in->ref_out_size;
+
+    buf.frameCount = echo_ref_sync_resample(&in->echo_ref_sync, in->ref_buf, in->ref_buf_frames,
+                                            in->ref_out_buf, frames, in->config.channels,
+                                            &consumed);
+    buf.raw = in->ref_out_buf;
 
     for (i = 0; i < in->num_preprocessors; i++) {
         if ((*in->preprocessors[i].effect_itfe)->process_reverse == NULL)
@@ -1096,13 +2240,13 @@ static void push_echo_reference(struct stream_in *in, size_t frames)
         set_preprocessor_echo_delay(in->preprocessors[i].effect_itfe, delay_us);
     }
 
-    in->ref_buf_frames -= buf.frameCount;
+    in->ref_buf_frames -= consumed;
     ALOGVV("%s: in->ref_buf_frames(%zd), in->config.channels(%d) ",
            __func__, in->ref_buf_frames, in->config.channels);
     if (in->ref_buf_frames) {
-        memcpy(in->ref_buf,
-               in->ref_buf + buf.frameCount * in->config.channels,
-               in->ref_buf_frames * in->config.channels * sizeof(int16_t));
+        memmove(in->ref_buf,
+                in->ref_buf + consumed * in->config.channels,
+                in->ref_buf_frames * in->config.channels * sizeof(int16_t));
     }
 }
 
@@ -1119,6 +2263,7 @@ static void put_echo_reference(struct audio_device *adev,
          * for voice use cases */
         adev->echo_reference = NULL;
         android_atomic_inc(&adev->echo_reference_generation);
+        publish_control_change(adev);
         if (out != NULL && out->usecase == USECASE_AUDIO_PLAYBACK) {
             // if the primary output is in standby or did not pick the echo reference yet
             // we can safely get rid of it here.
@@ -1156,8 +2301,10 @@ static struct echo_reference_itfe *get_echo_reference(struct audio_device *adev,
                                            wr_channel_count,
                                            wr_sampling_rate,
                                            &adev->echo_reference);
-        if (status == 0)
+        if (status == 0) {
             android_atomic_inc(&adev->echo_reference_generation);
+            publish_control_change(adev);
+        }
     }
     return adev->echo_reference;
 }
@@ -1166,6 +2313,7 @@ static struct echo_reference_itfe *get_echo_reference(struct audio_device *adev,
 static int get_hw_echo_reference(struct stream_in *in)
 {
     struct pcm_device_profile *ref_pcm_profile;
+    struct pcm_config ref_config;
     struct pcm_device *ref_device;
     struct audio_device *adev = in->dev;
 
@@ -1184,17 +2332,16 @@ static int get_hw_echo_reference(struct stream_in *in)
             return -EINVAL;
         }
 
-        if (in->input_flags & AUDIO_INPUT_FLAG_FAST) {
-            ALOGV("%s: change capture period size to low latency size %d",
-                  __func__, CAPTURE_PERIOD_SIZE_LOW_LATENCY);
-            ref_pcm_profile->config.period_size = CAPTURE_PERIOD_SIZE_LOW_LATENCY;
-        }
+        /* the reference is read one period at a time along with the capture */
+        ref_config = ref_pcm_profile->config;
+        ref_config.period_size = in->config.period_size;
+        ref_config.period_count = in->config.period_count;
 
         ref_device = (struct pcm_device *)calloc(1, sizeof(struct pcm_device));
         ref_device->pcm_profile = ref_pcm_profile;
 
         ALOGV("%s: ref_device rate:%d, ch:%d", __func__, ref_pcm_profile->config.rate, ref_pcm_profile->config.channels);
-        ref_device->pcm = pcm_open(ref_device->pcm_profile->card, ref_device->pcm_profile->id, PCM_IN | PCM_MONOTONIC, &ref_device->pcm_profile->config);
+        ref_device->pcm = pcm_open(ref_device->pcm_profile->card, ref_device->pcm_profile->id, PCM_IN | PCM_MONOTONIC, &ref_config);
 
         if (ref_device->pcm && !pcm_is_ready(ref_device->pcm)) {
            ALOGE("%s: %s", __func__, pcm_get_error(ref_device->pcm));
@@ -1239,9 +2386,14 @@ static int get_playback_delay(struct stream_out *out,
 
     /* adjust render time stamp with delay added by current driver buffer.
      * Add the duration of current frame as we want the render time of the last
-     * sample being written. */
-    buffer->delay_ns = (long)(((int64_t)(kernel_frames + frames)* 1000000000)/
-                            out->config.rate);
+     * sample being written. The driver buffer runs at the PCM rate, which
+     * differs from the stream rate on SCO. */
+    buffer->delay_ns = (long)(((int64_t)kernel_frames * 1000000000) /
+                            pcm_device->pcm_profile->config.rate +
+                            ((int64_t)frames * 1000000000) / out->config.rate);
+    /* the headset plays the samples after the SCO link delay */
+    if (pcm_device->pcm_profile->devices & AUDIO_DEVICE_OUT_ALL_SCO)
+        buffer->delay_ns += (long)out->dev->snd_dev_latency_us[SND_DEVICE_OUT_BT_SCO] * 1000;
     ALOGVV("get_playback_delay_time_stamp Secs: [%10ld], nSecs: [%9ld], kernel_frames: [%5u], delay_ns: [%d],",
          buffer->time_stamp.tv_sec, buffer->time_stamp.tv_nsec, kernel_frames, buffer->delay_ns);
 
@@ -1537,6 +2689,125 @@ static void in_update_aux_channels(struct stream_in *in,
 }
 #endif
 
+#ifdef PREPROCESSING_ENABLED
+/* Runs the block in in->proc_buf_in through the capture effects in order. Each
+ * effect writes to its own buffer, which is the input of the next one. An effect
+ * returning -ENODATA belongs to a session that is processed as a whole when a
+ * later effect of the same library is called (as the platform pre-processing
+ * library does): its output buffer is left untouched and the next effect gets
+ * the same input. The output of the last effect that produced frames is handed
+ * out by read_and_process_frames() from in->proc_out_buf.
+ * must be called with in->lock locked */
+static void process_effect_chain_l(struct stream_in *in)
+{
+    audio_buffer_t in_buf;
+    audio_buffer_t out_buf;
+    int16_t *stage_in = in->proc_buf_in;
+    size_t stage_frames = in->proc_buf_frames;
+    size_t consumed = in->proc_buf_frames;
+    bool produced = false;
+    int ret;
+    int i;
+
+    for (i = 0; i < in->num_preprocessors; i++) {
+        /* in_buf.frameCount and out_buf.frameCount indicate respectively
+         * the maximum number of frames to be consumed and produced by process() */
+        in_buf.frameCount = stage_frames;
+        in_buf.s16 = stage_in;
+        out_buf.frameCount = in->proc_block_frames;
+        out_buf.s16 = in->proc_stage_buf[i];
+
+        ret = (*in->preprocessors[i].effect_itfe)->process(in->preprocessors[i].effect_itfe,
+                                                           &in_buf,
+                                                           &out_buf);
+        if (ret != 0 && ret != -ENODATA) {
+            ALOGW("%s: preproc %d error %d, bypassed", __func__, i, ret);
+            continue;
+        }
+        if (stage_in == in->proc_buf_in)
+            consumed = in_buf.frameCount;
+        if (ret == 0 && out_buf.frameCount != 0) {
+            stage_in = out_buf.s16;
+            stage_frames = out_buf.frameCount;
+            produced = true;
+        }
+    }
+
+    if (consumed == 0) {
+        /* The effect does not comply to the API: drop the block rather than spin */
+        ALOGE("%s: no frames consumed by preproc, dropping %zu frames",
+              __func__, in->proc_buf_frames);
+        consumed = in->proc_buf_frames;
+    }
+    in->proc_buf_frames -= consumed;
+    if (in->proc_buf_frames != 0) {
+        ALOGW("%s: preproc consumed %zu frames out of %zu", __func__, consumed,
+              consumed + in->proc_buf_frames);
+        memmove(in->proc_buf_in,
+                in->proc_buf_in + consumed * in->config.channels,
+                in->proc_buf_frames * in->config.channels * sizeof(int16_t));
+    }
+
+    if (!produced) {
+        ALOGW("No frames produced by preproc");
+        return;
+    }
+    in->proc_out_buf = stage_in;
+    in->proc_out_frames = stage_frames;
+}
+#endif
+
+/* Copies the first dst_channels of each frame of src to dst. The 2 to 1 and
+ * 4 to 2 channel layouts produced by the capture paths are vectorized.
+ * Not static: the host bench measures it. */
+void extract_main_channels(int16_t *dst, const int16_t *src, size_t frames,
+                           size_t src_channels, size_t dst_channels)
+{
+    size_t i;
+    size_t c;
+
+#if defined(__ARM_NEON__) || defined(__aarch64__)
+    if (src_channels == 2 && dst_channels == 1) {
+        for (; frames >= 8; frames -= 8) {
+            int16x8x2_t v = vld2q_s16(src);
+            vst1q_s16(dst, v.val[0]);
+            src += 16;
+            dst += 8;
+        }
+    } else if (src_channels == 4 && dst_channels == 2) {
+        for (; frames >= 8; frames -= 8) {
+            int16x8x4_t v = vld4q_s16(src);
+            int16x8x2_t out = { { v.val[0], v.val[1] } };
+            vst2q_s16(dst, out);
+            src += 32;
+            dst += 16;
+        }
+    }
+#endif
+
+    /* remaining frames, or layouts without a vector kernel */
+    if (dst_channels == 1) {
+        for (i = 0; i < frames; i++) {
+            *dst++ = *src;
+            src += src_channels;
+        }
+    } else if (dst_channels == 2) {
+        for (i = 0; i < frames; i++) {
+            dst[0] = src[0];
+            dst[1] = src[1];
+            dst += 2;
+            src += src_channels;
+        }
+    } else {
+        for (i = 0; i < frames; i++) {
+            for (c = 0; c < dst_channels; c++)
+                dst[c] = src[c];
+            dst += dst_channels;
+            src += src_channels;
+        }
+    }
+}
+
 /* This function reads PCM data and:
  * - resample if needed
  * - process if pre-processors are attached
@@ -1549,7 +2820,6 @@ static ssize_t read_and_process_frames(struct stream_in *in, void* buffer, ssize
     audio_buffer_t out_buf;
     size_t src_channels = in->config.channels;
     size_t dst_channels = audio_channel_count_from_in_mask(in->main_channels);
-    int i;
     void *proc_buf_out;
     struct pcm_device *pcm_device;
     bool has_additional_channels = (dst_channels != src_channels) ? true : false;
@@ -1562,9 +2832,12 @@ static ssize_t read_and_process_frames(struct stream_in *in, void* buffer, ssize
     * - extra channels due to HW limitations
     * In case of additional channels, we cannot work inplace
     */
-    if (has_additional_channels)
+    if (has_additional_channels) {
+        /* in_read() splits requests into chunks that fit in proc_buf_out */
+        if ((size_t)frames > in->proc_buf_size)
+            frames = in->proc_buf_size;
         proc_buf_out = in->proc_buf_out;
-    else
+    } else
         proc_buf_out = buffer;
 
     if (list_empty(&in->pcm_dev_list)) {
@@ -1579,99 +2852,51 @@ static ssize_t read_and_process_frames(struct stream_in *in, void* buffer, ssize
     if (has_processing) {
         /* since all the processing below is done in frames and using the config.channels
          * as the number of channels, no changes is required in case aux_channels are present */
+
         while (frames_wr < frames) {
-            /* first reload enough frames at the end of process input buffer */
-            if (in->proc_buf_frames < (size_t)frames) {
+            /* first hand out the frames left over from the last processed block */
+            if (in->proc_out_frames != 0) {
+                size_t frames_cp = in->proc_out_frames;
+
+                if (frames_cp > (size_t)(frames - frames_wr))
+                    frames_cp = frames - frames_wr;
+                memcpy((int16_t *)proc_buf_out + frames_wr * in->config.channels,
+                       in->proc_out_buf,
+                       frames_cp * in->config.channels * sizeof(int16_t));
+                in->proc_out_buf += frames_cp * in->config.channels;
+                in->proc_out_frames -= frames_cp;
+                frames_wr += frames_cp;
+                continue;
+            }
+
+            /* then complete the input block */
+            if (in->proc_buf_frames < in->proc_block_frames) {
                 ssize_t frames_rd;
-                if (in->proc_buf_size < (size_t)frames) {
-                    size_t size_in_bytes = pcm_frames_to_bytes(pcm_device->pcm, frames);
-                    in->proc_buf_size = (size_t)frames;
-                    in->proc_buf_in = (int16_t *)realloc(in->proc_buf_in, size_in_bytes);
-                    ALOG_ASSERT((in->proc_buf_in != NULL),
-                                "process_frames() failed to reallocate proc_buf_in");
-                    if (has_additional_channels) {
-                        in->proc_buf_out = (int16_t *)realloc(in->proc_buf_out, size_in_bytes);
-                        ALOG_ASSERT((in->proc_buf_out != NULL),
-                                    "process_frames() failed to reallocate proc_buf_out");
-                        proc_buf_out = in->proc_buf_out;
-                    }
-                }
+
                 frames_rd = read_frames(in,
                                         in->proc_buf_in +
                                             in->proc_buf_frames * in->config.channels,
-                                        frames - in->proc_buf_frames);
-                  if (frames_rd < 0) {
+                                        in->proc_block_frames - in->proc_buf_frames);
+                if (frames_rd < 0) {
                     /* Return error code */
                     frames_wr = frames_rd;
                     break;
                 }
                 in->proc_buf_frames += frames_rd;
+                continue;
             }
 
             if (in->echo_reference != NULL) {
                 push_echo_reference(in, in->proc_buf_frames);
             }
 
-             /* in_buf.frameCount and out_buf.frameCount indicate respectively
-              * the maximum number of frames to be consumed and produced by process() */
-            in_buf.frameCount = in->proc_buf_frames;
-            in_buf.s16 = in->proc_buf_in;
-            out_buf.frameCount = frames - frames_wr;
-            out_buf.s16 = (int16_t *)proc_buf_out + frames_wr * in->config.channels;
-
-            /* FIXME: this works because of current pre processing library implementation that
-             * does the actual process only when the last enabled effect process is called.
-             * The generic solution is to have an output buffer for each effect and pass it as
-             * input to the next.
-             */
-            for (i = 0; i < in->num_preprocessors; i++) {
-                (*in->preprocessors[i].effect_itfe)->process(in->preprocessors[i].effect_itfe,
-                                                   &in_buf,
-                                                   &out_buf);
-            }
-
-            /* process() has updated the number of frames consumed and produced in
-             * in_buf.frameCount and out_buf.frameCount respectively
-             * move remaining frames to the beginning of in->proc_buf_in */
-            in->proc_buf_frames -= in_buf.frameCount;
-
-            if (in->proc_buf_frames) {
-                memcpy(in->proc_buf_in,
-                       in->proc_buf_in + in_buf.frameCount * in->config.channels,
-                       in->proc_buf_frames * in->config.channels * sizeof(int16_t));
-            }
-
-            /* if not enough frames were passed to process(), read more and retry. */
-            if (out_buf.frameCount == 0) {
-                ALOGW("No frames produced by preproc");
-                continue;
-            }
-
-            if ((frames_wr + (ssize_t)out_buf.frameCount) <= frames) {
-                frames_wr += out_buf.frameCount;
-            } else {
-                /* The effect does not comply to the API. In theory, we should never end up here! */
-                ALOGE("preprocessing produced too many frames: %d + %zd  > %d !",
-                      (unsigned int)frames_wr, out_buf.frameCount, (unsigned int)frames);
-                frames_wr = frames;
-            }
+            process_effect_chain_l(in);
         }
     }
     else
 #endif //PREPROCESSING_ENABLED
     {
         /* No processing effects attached */
-        if (has_additional_channels) {
-            /* With additional channels, we cannot use original buffer */
-            if (in->proc_buf_size < (size_t)frames) {
-                size_t size_in_bytes = pcm_frames_to_bytes(pcm_device->pcm, frames);
-                in->proc_buf_size = (size_t)frames;
-                in->proc_buf_out = (int16_t *)realloc(in->proc_buf_out, size_in_bytes);
-                ALOG_ASSERT((in->proc_buf_out != NULL),
-                            "process_frames() failed to reallocate proc_buf_out");
-                proc_buf_out = in->proc_buf_out;
-            }
-        }
         frames_wr = read_frames(in, proc_buf_out, frames);
     }
 
@@ -1681,28 +2906,477 @@ static ssize_t read_and_process_frames(struct stream_in *in, void* buffer, ssize
      * Assumption is made that the channels are interleaved and that the main
      * channels are first. */
 
-    if (has_additional_channels)
-    {
-        int16_t* src_buffer = (int16_t *)proc_buf_out;
-        int16_t* dst_buffer = (int16_t *)buffer;
-
-        if (dst_channels == 1) {
-            for (i = frames_wr; i > 0; i--)
-            {
-                *dst_buffer++ = *src_buffer;
-                src_buffer += src_channels;
-            }
-        } else {
-            for (i = frames_wr; i > 0; i--)
-            {
-                memcpy(dst_buffer, src_buffer, dst_channels*sizeof(int16_t));
-                dst_buffer += dst_channels;
-                src_buffer += src_channels;
+    if (has_additional_channels && frames_wr > 0)
+        extract_main_channels((int16_t *)buffer, (const int16_t *)proc_buf_out,
+                              frames_wr, src_channels, dst_channels);
+
+    return frames_wr;
+}
+
+/* Voice resampler.
+ * SCO links run at 8 kHz, or 16 kHz with wideband speech, while streams usually run
+ * at 48 kHz. These integer ratios are converted by a polyphase FIR instead of the
+ * generic resampler: the Kaiser windowed sinc prototype is split in one branch per
+ * output phase, so each output sample costs taps multiply-adds and no sample is
+ * stuffed or discarded. It implements resampler_itfe so that the stream paths use
+ * it unchanged, and must be released with release_stream_resampler(). */
+
+static double voice_resampler_bessel_i0(double x)
+{
+    double sum = 1.0;
+    double term = 1.0;
+    int k;
+
+    for (k = 1; k < 32; k++) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+/* Builds the prototype low pass at in_rate * up, cut off at the lowest Nyquist
+ * frequency, with a gain of up so that interpolation keeps the level. */
+static int voice_resampler_init_coefs(struct voice_resampler *rsmp)
+{
+    uint32_t ratio = rsmp->up > rsmp->down ? rsmp->up : rsmp->down;
+    uint32_t len = rsmp->up * rsmp->taps;
+    double fc = 0.5 / ratio;
+    double center = (len - 1) / 2.0;
+    double i0_beta = voice_resampler_bessel_i0(VOICE_RESAMPLER_KAISER_BETA);
+    double *proto;
+    double sum = 0;
+    double t, r;
+    uint32_t n, phase, k;
+    long c;
+
+    proto = (double *)malloc(len * sizeof(double));
+    if (proto == NULL)
+        return -ENOMEM;
+    for (n = 0; n < len; n++) {
+        t = n - center;
+        proto[n] = t == 0 ? 2 * fc : sin(2 * M_PI * fc * t) / (M_PI * t);
+        r = t / (center + 0.5);
+        proto[n] *= voice_resampler_bessel_i0(VOICE_RESAMPLER_KAISER_BETA *
+                                              sqrt(1.0 - r * r)) / i0_beta;
+        sum += proto[n];
+    }
+    /* output phase p of input frame x[i] uses proto[p + k * up] on x[i - k] */
+    for (phase = 0; phase < rsmp->up; phase++) {
+        for (k = 0; k < rsmp->taps; k++) {
+            c = lrint(proto[phase + k * rsmp->up] * rsmp->up / sum * (1 << 14));
+            if (c > INT16_MAX)
+                c = INT16_MAX;
+            else if (c < INT16_MIN)
+                c = INT16_MIN;
+            rsmp->coefs[phase * rsmp->taps + k] = (int16_t)c;
+        }
+    }
+    free(proto);
+    return 0;
+}
+
+static void voice_resampler_reset(struct resampler_itfe *resampler)
+{
+    struct voice_resampler *rsmp = (struct voice_resampler *)resampler;
+
+    memset(rsmp->hist, 0, rsmp->channels * 2 * rsmp->taps * sizeof(int16_t));
+    rsmp->hist_pos = 0;
+    rsmp->phase = 0;
+    rsmp->pending = 1;
+}
+
+/* Converts from in_frames input frames as long as out_frames allows: returns the
+ * number of input frames consumed and updates *out_frames */
+static size_t voice_resampler_process(struct voice_resampler *rsmp, const int16_t *in,
+                                      size_t in_frames, int16_t *out, size_t *out_frames)
+{
+    uint32_t taps = rsmp->taps;
+    uint32_t channels = rsmp->channels;
+    size_t in_used = 0;
+    size_t out_done = 0;
+    const int16_t *coefs;
+    const int16_t *hist;
+    int32_t acc;
+    uint32_t ch, k;
+
+    while (out_done < *out_frames) {
+        while (rsmp->pending != 0) {
+            if (in_used == in_frames)
+                goto exit;
+            rsmp->hist_pos = (rsmp->hist_pos + taps - 1) % taps;
+            for (ch = 0; ch < channels; ch++) {
+                int16_t *ch_hist = rsmp->hist + ch * 2 * taps;
+                ch_hist[rsmp->hist_pos] = in[in_used * channels + ch];
+                ch_hist[rsmp->hist_pos + taps] = in[in_used * channels + ch];
             }
+            in_used++;
+            rsmp->pending--;
         }
+
+        coefs = rsmp->coefs + rsmp->phase * taps;
+        for (ch = 0; ch < channels; ch++) {
+            hist = rsmp->hist + ch * 2 * taps + rsmp->hist_pos;
+            acc = 1 << 13;
+            for (k = 0; k < taps; k++)
+                acc += coefs[k] * hist[k];
+            acc >>= 14;
+            out[out_done * channels + ch] = acc > INT16_MAX ? INT16_MAX :
+                                            acc < INT16_MIN ? INT16_MIN : acc;
+        }
+        out_done++;
+
+        rsmp->phase += rsmp->down;
+        rsmp->pending = rsmp->phase / rsmp->up;
+        rsmp->phase %= rsmp->up;
     }
+exit:
+    *out_frames = out_done;
+    return in_used;
+}
 
-    return frames_wr;
+static int voice_resampler_resample_from_input(struct resampler_itfe *resampler,
+                                               int16_t *in, size_t *inFrameCount,
+                                               int16_t *out, size_t *outFrameCount)
+{
+    struct voice_resampler *rsmp = (struct voice_resampler *)resampler;
+
+    if (in == NULL || out == NULL || inFrameCount == NULL || outFrameCount == NULL)
+        return -EINVAL;
+    *inFrameCount = voice_resampler_process(rsmp, in, *inFrameCount, out, outFrameCount);
+    return 0;
+}
+
+static int voice_resampler_resample_from_provider(struct resampler_itfe *resampler,
+                                                  int16_t *out, size_t *outFrameCount)
+{
+    struct voice_resampler *rsmp = (struct voice_resampler *)resampler;
+    struct resampler_buffer buf;
+    size_t out_done = 0;
+    size_t out_frames;
+
+    if (rsmp->provider == NULL || out == NULL || outFrameCount == NULL)
+        return -EINVAL;
+
+    while (out_done < *outFrameCount) {
+        out_frames = *outFrameCount - out_done;
+        buf.frame_count = rsmp->pending + (out_frames - 1) * rsmp->down / rsmp->up + 1;
+        rsmp->provider->get_next_buffer(rsmp->provider, &buf);
+        if (buf.raw == NULL || buf.frame_count == 0)
+            break;
+        buf.frame_count = voice_resampler_process(rsmp, buf.i16, buf.frame_count,
+                                                  out + out_done * rsmp->channels,
+                                                  &out_frames);
+        rsmp->provider->release_buffer(rsmp->provider, &buf);
+        out_done += out_frames;
+    }
+    *outFrameCount = out_done;
+    return 0;
+}
+
+static int32_t voice_resampler_delay_ns(struct resampler_itfe *resampler)
+{
+    struct voice_resampler *rsmp = (struct voice_resampler *)resampler;
+
+    /* group delay of the prototype filter, at in_rate * up */
+    return (int32_t)((int64_t)(rsmp->up * rsmp->taps - 1) * 1000000000 /
+                     (2 * (int64_t)rsmp->in_rate * rsmp->up));
+}
+
+static bool voice_resampler_supported(uint32_t in_rate, uint32_t out_rate)
+{
+    uint32_t low = in_rate < out_rate ? in_rate : out_rate;
+    uint32_t high = in_rate < out_rate ? out_rate : in_rate;
+
+    return low != 0 && high % low == 0 && high / low <= VOICE_RESAMPLER_MAX_RATIO;
+}
+
+static int create_voice_resampler(uint32_t in_rate, uint32_t out_rate, uint32_t channels,
+                                  struct resampler_buffer_provider *provider,
+                                  struct resampler_itfe **resampler)
+{
+    struct voice_resampler *rsmp;
+    uint32_t ratio;
+
+    if (!voice_resampler_supported(in_rate, out_rate) || channels == 0)
+        return -EINVAL;
+
+    rsmp = (struct voice_resampler *)calloc(1, sizeof(struct voice_resampler));
+    if (rsmp == NULL)
+        return -ENOMEM;
+    rsmp->itfe.reset = voice_resampler_reset;
+    rsmp->itfe.resample_from_provider = voice_resampler_resample_from_provider;
+    rsmp->itfe.resample_from_input = voice_resampler_resample_from_input;
+    rsmp->itfe.delay_ns = voice_resampler_delay_ns;
+    rsmp->provider = provider;
+    rsmp->in_rate = in_rate;
+    rsmp->channels = channels;
+    if (out_rate >= in_rate) {
+        rsmp->up = out_rate / in_rate;
+        rsmp->down = 1;
+    } else {
+        rsmp->up = 1;
+        rsmp->down = in_rate / out_rate;
+    }
+    ratio = rsmp->up > rsmp->down ? rsmp->up : rsmp->down;
+    rsmp->taps = VOICE_RESAMPLER_TAPS * ratio / rsmp->up;
+    rsmp->coefs = (int16_t *)malloc(rsmp->up * rsmp->taps * sizeof(int16_t));
+    rsmp->hist = (int16_t *)malloc(channels * 2 * rsmp->taps * sizeof(int16_t));
+    if (rsmp->coefs == NULL || rsmp->hist == NULL ||
+            voice_resampler_init_coefs(rsmp) != 0) {
+        free(rsmp->coefs);
+        free(rsmp->hist);
+        free(rsmp);
+        return -ENOMEM;
+    }
+    voice_resampler_reset(&rsmp->itfe);
+    ALOGV("%s: %u -> %u Hz, %u phases of %u taps", __func__, in_rate, out_rate,
+          rsmp->up, rsmp->taps);
+
+    *resampler = &rsmp->itfe;
+    return 0;
+}
+
+/* Creates the voice resampler for the SCO rates, or a generic resampler */
+static int create_stream_resampler(uint32_t in_rate, uint32_t out_rate, uint32_t channels,
+                                   bool voice, struct resampler_buffer_provider *provider,
+                                   struct resampler_itfe **resampler)
+{
+    if (voice && voice_resampler_supported(in_rate, out_rate))
+        return create_voice_resampler(in_rate, out_rate, channels, provider, resampler);
+    return create_resampler(in_rate, out_rate, channels, RESAMPLER_QUALITY_DEFAULT,
+                            provider, resampler);
+}
+
+static void release_stream_resampler(struct resampler_itfe *resampler)
+{
+    struct voice_resampler *rsmp;
+
+    if (resampler == NULL)
+        return;
+    if (resampler->reset != voice_resampler_reset) {
+        release_resampler(resampler);
+        return;
+    }
+    rsmp = (struct voice_resampler *)resampler;
+    free(rsmp->coefs);
+    free(rsmp->hist);
+    free(rsmp);
+}
+
+/* Capture sharing.
+ * The first stream started on the capture PCM owns it: its usecase routes the
+ * PCM and it opens it. Streams started later with the same profile and usecase
+ * attach to it instead of failing to open a busy device, see
+ * start_shared_input_stream(). Each stream keeps its own resampler, channel mask
+ * and effects. The raw PCM frames are fanned out by capture_source_read(): the
+ * stream reading from the PCM copies what it got to the ring of every other
+ * attached stream, and streams always empty their ring before reading the PCM.
+ * One stream at a time reads from the PCM, without capture_source.lock held so
+ * that attaching a stream does not wait for a capture period: the others wait on
+ * capture_source.cond and find their ring refilled. */
+
+/* must be called with adev->capture_source.lock locked */
+static void capture_ring_push_l(struct stream_in *in, const int16_t *src,
+                                size_t frames, size_t channels)
+{
+    size_t size = in->capture_ring_size;
+    size_t wr;
+    size_t count;
+
+    if (size == 0)
+        return;
+
+    if (frames > size) {
+        /* keep the most recent frames */
+        in->capture_ring_dropped += frames - size;
+        src += (frames - size) * channels;
+        frames = size;
+    }
+    if (in->capture_ring_frames + frames > size) {
+        count = in->capture_ring_frames + frames - size;
+        in->capture_ring_dropped += count;
+        in->capture_ring_rd = (in->capture_ring_rd + count) % size;
+        in->capture_ring_frames -= count;
+    }
+
+    wr = (in->capture_ring_rd + in->capture_ring_frames) % size;
+    count = size - wr < frames ? size - wr : frames;
+    memcpy(in->capture_ring + wr * channels, src, count * channels * sizeof(int16_t));
+    if (count < frames)
+        memcpy(in->capture_ring, src + count * channels,
+               (frames - count) * channels * sizeof(int16_t));
+    in->capture_ring_frames += frames;
+}
+
+/* must be called with adev->capture_source.lock locked */
+static size_t capture_ring_pop_l(struct stream_in *in, int16_t *dst,
+                                 size_t frames, size_t channels)
+{
+    size_t size = in->capture_ring_size;
+    size_t count;
+
+    if (frames > in->capture_ring_frames)
+        frames = in->capture_ring_frames;
+    if (frames == 0)
+        return 0;
+
+    count = size - in->capture_ring_rd < frames ? size - in->capture_ring_rd : frames;
+    memcpy(dst, in->capture_ring + in->capture_ring_rd * channels,
+           count * channels * sizeof(int16_t));
+    if (count < frames)
+        memcpy(dst + count * channels, in->capture_ring,
+               (frames - count) * channels * sizeof(int16_t));
+    in->capture_ring_rd = (in->capture_ring_rd + frames) % size;
+    in->capture_ring_frames -= frames;
+    return frames;
+}
+
+/* Converts frames read from the PCM to frames returned by in_read() */
+static uint64_t in_pcm_to_client_frames(struct stream_in *in, uint64_t frames)
+{
+    if (in->config.rate == 0)
+        return frames;
+    return frames * in->requested_rate / in->config.rate;
+}
+
+/* Returns the frames dropped by the driver since the last read, 0 under the
+ * overrun threshold.
+ * The frames captured since the PCM started are the frames read plus the frames
+ * available in the driver: when they fall behind the time elapsed on the
+ * timestamps, the driver overran and discarded them. Slow drift between the
+ * audio and system clocks is absorbed as each read restarts the comparison. */
+static int64_t capture_clock_lost(struct capture_clock *clock, struct pcm *pcm,
+                                  const struct pcm_config *config, size_t frames)
+{
+    unsigned int avail;
+    struct timespec ts;
+    int64_t now_ns;
+    uint64_t captured;
+    int64_t lost = 0;
+
+    clock->frames_read += frames;
+    if (pcm_get_htimestamp(pcm, &avail, &ts) != 0) {
+        /* not running: resync on the next read */
+        clock->last_ns = 0;
+        return 0;
+    }
+    now_ns = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    captured = clock->frames_read + avail;
+
+    if (clock->last_ns != 0) {
+        lost = (now_ns - clock->last_ns) * config->rate / 1000000000 -
+                (int64_t)(captured - clock->last_frames);
+        if (lost <= (int64_t)(config->period_size / CAPTURE_OVERRUN_THRESHOLD_DIV))
+            lost = 0;
+    }
+    clock->last_ns = now_ns;
+    clock->last_frames = captured;
+    if (lost != 0)
+        ALOGW("%s: capture overrun, %lld frames lost", __func__, (long long)lost);
+    return lost;
+}
+
+/* Charges the frames dropped by the driver to every stream attached to the
+ * capture PCM: they all lost the same frames.
+ * must be called with adev->capture_source.lock locked */
+static void capture_source_account_l(struct capture_source *source, size_t frames)
+{
+    struct listnode *node;
+    struct stream_in *client;
+    int64_t lost;
+
+    lost = capture_clock_lost(&source->xrun_clock, source->pcm, &source->config, frames);
+    if (lost == 0)
+        return;
+    list_for_each(node, &source->clients) {
+        client = node_to_item(node, struct stream_in, capture_client_node);
+        client->overruns++;
+        client->capture_overrun_lost += lost;
+    }
+    ATRACE_INT("in_overruns", source->owner->overruns);
+}
+
+/* Counts the frames dropped by the driver on a PCM read by this stream only.
+ * must be called with in->lock locked */
+static void in_account_capture_l(struct stream_in *in, struct pcm *pcm, size_t frames)
+{
+    int64_t lost;
+
+    lost = capture_clock_lost(&in->xrun_clock, pcm, &in->config, frames);
+    if (lost == 0)
+        return;
+    in->overruns++;
+    ATRACE_INT("in_overruns", in->overruns);
+    lost = in_pcm_to_client_frames(in, lost);
+    in->frames_lost += lost;
+    in->frames_lost_total += lost;
+}
+
+/* Reads from the capture PCM of the stream, shared or not.
+ * must be called with in->lock locked */
+static int capture_source_read(struct stream_in *in, struct pcm *pcm,
+                               void *data, unsigned int bytes)
+{
+    struct capture_source *source = &in->dev->capture_source;
+    struct listnode *node;
+    struct pcm *source_pcm;
+    size_t channels;
+    size_t frames;
+    size_t done;
+    int16_t *dst;
+    int64_t begin_ns;
+    int ret = 0;
+
+    if (!in->capture_shared) {
+        begin_ns = get_monotonic_ns();
+        ATRACE_BEGIN("pcm_read");
+        ret = pcm_read(pcm, data, bytes);
+        ATRACE_END();
+        latency_hist_add(&in->pcm_read_time, get_monotonic_ns() - begin_ns);
+        if (ret == 0)
+            in_account_capture_l(in, pcm, pcm_bytes_to_frames(pcm, bytes));
+        return ret;
+    }
+
+    pthread_mutex_lock(&source->lock);
+    channels = source->config.channels;
+    frames = bytes / (channels * sizeof(int16_t));
+    done = capture_ring_pop_l(in, (int16_t *)data, frames, channels);
+    /* another client is reading: its frames are pushed to our ring */
+    while (done < frames && source->reading) {
+        pthread_cond_wait(&source->cond, &source->lock);
+        done += capture_ring_pop_l(in, (int16_t *)data + done * channels,
+                                   frames - done, channels);
+    }
+    if (done < frames) {
+        dst = (int16_t *)data + done * channels;
+        /* the PCM stays open while a client is attached, and this stream
+         * cannot detach while it holds in->lock */
+        source_pcm = source->pcm;
+        source->reading = true;
+        pthread_mutex_unlock(&source->lock);
+
+        begin_ns = get_monotonic_ns();
+        ATRACE_BEGIN("pcm_read");
+        ret = pcm_read(source_pcm, dst, (frames - done) * channels * sizeof(int16_t));
+        ATRACE_END();
+        latency_hist_add(&in->pcm_read_time, get_monotonic_ns() - begin_ns);
+
+        pthread_mutex_lock(&source->lock);
+        source->reading = false;
+        if (ret == 0) {
+            capture_source_account_l(source, frames - done);
+            list_for_each(node, &source->clients) {
+                struct stream_in *client = node_to_item(node, struct stream_in,
+                                                        capture_client_node);
+                if (client != in)
+                    capture_ring_push_l(client, dst, frames - done, channels);
+            }
+        }
+        pthread_cond_broadcast(&source->cond);
+    }
+    pthread_mutex_unlock(&source->lock);
+    return ret;
 }
 
 static int get_next_buffer(struct resampler_buffer_provider *buffer_provider,
@@ -1729,14 +3403,9 @@ static int get_next_buffer(struct resampler_buffer_provider *buffer_provider,
 
     if (in->read_buf_frames == 0) {
         size_t size_in_bytes = pcm_frames_to_bytes(pcm_device->pcm, in->config.period_size);
-        if (in->read_buf_size < in->config.period_size) {
-            in->read_buf_size = in->config.period_size;
-            in->read_buf = (int16_t *) realloc(in->read_buf, size_in_bytes);
-            ALOG_ASSERT((in->read_buf != NULL),
-                        "get_next_buffer() failed to reallocate read_buf");
-        }
 
-        in->read_status = pcm_read(pcm_device->pcm, (void*)in->read_buf, size_in_bytes);
+        in->read_status = capture_source_read(in, pcm_device->pcm, (void*)in->read_buf,
+                                              size_in_bytes);
 
         if (in->read_status != 0) {
             ALOGE("get_next_buffer() pcm_read error %d", in->read_status);
@@ -1767,16 +3436,8 @@ static int get_next_buffer(struct resampler_buffer_provider *buffer_provider,
                 }
             }
             if (ref_device) {
-                size_hw_ref_bytes = pcm_frames_to_bytes(ref_device->pcm, ref_device->pcm_profile->config.period_size);
-                size_hw_ref_frames = ref_device->pcm_profile->config.period_size;
-                if (in->hw_ref_buf_size < size_hw_ref_frames) {
-                    in->hw_ref_buf_size = size_hw_ref_frames;
-                    in->hw_ref_buf = (int16_t *) realloc(in->hw_ref_buf, size_hw_ref_bytes);
-                    ALOG_ASSERT((in->hw_ref_buf != NULL),
-                                "get_next_buffer() failed to reallocate hw_ref_buf");
-                    ALOGV("get_next_buffer(): hw_ref_buf %p extended to %zd bytes",
-                          in->hw_ref_buf, size_hw_ref_bytes);
-                }
+                size_hw_ref_bytes = pcm_frames_to_bytes(ref_device->pcm, in->config.period_size);
+                size_hw_ref_frames = in->config.period_size;
 
                 read_status = pcm_read(ref_device->pcm, (void*)in->hw_ref_buf, size_hw_ref_bytes);
                 if (read_status != 0) {
@@ -1844,6 +3505,18 @@ static ssize_t read_frames(struct stream_in *in, void *buffer, ssize_t frames)
                     (int16_t *)((char *)buffer +
                             pcm_frames_to_bytes(pcm_device->pcm, frames_wr)),
                     &frames_rd);
+        } else if (in->read_buf_frames == 0
+#ifdef HW_AEC_LOOPBACK
+                   && !in->hw_echo_reference
+#endif
+                   && pcm_device->pcm != NULL) {
+            /* nothing buffered: read straight into the destination */
+            in->read_status = capture_source_read(in, pcm_device->pcm,
+                                       (char *)buffer +
+                                            pcm_frames_to_bytes(pcm_device->pcm, frames_wr),
+                                       pcm_frames_to_bytes(pcm_device->pcm, frames_rd));
+            if (in->read_status != 0)
+                ALOGE("%s: pcm_read error %d", __func__, in->read_status);
         } else {
             struct resampler_buffer buf = {
                     { raw : NULL, },
@@ -1902,7 +3575,7 @@ static int stop_input_stream(struct stream_in *in)
     /* Disable the tx device */
     disable_snd_device(adev, uc_info, uc_info->in_snd_device, true);
 
-    list_remove(&uc_info->adev_list_node);
+    remove_usecase_l(adev, uc_info);
     free(uc_info);
 
     if (list_empty(&in->pcm_dev_list)) {
@@ -1924,32 +3597,282 @@ static int stop_input_stream(struct stream_in *in)
     return 0;
 }
 
+static size_t arena_align(size_t bytes)
+{
+    return (bytes + 15) & ~(size_t)15;
+}
+
+/* Carves all the buffers of the capture path out of a single per-stream arena.
+ * Sizes follow the stream config so that in_read() never allocates:
+ * - read_buf and hw_ref_buf hold one driver period,
+ * - proc_buf_out holds the largest chunk handed out by read_and_process_frames(),
+ *   the client buffer size reported by get_input_buffer_size(),
+ * - capture_ring holds CAPTURE_SHARE_RING_PERIODS periods read by other streams
+ *   sharing the PCM,
+ * - the effect chain buffers hold one PREPROCESSING_BLOCK_MS block.
+ * The arena is kept across standby and only grows when the config does.
+ * must be called with in->lock locked */
+static int in_alloc_buffers_l(struct stream_in *in, unsigned int pcm_channels)
+{
+    size_t frame_size = (in->config.channels > pcm_channels ?
+                            in->config.channels : pcm_channels) * sizeof(int16_t);
+    size_t chunk_frames = (in->config.period_size * in->requested_rate) / in->config.rate;
+    size_t read_bytes = arena_align(in->config.period_size * frame_size);
+    size_t chunk_bytes;
+    size_t size;
+    char *cursor;
+#ifdef PREPROCESSING_ENABLED
+    size_t block_frames = (in->requested_rate * PREPROCESSING_BLOCK_MS) / 1000;
+    size_t block_bytes = arena_align(block_frames * frame_size);
+    /* the reference is read ahead by the drift correction ratio */
+    size_t ref_frames = block_frames * 2 + 4;
+    size_t ref_bytes = arena_align(ref_frames * frame_size);
+    int i;
+#endif
+    size_t ring_frames = in->config.period_size * CAPTURE_SHARE_RING_PERIODS;
+    size_t ring_bytes = arena_align(ring_frames * pcm_channels * sizeof(int16_t));
+#ifdef HW_AEC_LOOPBACK
+    size_t hw_ref_bytes = arena_align(in->config.period_size *
+                                      pcm_device_capture_loopback_aec.config.channels *
+                                      sizeof(int16_t));
+#endif
+
+    /* same rounding as get_input_buffer_size() */
+    chunk_frames = ((chunk_frames + 15) / 16) * 16;
+    chunk_bytes = arena_align(chunk_frames * frame_size);
+
+    size = read_bytes + chunk_bytes + ring_bytes;
+#ifdef PREPROCESSING_ENABLED
+    size += block_bytes * (1 + MAX_PREPROCESSORS) + ref_bytes + block_bytes;
+#endif
+#ifdef HW_AEC_LOOPBACK
+    size += hw_ref_bytes;
+#endif
+
+    if (in->buf_arena_size < size) {
+        free(in->buf_arena);
+        in->buf_arena = malloc(size);
+        if (in->buf_arena == NULL) {
+            in->buf_arena_size = 0;
+            ALOGE("%s: cannot allocate %zu bytes", __func__, size);
+            return -ENOMEM;
+        }
+        in->buf_arena_size = size;
+    }
+    ALOGV("%s: %zu bytes, %zu frames per chunk", __func__, size, chunk_frames);
+
+    cursor = (char *)in->buf_arena;
+    in->read_buf = (int16_t *)cursor;
+    in->read_buf_size = in->config.period_size;
+    in->read_buf_frames = 0;
+    cursor += read_bytes;
+
+    in->proc_buf_out = (int16_t *)cursor;
+    in->proc_buf_size = chunk_frames;
+    cursor += chunk_bytes;
+    in->proc_buf_frames = 0;
+
+    in->capture_ring = (int16_t *)cursor;
+    in->capture_ring_size = ring_frames;
+    cursor += ring_bytes;
+
+#ifdef PREPROCESSING_ENABLED
+    in->proc_buf_in = (int16_t *)cursor;
+    cursor += block_bytes;
+    for (i = 0; i < MAX_PREPROCESSORS; i++) {
+        in->proc_stage_buf[i] = (int16_t *)cursor;
+        cursor += block_bytes;
+    }
+    in->proc_block_frames = block_frames;
+    in->proc_out_frames = 0;
+
+    in->ref_buf = (int16_t *)cursor;
+    in->ref_buf_size = ref_frames;
+    in->ref_buf_frames = 0;
+    cursor += ref_bytes;
+
+    in->ref_out_buf = (int16_t *)cursor;
+    in->ref_out_size = block_frames;
+    cursor += block_bytes;
+#endif
+#ifdef HW_AEC_LOOPBACK
+    in->hw_ref_buf = (int16_t *)cursor;
+    in->hw_ref_buf_size = in->config.period_size;
+    cursor += hw_ref_bytes;
+#endif
+
+    return 0;
+}
+
+/* Sets the stream config from the config of the PCM it reads from.
+ * Config should be updated as profile can be changed between different calls
+ * to start_input_stream():
+ * - Trigger resampler creation
+ * - Config needs to be updated */
+static int in_configure_l(struct stream_in *in, const struct pcm_config *pcm_config)
+{
+    bool recreate_resampler = false;
+    int ret = 0;
+
+    if (in->config.rate != pcm_config->rate) {
+        recreate_resampler = true;
+    }
+    in->config = *pcm_config;
+
+#ifdef PREPROCESSING_ENABLED
+    if (in->aux_channels_changed) {
+        in->config.channels = audio_channel_count_from_in_mask(in->main_channels | in->aux_channels);
+        recreate_resampler = true;
+    }
+#endif
+
+    if (in->requested_rate != in->config.rate) {
+        recreate_resampler = true;
+    }
+
+    if (recreate_resampler) {
+        if (in->resampler) {
+            release_stream_resampler(in->resampler);
+            in->resampler = NULL;
+        }
+    }
+
+    /* frames are read straight from the driver when the rates match */
+    if (recreate_resampler && in->requested_rate != in->config.rate) {
+        in->buf_provider.get_next_buffer = get_next_buffer;
+        in->buf_provider.release_buffer = release_buffer;
+        ret = create_stream_resampler(in->config.rate,
+                                      in->requested_rate,
+                                      in->config.channels,
+                                      (in->devices & AUDIO_DEVICE_IN_BLUETOOTH_SCO_HEADSET &
+                                              ~AUDIO_DEVICE_BIT_IN) != 0,
+                                      &in->buf_provider,
+                                      &in->resampler);
+    }
+    return ret;
+}
+
+/* must be called with in->lock and adev->lock locked */
+static void capture_source_attach_l(struct stream_in *in)
+{
+    struct capture_source *source = &in->dev->capture_source;
+
+    pthread_mutex_lock(&source->lock);
+    in->capture_ring_rd = 0;
+    in->capture_ring_frames = 0;
+    list_add_tail(&source->clients, &in->capture_client_node);
+    source->num_clients++;
+    in->capture_shared = true;
+    pthread_mutex_unlock(&source->lock);
+}
+
+/* Returns true if other streams still read from the PCM, which must then stay open.
+ * must be called with in->lock and adev->lock locked */
+static bool capture_source_detach_l(struct stream_in *in)
+{
+    struct audio_device *adev = in->dev;
+    struct capture_source *source = &adev->capture_source;
+    struct audio_usecase *usecase;
+    struct stream_in *owner;
+    bool busy;
+
+    pthread_mutex_lock(&source->lock);
+    list_remove(&in->capture_client_node);
+    source->num_clients--;
+    in->capture_shared = false;
+    busy = source->num_clients > 0;
+    if (!busy) {
+        source->pcm = NULL;
+        source->owner = NULL;
+    } else if (source->owner == in) {
+        /* hand the usecase over to another stream */
+        owner = node_to_item(list_head(&source->clients), struct stream_in,
+                             capture_client_node);
+        usecase = get_usecase_from_id(adev, source->usecase);
+        if (usecase != NULL)
+            usecase->stream = (struct audio_stream *)owner;
+        if (adev->active_input == in)
+            adev->active_input = owner;
+        source->owner = owner;
+    }
+    pthread_mutex_unlock(&source->lock);
+    return busy;
+}
+
+/* Starts a stream on the capture PCM already opened by another stream.
+ * must be called with in->lock and adev->lock locked */
+static int start_shared_input_stream(struct stream_in *in,
+                                     struct pcm_device_profile *pcm_profile)
+{
+    struct capture_source *source = &in->dev->capture_source;
+    struct pcm_device *pcm_device;
+    int ret;
+
+    /* The route follows the devices and audio source of the owner, and echo
+     * cancellation needs the PCM and the reference for itself: a stream that
+     * would get another input device or processing is not attached */
+    if (source->pcm_profile != pcm_profile || source->usecase != in->usecase ||
+            in->devices != source->owner->devices || in->source != source->owner->source
+#ifdef PREPROCESSING_ENABLED
+            || in->enable_aec || source->owner->enable_aec
+#endif
+            ) {
+        ALOGE("%s: capture PCM busy with usecase(%d)", __func__, source->usecase);
+        return -EBUSY;
+    }
+
+    ret = in_configure_l(in, &source->config);
+    if (ret != 0)
+        return ret;
+    ret = in_alloc_buffers_l(in, source->config.channels);
+    if (ret != 0)
+        return ret;
+
+    pcm_device = (struct pcm_device *)calloc(1, sizeof(struct pcm_device));
+    pcm_device->pcm_profile = pcm_profile;
+    pcm_device->pcm = source->pcm;
+    list_init(&in->pcm_dev_list);
+    list_add_tail(&in->pcm_dev_list, &pcm_device->stream_list_node);
+
+    if (in->resampler) {
+        in->resampler->reset(in->resampler);
+    }
+    capture_source_attach_l(in);
+    ALOGV("%s: usecase(%d) shared by %d streams", __func__, in->usecase,
+          source->num_clients);
+    return 0;
+}
+
 int start_input_stream(struct stream_in *in)
 {
     /* Enable output device and stream routing controls */
     int ret = 0;
-    bool recreate_resampler = false;
     struct audio_usecase *uc_info;
     struct audio_device *adev = in->dev;
     struct pcm_device_profile *pcm_profile;
     struct pcm_device *pcm_device;
+    struct pcm_config pcm_config;
 
     ALOGV("%s: enter: usecase(%d)", __func__, in->usecase);
-    adev->active_input = in;
+    ret = adev_wait_for_init(adev, in->usecase == USECASE_AUDIO_CAPTURE_HOTWORD ?
+                                   ADEV_INIT_DONE : ADEV_INIT_ROUTING);
+    if (ret != 0)
+        return ret;
+
+    in->xrun_clock.last_ns = 0;
     pcm_profile = get_pcm_device(in->usecase == USECASE_AUDIO_CAPTURE_HOTWORD
                                  ? PCM_HOTWORD_STREAMING : PCM_CAPTURE, in->devices);
     if (pcm_profile == NULL) {
         ALOGE("%s: Could not find PCM device id for the usecase(%d)",
               __func__, in->usecase);
-        ret = -EINVAL;
-        goto error_config;
+        return -EINVAL;
     }
+    pcm_profile = get_sco_pcm_device(adev, pcm_profile);
 
-    if (in->input_flags & AUDIO_INPUT_FLAG_FAST) {
-        ALOGV("%s: change capture period size to low latency size %d",
-              __func__, CAPTURE_PERIOD_SIZE_LOW_LATENCY);
-        pcm_profile->config.period_size = CAPTURE_PERIOD_SIZE_LOW_LATENCY;
-    }
+    if (pcm_profile->type == PCM_CAPTURE && adev->capture_source.pcm != NULL)
+        return start_shared_input_stream(in, pcm_profile);
+
+    adev->active_input = in;
 
     uc_info = (struct audio_usecase *)calloc(1, sizeof(struct audio_usecase));
     uc_info->id = in->usecase;
@@ -1965,50 +3888,26 @@ int start_input_stream(struct stream_in *in)
     list_add_tail(&in->pcm_dev_list, &pcm_device->stream_list_node);
 
     list_init(&uc_info->mixer_list);
-    list_add_tail(&uc_info->mixer_list,
-                  &adev_get_mixer_for_card(adev,
-                                       pcm_device->pcm_profile->card)->uc_list_node[uc_info->id]);
+    uc_add_mixer_card(uc_info, adev_get_mixer_for_card(adev, pcm_device->pcm_profile->card));
 
-    list_add_tail(&adev->usecase_list, &uc_info->adev_list_node);
+    add_usecase_l(adev, uc_info);
 
     select_devices(adev, in->usecase);
 
-    /* Config should be updated as profile can be changed between different calls
-     * to this function:
-     * - Trigger resampler creation
-     * - Config needs to be updated */
-    if (in->config.rate != pcm_profile->config.rate) {
-        recreate_resampler = true;
-    }
-    in->config = pcm_profile->config;
-
-#ifdef PREPROCESSING_ENABLED
-    if (in->aux_channels_changed) {
-        in->config.channels = audio_channel_count_from_in_mask(in->main_channels | in->aux_channels);
-        recreate_resampler = true;
-    }
-#endif
-
-    if (in->requested_rate != in->config.rate) {
-        recreate_resampler = true;
-    }
-
-    if (recreate_resampler) {
-        if (in->resampler) {
-            release_resampler(in->resampler);
-            in->resampler = NULL;
-        }
-        in->buf_provider.get_next_buffer = get_next_buffer;
-        in->buf_provider.release_buffer = release_buffer;
-        ret = create_resampler(in->config.rate,
-                               in->requested_rate,
-                               in->config.channels,
-                               RESAMPLER_QUALITY_DEFAULT,
-                               &in->buf_provider,
-                               &in->resampler);
+    /* The HW is limited to the default channels of the profile.
+     * The profile is shared by all capture streams: only the stream config
+     * gets the low latency periods */
+    pcm_config = pcm_profile->config;
+    if (in->usecase == USECASE_AUDIO_CAPTURE_LOW_LATENCY) {
+        ALOGV("%s: change capture period size to low latency size %d",
+              __func__, CAPTURE_PERIOD_SIZE_LOW_LATENCY);
+        pcm_config.period_size = CAPTURE_PERIOD_SIZE_LOW_LATENCY;
+        pcm_config.period_count = CAPTURE_PERIOD_COUNT_LOW_LATENCY;
     }
+    ret = in_configure_l(in, &pcm_config);
 
 #ifdef PREPROCESSING_ENABLED
+    echo_ref_sync_reset(&in->echo_ref_sync);
     if (in->enable_aec && in->echo_reference == NULL) {
         in->echo_reference = get_echo_reference(adev,
                                                 AUDIO_FORMAT_PCM_16_BIT,
@@ -2022,9 +3921,6 @@ int start_input_stream(struct stream_in *in)
         ret = get_hw_echo_reference(in);
         if (ret!=0)
             goto error_open;
-
-        /* force ref buffer reallocation */
-        in->hw_ref_buf_size = 0;
     }
 #endif
 #endif
@@ -2035,8 +3931,7 @@ int start_input_stream(struct stream_in *in)
      */
     ALOGV("%s: Opening PCM device card_id(%d) device_id(%d), channels %d, smp rate %d format %d, \
           period_size %d", __func__, pcm_device->pcm_profile->card, pcm_device->pcm_profile->id,
-          pcm_device->pcm_profile->config.channels,pcm_device->pcm_profile->config.rate,
-          pcm_device->pcm_profile->config.format, pcm_device->pcm_profile->config.period_size);
+          pcm_config.channels, pcm_config.rate, pcm_config.format, pcm_config.period_size);
 
     if (pcm_profile->type == PCM_HOTWORD_STREAMING) {
         if (!adev->sound_trigger_open_for_streaming) {
@@ -2055,7 +3950,7 @@ int start_input_stream(struct stream_in *in)
     } else {
         pcm_device->sound_trigger_handle = 0;
         pcm_device->pcm = pcm_open(pcm_device->pcm_profile->card, pcm_device->pcm_profile->id,
-                                   PCM_IN | PCM_MONOTONIC, &pcm_device->pcm_profile->config);
+                                   PCM_IN | PCM_MONOTONIC, &pcm_config);
 
         if (pcm_device->pcm && !pcm_is_ready(pcm_device->pcm)) {
             ALOGE("%s: %s", __func__, pcm_get_error(pcm_device->pcm));
@@ -2066,29 +3961,41 @@ int start_input_stream(struct stream_in *in)
         }
     }
 
-    /* force read and proc buffer reallocation in case of frame size or
-     * channel count change */
-    in->proc_buf_frames = 0;
-    in->proc_buf_size = 0;
-    in->read_buf_size = 0;
-    in->read_buf_frames = 0;
+    /* size the read and proc buffers for the frame size and channel count */
+    ret = in_alloc_buffers_l(in, pcm_config.channels);
+    if (ret != 0) {
+        if (pcm_device->pcm != NULL) {
+            pcm_close(pcm_device->pcm);
+            pcm_device->pcm = NULL;
+        }
+        goto error_open;
+    }
 
     /* if no supported sample rate is available, use the resampler */
     if (in->resampler) {
         in->resampler->reset(in->resampler);
     }
 
+    if (pcm_profile->type == PCM_CAPTURE) {
+        adev->capture_source.pcm = pcm_device->pcm;
+        adev->capture_source.pcm_profile = pcm_profile;
+        adev->capture_source.config = pcm_config;
+        adev->capture_source.usecase = in->usecase;
+        adev->capture_source.owner = in;
+        memset(&adev->capture_source.xrun_clock, 0, sizeof(struct capture_clock));
+        capture_source_attach_l(in);
+    }
+
     ALOGV("%s: exit", __func__);
     return ret;
 
 error_open:
     if (in->resampler) {
-        release_resampler(in->resampler);
+        release_stream_resampler(in->resampler);
         in->resampler = NULL;
     }
     stop_input_stream(in);
 
-error_config:
     ALOGD("%s: exit: status(%d)", __func__, ret);
     adev->active_input = NULL;
     return ret;
@@ -2111,14 +4018,62 @@ static int send_offload_cmd_l(struct stream_out* out, int command)
 static void stop_compressed_output_l(struct stream_out *out)
 {
     out->send_new_metadata = 1;
+    out->offload_wait_pending = false;
     if (out->compr != NULL) {
         compress_stop(out->compr);
+        /* ends a wait for the write watermark */
+        pthread_cond_signal(&out->offload_cond);
         while (out->offload_thread_blocked) {
             pthread_cond_wait(&out->cond, &out->lock);
         }
     }
 }
 
+/* Waits until at least out->offload_write_watermark bytes are free in the DSP
+ * buffer so that the client is woken up to write several fragments at once.
+ * compress_wait() returns as soon as one fragment is free: below the watermark
+ * the thread sleeps for the time the DSP takes to play the missing bytes.
+ * The sleep is on offload_cond so that a command queued meanwhile (drain,
+ * exit) or a stop ends it.
+ * called without out->lock held, from the offload thread only */
+static void offload_wait_for_watermark(struct stream_out *out)
+{
+    unsigned int avail;
+    struct timespec tstamp;
+    struct timespec deadline;
+    int64_t wait_ms;
+    int ret;
+
+    for (;;) {
+        ret = compress_wait(out->compr, OFFLOAD_WAIT_TIMEOUT_MS);
+        /* tinycompress reports errors in errno: anything but a timeout means
+         * the stream was stopped */
+        if (ret < 0 && errno != ETIME)
+            break;
+        wait_ms = 0;
+        if (ret == 0) {
+            if (compress_get_hpointer(out->compr, &avail, &tstamp) < 0 ||
+                    avail >= out->offload_write_watermark || out->offload_byte_rate == 0)
+                break;
+            wait_ms = ((int64_t)(out->offload_write_watermark - avail) * 1000 +
+                       out->offload_byte_rate - 1) / out->offload_byte_rate;
+            if (wait_ms > OFFLOAD_WAIT_TIMEOUT_MS)
+                wait_ms = OFFLOAD_WAIT_TIMEOUT_MS;
+        }
+
+        pthread_mutex_lock(&out->lock);
+        if (wait_ms > 0 && list_empty(&out->offload_cmd_list) &&
+                out->offload_state == OFFLOAD_STATE_PLAYING) {
+            get_deadline(&deadline, wait_ms);
+            pthread_cond_timedwait(&out->offload_cond, &out->lock, &deadline);
+        }
+        ret = !list_empty(&out->offload_cmd_list) || out->offload_state != OFFLOAD_STATE_PLAYING;
+        pthread_mutex_unlock(&out->lock);
+        if (ret)
+            break;
+    }
+}
+
 static void *offload_thread_loop(void *context)
 {
     struct stream_out *out = (struct stream_out *) context;
@@ -2167,12 +4122,12 @@ static void *offload_thread_loop(void *context)
         send_callback = false;
         switch(cmd->cmd) {
         case OFFLOAD_CMD_WAIT_FOR_BUFFER:
-            compress_wait(out->compr, -1);
+            offload_wait_for_watermark(out);
             send_callback = true;
             event = STREAM_CBK_EVENT_WRITE_READY;
             break;
         case OFFLOAD_CMD_PARTIAL_DRAIN:
-            compress_next_track(out->compr);
+            /* the next track was opened in out_drain() */
             compress_partial_drain(out->compr);
             send_callback = true;
             event = STREAM_CBK_EVENT_DRAIN_READY;
@@ -2188,6 +4143,8 @@ static void *offload_thread_loop(void *context)
         }
         pthread_mutex_lock(&out->lock);
         out->offload_thread_blocked = false;
+        if (cmd->cmd == OFFLOAD_CMD_WAIT_FOR_BUFFER)
+            out->offload_wait_pending = false;
         pthread_cond_signal(&out->cond);
         if (send_callback) {
             out->offload_callback(event, NULL, out->offload_cookie);
@@ -2208,7 +4165,13 @@ static void *offload_thread_loop(void *context)
 
 static int create_offload_callback_thread(struct stream_out *out)
 {
-    pthread_cond_init(&out->offload_cond, (const pthread_condattr_t *) NULL);
+    pthread_condattr_t attr;
+
+    /* timed waits of offload_wait_for_watermark() use get_deadline() */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&out->offload_cond, &attr);
+    pthread_condattr_destroy(&attr);
     list_init(&out->offload_cmd_list);
     pthread_create(&out->offload_thread, (const pthread_attr_t *) NULL,
                     offload_thread_loop, out);
@@ -2258,12 +4221,12 @@ static int uc_select_pcm_devices(struct audio_usecase *usecase)
 
     while ((pcm_profile = get_pcm_device(usecase->type, devices)) != NULL) {
         pcm_device = calloc(1, sizeof(struct pcm_device));
-        pcm_device->pcm_profile = pcm_profile;
+        pcm_device->pcm_profile = get_sco_pcm_device(out->dev, pcm_profile);
         list_add_tail(&out->pcm_dev_list, &pcm_device->stream_list_node);
         mixer_card = uc_get_mixer_for_card(usecase, pcm_profile->card);
         if (mixer_card == NULL) {
             mixer_card = adev_get_mixer_for_card(out->dev, pcm_profile->card);
-            list_add_tail(&usecase->mixer_list, &mixer_card->uc_list_node[usecase->id]);
+            uc_add_mixer_card(usecase, mixer_card);
         }
         devices &= ~pcm_profile->devices;
     }
@@ -2288,7 +4251,7 @@ static int out_close_pcm_devices(struct stream_out *out)
             pcm_device->pcm = NULL;
         }
         if (pcm_device->resampler) {
-            release_resampler(pcm_device->resampler);
+            release_stream_resampler(pcm_device->resampler);
             pcm_device->resampler = NULL;
         }
         if (pcm_device->res_buffer) {
@@ -2300,9 +4263,53 @@ static int out_close_pcm_devices(struct stream_out *out)
     return 0;
 }
 
+/* Fills the config a PCM device of the stream runs: the deep buffer usecase
+ * always opens the pcm_config_deep_buffer buffer, except on SCO whose rate is set
+ * by the link. While the screen is on, its writer is woken up and playback starts
+ * after a period of the device profile instead of a long period. */
+static void out_get_pcm_config(struct stream_out *out,
+                               struct pcm_device_profile *pcm_profile,
+                               struct pcm_config *config)
+{
+    if (out->usecase != USECASE_AUDIO_PLAYBACK_DEEP_BUFFER ||
+            (pcm_profile->devices & AUDIO_DEVICE_OUT_ALL_SCO)) {
+        *config = pcm_profile->config;
+        return;
+    }
+    *config = pcm_config_deep_buffer;
+    if (!out->long_wakeups) {
+        config->start_threshold = pcm_profile->config.period_size;
+        config->avail_min = pcm_profile->config.period_size;
+    }
+}
+
+/* Applies the thresholds of config to an open PCM with the same software
+ * parameters pcm_open() sets, without stopping it */
+static int pcm_set_thresholds(struct pcm *pcm, const struct pcm_config *config)
+{
+    struct snd_pcm_sw_params sparams;
+    unsigned int buffer_size = config->period_size * config->period_count;
+
+    memset(&sparams, 0, sizeof(sparams));
+    sparams.tstamp_mode = SNDRV_PCM_TSTAMP_ENABLE;
+    sparams.period_step = 1;
+    sparams.start_threshold = config->start_threshold ? config->start_threshold :
+                                                        buffer_size / 2;
+    sparams.stop_threshold = config->stop_threshold ? config->stop_threshold : buffer_size;
+    sparams.avail_min = config->avail_min ? config->avail_min : 1;
+    sparams.xfer_align = config->period_size / 2;
+    sparams.silence_threshold = config->silence_threshold;
+    sparams.silence_size = config->silence_size;
+    sparams.boundary = buffer_size;
+    if (pcm_ioctl(pcm, SNDRV_PCM_IOCTL_SW_PARAMS, &sparams) < 0)
+        return -errno;
+    return 0;
+}
+
 static int out_open_pcm_devices(struct stream_out *out)
 {
     struct pcm_device *pcm_device;
+    struct pcm_config config;
     struct listnode *node;
     int ret = 0;
 
@@ -2311,8 +4318,9 @@ static int out_open_pcm_devices(struct stream_out *out)
         ALOGV("%s: Opening PCM device card_id(%d) device_id(%d)",
               __func__, pcm_device->pcm_profile->card, pcm_device->pcm_profile->id);
 
+        out_get_pcm_config(out, pcm_device->pcm_profile, &config);
         pcm_device->pcm = pcm_open(pcm_device->pcm_profile->card, pcm_device->pcm_profile->id,
-                               PCM_OUT | PCM_MONOTONIC, &pcm_device->pcm_profile->config);
+                               PCM_OUT | PCM_MONOTONIC, &config);
 
         if (pcm_device->pcm && !pcm_is_ready(pcm_device->pcm)) {
             ALOGE("%s: %s", __func__, pcm_get_error(pcm_device->pcm));
@@ -2324,15 +4332,15 @@ static int out_open_pcm_devices(struct stream_out *out)
         * If the stream rate differs from the PCM rate, we need to
         * create a resampler.
         */
-        if (out->sample_rate != pcm_device->pcm_profile->config.rate) {
+        if (out->sample_rate != config.rate) {
             ALOGV("%s: create_resampler(), pcm_device_card(%d), pcm_device_id(%d), \
                     out_rate(%d), device_rate(%d)",__func__,
                     pcm_device->pcm_profile->card, pcm_device->pcm_profile->id,
-                    out->sample_rate, pcm_device->pcm_profile->config.rate);
-            ret = create_resampler(out->sample_rate,
-                    pcm_device->pcm_profile->config.rate,
+                    out->sample_rate, config.rate);
+            ret = create_stream_resampler(out->sample_rate,
+                    config.rate,
                     audio_channel_count_from_out_mask(out->channel_mask),
-                    RESAMPLER_QUALITY_DEFAULT,
+                    (pcm_device->pcm_profile->devices & AUDIO_DEVICE_OUT_ALL_SCO) != 0,
                     NULL,
                     &pcm_device->resampler);
             pcm_device->res_byte_count = 0;
@@ -2359,7 +4367,7 @@ static int disable_output_path_l(struct stream_out *out)
     }
     disable_snd_device(adev, uc_info, uc_info->out_snd_device, true);
     uc_release_pcm_devices(uc_info);
-    list_remove(&uc_info->adev_list_node);
+    remove_usecase_l(adev, uc_info);
     free(uc_info);
 
     return 0;
@@ -2379,7 +4387,7 @@ static void enable_output_path_l(struct stream_out *out)
     uc_info->out_snd_device = SND_DEVICE_NONE;
     uc_select_pcm_devices(uc_info);
 
-    list_add_tail(&adev->usecase_list, &uc_info->adev_list_node);
+    add_usecase_l(adev, uc_info);
 
     select_devices(adev, out->usecase);
 }
@@ -2409,6 +4417,50 @@ static int stop_output_stream(struct stream_out *out)
     return ret;
 }
 
+/* Selects the wakeup mode of the deep buffer usecase and updates out->config
+ * used for the buffer and latency computations.
+ * must be called with out->lock locked, before opening the PCM devices */
+static void out_select_config_l(struct stream_out *out, bool long_wakeups)
+{
+    struct pcm_device *pcm_device;
+
+    if (out->usecase != USECASE_AUDIO_PLAYBACK_DEEP_BUFFER)
+        return;
+    out->long_wakeups = long_wakeups;
+    if (list_empty(&out->pcm_dev_list))
+        return;
+    pcm_device = node_to_item(list_head(&out->pcm_dev_list),
+                              struct pcm_device, stream_list_node);
+    out_get_pcm_config(out, pcm_device->pcm_profile, &out->config);
+    ALOGV("%s: %u x %u frames, avail_min %d", __func__,
+          out->config.period_count, out->config.period_size, out->config.avail_min);
+}
+
+/* Switches the PCM devices of a playing deep buffer stream to the wakeup mode of
+ * the screen state. Only the software parameters change: the buffer and the
+ * queued frames are kept.
+ * must be called with out->lock locked */
+static void out_switch_wakeups_l(struct stream_out *out, bool long_wakeups)
+{
+    struct pcm_device *pcm_device;
+    struct pcm_config config;
+    struct listnode *node;
+    int ret;
+
+    out_select_config_l(out, long_wakeups);
+    list_for_each(node, &out->pcm_dev_list) {
+        pcm_device = node_to_item(node, struct pcm_device, stream_list_node);
+        if (pcm_device->pcm == NULL)
+            continue;
+        out_get_pcm_config(out, pcm_device->pcm_profile, &config);
+        ret = pcm_set_thresholds(pcm_device->pcm, &config);
+        if (ret != 0)
+            ALOGW("%s: cannot set avail_min %d on card %d device %d: %s", __func__,
+                  config.avail_min, pcm_device->pcm_profile->card,
+                  pcm_device->pcm_profile->id, strerror(-ret));
+    }
+}
+
 int start_output_stream(struct stream_out *out)
 {
     int ret = 0;
@@ -2417,10 +4469,16 @@ int start_output_stream(struct stream_out *out)
     ALOGV("%s: enter: usecase(%d: %s) devices(%#x) channels(%d)",
           __func__, out->usecase, use_case_table[out->usecase], out->devices, out->config.channels);
 
+    ret = adev_wait_for_init(adev, out->usecase == USECASE_AUDIO_PLAYBACK_OFFLOAD ?
+                                   ADEV_INIT_DONE : ADEV_INIT_ROUTING);
+    if (ret != 0)
+        return ret;
+
     enable_output_path_l(out);
 
     if (out->usecase != USECASE_AUDIO_PLAYBACK_OFFLOAD) {
         out->compr = NULL;
+        out_select_config_l(out, adev->screen_off);
         ret = out_open_pcm_devices(out);
         if (ret != 0)
             goto error_open;
@@ -2474,7 +4532,7 @@ static int stop_voice_call(struct audio_device *adev)
     disable_snd_device(adev, uc_info, uc_info->in_snd_device, true);
 
     uc_release_pcm_devices(uc_info);
-    list_remove(&uc_info->adev_list_node);
+    remove_usecase_l(adev, uc_info);
     free(uc_info);
 
     ALOGV("%s: exit", __func__);
@@ -2488,6 +4546,9 @@ static int start_voice_call(struct audio_device *adev)
 
     ALOGV("%s: enter", __func__);
 
+    if (adev_wait_for_init(adev, ADEV_INIT_ROUTING) != 0)
+        return -ENODEV;
+
     uc_info = (struct audio_usecase *)calloc(1, sizeof(struct audio_usecase));
     uc_info->id = USECASE_VOICE_CALL;
     uc_info->type = VOICE_CALL;
@@ -2498,7 +4559,7 @@ static int start_voice_call(struct audio_device *adev)
 
     uc_select_pcm_devices(uc_info);
 
-    list_add_tail(&adev->usecase_list, &uc_info->adev_list_node);
+    add_usecase_l(adev, uc_info);
 
     select_devices(adev, USECASE_VOICE_CALL);
 
@@ -2542,9 +4603,11 @@ static int check_input_parameters(uint32_t sample_rate,
 static size_t get_input_buffer_size(uint32_t sample_rate,
                                     audio_format_t format,
                                     int channel_count,
-                                    audio_devices_t devices)
+                                    audio_devices_t devices,
+                                    bool is_low_latency)
 {
     size_t size = 0;
+    size_t period_size;
     struct pcm_device_profile *pcm_profile;
 
     if (check_input_parameters(sample_rate, format, channel_count) != 0)
@@ -2559,7 +4622,9 @@ static size_t get_input_buffer_size(uint32_t sample_rate,
      * multiple of 16 frames, as audioflinger expects audio buffers to
      * be a multiple of 16 frames
      */
-    size = (pcm_profile->config.period_size * sample_rate) / pcm_profile->config.rate;
+    period_size = is_low_latency ? CAPTURE_PERIOD_SIZE_LOW_LATENCY :
+                                   pcm_profile->config.period_size;
+    size = (period_size * sample_rate) / pcm_profile->config.rate;
     size = ((size + 15) / 16) * 16;
 
     return (size * channel_count * audio_bytes_per_sample(format));
@@ -2587,6 +4652,11 @@ static size_t out_get_buffer_size(const struct audio_stream *stream)
     if (out->usecase == USECASE_AUDIO_PLAYBACK_OFFLOAD) {
         return out->compr_config.fragment_size;
     }
+    /* the period of the deep buffer PCMs, which are opened with it whatever the
+     * screen state; SCO runs its own config behind the resampler */
+    if (out->usecase == USECASE_AUDIO_PLAYBACK_DEEP_BUFFER)
+        return pcm_config_deep_buffer.period_size *
+                   audio_stream_out_frame_size((const struct audio_stream_out *)stream);
 
     return out->config.period_size *
                audio_stream_out_frame_size((const struct audio_stream_out *)stream);
@@ -2617,8 +4687,12 @@ static int do_out_standby_l(struct stream_out *out)
 {
     struct audio_device *adev = out->dev;
     int status = 0;
+    int64_t begin_ns = get_monotonic_ns();
 
     out->standby = true;
+    out->last_write_end_ns = 0;
+    /* force a full control plane check on the first write after standby */
+    out->control_generation = 0;
     if (out->usecase != USECASE_AUDIO_PLAYBACK_OFFLOAD) {
         out_close_pcm_devices(out);
 #ifdef PREPROCESSING_ENABLED
@@ -2637,12 +4711,14 @@ static int do_out_standby_l(struct stream_out *out)
         stop_compressed_output_l(out);
         out->gapless_mdata.encoder_delay = 0;
         out->gapless_mdata.encoder_padding = 0;
+        out->next_track_mdata = false;
         if (out->compr != NULL) {
             compress_close(out->compr);
             out->compr = NULL;
         }
     }
     status = stop_output_stream(out);
+    latency_hist_add(&out->standby_time, get_monotonic_ns() - begin_ns);
 
     return status;
 }
@@ -2665,10 +4741,24 @@ static int out_standby(struct audio_stream *stream)
     return 0;
 }
 
+/* does not take out->lock: the counters are read while the stream runs */
 static int out_dump(const struct audio_stream *stream, int fd)
 {
-    (void)stream;
-    (void)fd;
+    struct stream_out *out = (struct stream_out *)stream;
+
+    dprintf(fd, "  Playback: usecase %s, underruns %d, written %llu frames\n",
+            use_case_table[out->usecase], android_atomic_acquire_load(&out->underruns),
+            (unsigned long long)out->written);
+    latency_hist_dump(fd, "Write time", &out->write_time);
+    latency_hist_dump(fd, "Blocked in write", &out->pcm_write_time);
+    latency_hist_dump(fd, "Stream lock wait", &out->lock_wait);
+    latency_hist_dump(fd, "Start time", &out->start_time);
+    latency_hist_dump(fd, "Standby time", &out->standby_time);
+    if (out->usecase == USECASE_AUDIO_PLAYBACK_OFFLOAD)
+        dprintf(fd, "  Offload buffer: %u fragments of %u bytes, write watermark %u bytes, "
+                "expected wakeup interval %u ms\n", out->compr_config.fragments,
+                out->compr_config.fragment_size, out->offload_write_watermark,
+                out->offload_wakeup_interval_ms);
 
     return 0;
 }
@@ -2699,6 +4789,7 @@ static int parse_compress_metadata(struct stream_out *out, struct str_parms *par
 
     out->gapless_mdata = tmp_mdata;
     out->send_new_metadata = 1;
+    out->next_track_mdata = true;
     ALOGV("%s new encoder delay %u and padding %u", __func__,
           out->gapless_mdata.encoder_delay, out->gapless_mdata.encoder_padding);
 
@@ -2849,11 +4940,114 @@ static uint32_t out_get_latency(const struct audio_stream_out *stream)
 {
     struct stream_out *out = (struct stream_out *)stream;
 
+    uint32_t latency_ms = render_latency(out->dev, out->usecase) / 1000;
+
     if (out->usecase == USECASE_AUDIO_PLAYBACK_OFFLOAD)
-        return COMPRESS_OFFLOAD_PLAYBACK_LATENCY;
+        return COMPRESS_OFFLOAD_PLAYBACK_LATENCY + latency_ms;
 
     return (out->config.period_count * out->config.period_size * 1000) /
-           (out->config.rate);
+           (out->config.rate) + latency_ms;
+}
+
+/* Sets the gain reached by a linear ramp of OUT_GAIN_RAMP_MS, or at once while
+ * the stream is in standby as nothing is playing.
+ * must be called with out->lock locked */
+static void out_set_gain_l(struct stream_out *out, float left, float right)
+{
+    unsigned int ramp_frames = out->sample_rate * OUT_GAIN_RAMP_MS / 1000;
+    int i;
+
+    out->gain_target[0] = left < 0.0f ? 0.0f : (left > 1.0f ? 1.0f : left);
+    out->gain_target[1] = right < 0.0f ? 0.0f : (right > 1.0f ? 1.0f : right);
+
+    if (out->standby || ramp_frames == 0) {
+        for (i = 0; i < 2; i++)
+            out->gain_current[i] = out->gain_target[i];
+        out->gain_ramp_frames = 0;
+        return;
+    }
+    /* a ramp in progress continues from where it is */
+    for (i = 0; i < 2; i++)
+        out->gain_step[i] = (out->gain_target[i] - out->gain_current[i]) / ramp_frames;
+    out->gain_ramp_frames = ramp_frames;
+}
+
+static inline int16_t clamp16_from_float(float sample)
+{
+    if (sample >= 32767.0f)
+        return 32767;
+    if (sample <= -32768.0f)
+        return -32768;
+    /* round to nearest rather than toward zero */
+    return (int16_t)(sample >= 0.0f ? sample + 0.5f : sample - 0.5f);
+}
+
+/* Returns the frames with the stream gain applied, written to out->gain_buf.
+ * At unity gain the client buffer is returned untouched.
+ * must be called with out->lock locked */
+static const void *out_apply_gain_l(struct stream_out *out, const void *buffer,
+                                    size_t frames, size_t channels)
+{
+    const int16_t *src = (const int16_t *)buffer;
+    int16_t *dst;
+    size_t bytes = frames * channels * sizeof(int16_t);
+    bool stereo = channels == 2;
+    size_t ramp;
+    size_t i;
+    size_t c;
+
+    if (out->gain_ramp_frames == 0 &&
+            out->gain_current[0] == 1.0f && (!stereo || out->gain_current[1] == 1.0f))
+        return buffer;
+
+    if (bytes > out->gain_buf_size) {
+        dst = realloc(out->gain_buf, bytes);
+        if (dst == NULL) {
+            ALOGE("%s: cannot allocate %zu bytes, gain not applied", __func__, bytes);
+            return buffer;
+        }
+        out->gain_buf = dst;
+        out->gain_buf_size = bytes;
+    }
+    dst = out->gain_buf;
+
+    ramp = frames < out->gain_ramp_frames ? frames : out->gain_ramp_frames;
+    for (i = 0; i < ramp; i++) {
+        out->gain_current[0] += out->gain_step[0];
+        out->gain_current[1] += out->gain_step[1];
+        for (c = 0; c < channels; c++)
+            dst[c] = clamp16_from_float(src[c] *
+                    out->gain_current[stereo && c == 1 ? 1 : 0]);
+        src += channels;
+        dst += channels;
+    }
+    out->gain_ramp_frames -= ramp;
+    if (out->gain_ramp_frames == 0) {
+        /* land exactly on the target whatever the rounding of the steps */
+        out->gain_current[0] = out->gain_target[0];
+        out->gain_current[1] = out->gain_target[1];
+    }
+    frames -= ramp;
+
+    /* constant gain: Q15 multiplies in plain loops the compiler can vectorize */
+    if (out->gain_current[0] == 0.0f && (!stereo || out->gain_current[1] == 0.0f)) {
+        memset(dst, 0, frames * channels * sizeof(int16_t));
+    } else if (stereo) {
+        int32_t left = (int32_t)(out->gain_current[0] * 32768.0f);
+        int32_t right = (int32_t)(out->gain_current[1] * 32768.0f);
+
+        for (i = 0; i < frames; i++) {
+            dst[2 * i] = (int16_t)((src[2 * i] * left) >> 15);
+            dst[2 * i + 1] = (int16_t)((src[2 * i + 1] * right) >> 15);
+        }
+    } else {
+        int32_t gain = (int32_t)(out->gain_current[0] * 32768.0f);
+
+        for (i = 0; i < frames * channels; i++)
+            dst[i] = (int16_t)((src[i] * gain) >> 15);
+    }
+
+    return out->gain_buf;
 }
 
 static int out_set_volume(struct audio_stream_out *stream, float left,
@@ -2861,40 +5055,39 @@ static int out_set_volume(struct audio_stream_out *stream, float left,
 {
     struct stream_out *out = (struct stream_out *)stream;
     struct audio_device *adev = out->dev;
-    int offload_volume[2];//For stereo
+    long offload_volume[2];//For stereo
+    struct mixer_ctl *ctl;
+    struct mixer *mixer = NULL;
 
-    if (out->usecase == USECASE_AUDIO_PLAYBACK_MULTI_CH) {
-        /* only take left channel into account: the API is for stereo anyway */
-        out->muted = (left == 0.0f);
+    if (out->usecase != USECASE_AUDIO_PLAYBACK_OFFLOAD) {
+        /* the right gain only applies to stereo streams: the API is for stereo anyway */
+        pthread_mutex_lock(&out->lock);
+        out_set_gain_l(out, left, right);
+        pthread_mutex_unlock(&out->lock);
         return 0;
-    } else if (out->usecase == USECASE_AUDIO_PLAYBACK_OFFLOAD) {
-        struct mixer_ctl *ctl;
-        struct mixer *mixer = NULL;
+    }
 
-        offload_volume[0] = (int)(left * COMPRESS_PLAYBACK_VOLUME_MAX);
-        offload_volume[1] = (int)(right * COMPRESS_PLAYBACK_VOLUME_MAX);
+    offload_volume[0] = (long)(left * COMPRESS_PLAYBACK_VOLUME_MAX);
+    offload_volume[1] = (long)(right * COMPRESS_PLAYBACK_VOLUME_MAX);
 
-        mixer = mixer_open(MIXER_CARD);
-        if (!mixer) {
-            ALOGE("%s unable to open the mixer for card %d, aborting.",
-                    __func__, MIXER_CARD);
-            return -EINVAL;
-        }
-        ctl = mixer_get_ctl_by_name(mixer, MIXER_CTL_COMPRESS_PLAYBACK_VOLUME);
-        if (!ctl) {
-            ALOGE("%s: Could not get ctl for mixer cmd - %s",
-                  __func__, MIXER_CTL_COMPRESS_PLAYBACK_VOLUME);
-            mixer_close(mixer);
-            return -EINVAL;
-        }
-        ALOGD("out_set_volume set offload volume (%f, %f)", left, right);
-        mixer_ctl_set_array(ctl, offload_volume,
-                            sizeof(offload_volume)/sizeof(offload_volume[0]));
+    mixer = mixer_open(MIXER_CARD);
+    if (!mixer) {
+        ALOGE("%s unable to open the mixer for card %d, aborting.",
+                __func__, MIXER_CARD);
+        return -EINVAL;
+    }
+    ctl = mixer_get_ctl_by_name(mixer, MIXER_CTL_COMPRESS_PLAYBACK_VOLUME);
+    if (!ctl) {
+        ALOGE("%s: Could not get ctl for mixer cmd - %s",
+              __func__, MIXER_CTL_COMPRESS_PLAYBACK_VOLUME);
         mixer_close(mixer);
-        return 0;
+        return -EINVAL;
     }
-
-    return -ENOSYS;
+    ALOGD("out_set_volume set offload volume (%f, %f)", left, right);
+    mixer_ctl_set_array(ctl, offload_volume,
+                        sizeof(offload_volume)/sizeof(offload_volume[0]));
+    mixer_close(mixer);
+    return 0;
 }
 
 static void *tfa9895_config_thread(void *context)
@@ -2908,6 +5101,7 @@ static void *tfa9895_config_thread(void *context)
     if (!adev->tfa9895_init) {
         ALOGE("set_amp_mode failed, need to re-config again");
         adev->tfa9895_mode_change |= 0x1;
+        publish_control_change(adev);
     }
     ALOGI("@@##tfa9895_config_thread Done!! tfa9895_mode_change=%d", adev->tfa9895_mode_change);
     pthread_mutex_unlock(&adev->tfa9895_lock);
@@ -2915,6 +5109,32 @@ static void *tfa9895_config_thread(void *context)
     return NULL;
 }
 
+/* tinyalsa recovers from underruns inside pcm_write() without reporting them:
+ * an underrun is assumed when the time since the end of the previous write is
+ * longer than the kernel buffer, which was full then.
+ * must be called with out->lock locked */
+static void out_check_underrun_l(struct stream_out *out, int64_t now_ns)
+{
+    int64_t buffer_ns;
+
+    if (out->last_write_end_ns == 0 || out->config.rate == 0)
+        return;
+    buffer_ns = (int64_t)out->config.period_size * out->config.period_count *
+                1000000000LL / out->config.rate;
+    if (now_ns - out->last_write_end_ns > buffer_ns) {
+        android_atomic_inc(&out->underruns);
+        ATRACE_INT("out_underruns", out->underruns);
+        ALOGV("%s: underrun, no write for %lld us", __func__,
+              (long long)((now_ns - out->last_write_end_ns) / 1000));
+    }
+}
+
+static void out_write_done(struct stream_out *out, int64_t begin_ns)
+{
+    latency_hist_add(&out->write_time, get_monotonic_ns() - begin_ns);
+    ATRACE_END();
+}
+
 static ssize_t out_write(struct audio_stream_out *stream, const void *buffer,
                          size_t bytes)
 {
@@ -2932,21 +5152,28 @@ static ssize_t out_write(struct audio_stream_out *stream, const void *buffer,
     size_t out_frames = in_frames;
     struct stream_in *in = NULL;
 #endif
+    int64_t begin_ns = get_monotonic_ns();
+    int64_t start_ns;
 
-    pthread_mutex_lock(&out->lock);
+    ATRACE_BEGIN("out_write");
+    mutex_lock_timed(&out->lock, &out->lock_wait);
     if (out->standby) {
 #ifdef PREPROCESSING_ENABLED
         pthread_mutex_unlock(&out->lock);
         /* Prevent input stream from being closed */
-        pthread_mutex_lock(&adev->lock_inputs);
+        mutex_lock_timed(&adev->lock_inputs, &adev->lock_inputs_wait);
         pthread_mutex_lock(&out->lock);
         if (!out->standby) {
             pthread_mutex_unlock(&adev->lock_inputs);
             goto false_alarm;
         }
 #endif
-        pthread_mutex_lock(&adev->lock);
+        mutex_lock_timed(&adev->lock, &adev->lock_wait);
+        ATRACE_BEGIN("start_output_stream");
+        start_ns = get_monotonic_ns();
         ret = start_output_stream(out);
+        latency_hist_add(&out->start_time, get_monotonic_ns() - start_ns);
+        ATRACE_END();
         /* ToDo: If use case is compress offload should return 0 */
         if (ret != 0) {
             pthread_mutex_unlock(&adev->lock);
@@ -2990,11 +5217,17 @@ false_alarm:
             ALOGVV("send new gapless metadata");
             compress_set_gapless_metadata(out->compr, &out->gapless_mdata);
             out->send_new_metadata = 0;
+            out->next_track_mdata = false;
         }
 
+        start_ns = get_monotonic_ns();
+        ATRACE_BEGIN("compress_write");
         ret = compress_write(out->compr, buffer, bytes);
+        ATRACE_END();
+        latency_hist_add(&out->pcm_write_time, get_monotonic_ns() - start_ns);
         ALOGVV("%s: writing buffer (%d bytes) to compress device returned %d", __func__, bytes, ret);
-        if (ret >= 0 && ret < (ssize_t)bytes) {
+        if (ret >= 0 && ret < (ssize_t)bytes && !out->offload_wait_pending) {
+            out->offload_wait_pending = true;
             send_offload_cmd_l(out, OFFLOAD_CMD_WAIT_FOR_BUFFER);
         }
         if (out->offload_state != OFFLOAD_STATE_PLAYING) {
@@ -3008,36 +5241,50 @@ false_alarm:
             pthread_mutex_unlock(&adev->lock_inputs);
         }
 #endif
+        out_write_done(out, begin_ns);
         return ret;
     } else {
+        int32_t control_generation = android_atomic_acquire_load(&adev->control_generation);
+        bool check_tfa9895 = false;
+
+        /* Fast path: no route, echo reference or amplifier change was published
+         * since the last write, go straight to the PCM devices */
+        if (control_generation != out->control_generation) {
 #ifdef PREPROCESSING_ENABLED
-        if (android_atomic_acquire_load(&adev->echo_reference_generation)
-                != out->echo_reference_generation) {
-            pthread_mutex_lock(&adev->lock);
-            if (out->echo_reference != NULL) {
-                ALOGV("%s: release_echo_reference %p", __func__, out->echo_reference);
-                release_echo_reference(out->echo_reference);
+            if (android_atomic_acquire_load(&adev->echo_reference_generation)
+                    != out->echo_reference_generation) {
+                pthread_mutex_lock(&adev->lock);
+                if (out->echo_reference != NULL) {
+                    ALOGV("%s: release_echo_reference %p", __func__, out->echo_reference);
+                    release_echo_reference(out->echo_reference);
+                }
+                // note that adev->echo_reference_generation here can be different from the one
+                // tested above but it doesn't matter as we now have the adev mutex and it is
+                // consistent with what has been set by get_echo_reference() or
+                // put_echo_reference()
+                out->echo_reference_generation = adev->echo_reference_generation;
+                out->echo_reference = adev->echo_reference;
+                ALOGV("%s: update echo reference generation %d", __func__,
+                      out->echo_reference_generation);
+                pthread_mutex_unlock(&adev->lock);
             }
-            // note that adev->echo_reference_generation here can be different from the one
-            // tested above but it doesn't matter as we now have the adev mutex and it is consistent
-            // with what has been set by get_echo_reference() or put_echo_reference()
-            out->echo_reference_generation = adev->echo_reference_generation;
-            out->echo_reference = adev->echo_reference;
-            ALOGV("%s: update echo reference generation %d", __func__,
-                  out->echo_reference_generation);
-            pthread_mutex_unlock(&adev->lock);
-        }
 #endif
+            check_tfa9895 = (adev->tfa9895_mode_change == 0x1);
+            out->control_generation = control_generation;
+            if (out->usecase == USECASE_AUDIO_PLAYBACK_DEEP_BUFFER &&
+                    out->long_wakeups != adev->screen_off)
+                out_switch_wakeups_l(out, adev->screen_off);
+        }
 
-        if (out->muted)
-            memset((void *)buffer, 0, bytes);
+        buffer = out_apply_gain_l(out, buffer, bytes / frame_size, frame_size / sizeof(int16_t));
         list_for_each(node, &out->pcm_dev_list) {
             pcm_device = node_to_item(node, struct pcm_device, stream_list_node);
             if (pcm_device->resampler) {
-                if (bytes * pcm_device->pcm_profile->config.rate / out->sample_rate + frame_size
+                out_get_pcm_config(out, pcm_device->pcm_profile, &config);
+                if (bytes * config.rate / out->sample_rate + frame_size
                         > pcm_device->res_byte_count) {
                     pcm_device->res_byte_count =
-                        bytes * pcm_device->pcm_profile->config.rate / out->sample_rate + frame_size;
+                        bytes * config.rate / out->sample_rate + frame_size;
                     pcm_device->res_buffer =
                         realloc(pcm_device->res_buffer, pcm_device->res_byte_count);
                     ALOGV("%s: resampler res_byte_count = %zu", __func__,
@@ -3062,7 +5309,7 @@ false_alarm:
                     out->echo_reference->write(out->echo_reference, &b);
                  }
 #endif
-                if (adev->tfa9895_mode_change == 0x1) {
+                if (check_tfa9895) {
                     if (out->devices & AUDIO_DEVICE_OUT_SPEAKER) {
                         pthread_mutex_lock(&adev->tfa9895_lock);
                         data = (unsigned char *)
@@ -3072,8 +5319,7 @@ false_alarm:
                             int i;
 
                             // reopen pcm with stop_threshold = INT_MAX/2
-                            memcpy(&config, &pcm_device->pcm_profile->config,
-                                    sizeof(struct pcm_config));
+                            out_get_pcm_config(out, pcm_device->pcm_profile, &config);
                             config.stop_threshold = INT_MAX/2;
 
                             if (pcm_device->pcm)
@@ -3112,10 +5358,11 @@ false_alarm:
                             if (pcm_device->pcm)
                                 pcm_close(pcm_device->pcm);
 
+                            out_get_pcm_config(out, pcm_device->pcm_profile, &config);
                             for (i = 0; i < RETRY_NUMBER; i++) {
                                 pcm_device->pcm = pcm_open(pcm_device->pcm_profile->card,
                                         pcm_device->pcm_profile->id,
-                                        PCM_OUT | PCM_MONOTONIC, &pcm_device->pcm_profile->config);
+                                        PCM_OUT | PCM_MONOTONIC, &config);
                                 if (pcm_device->pcm != NULL && pcm_is_ready(pcm_device->pcm))
                                     break;
                                 else
@@ -3123,8 +5370,10 @@ false_alarm:
                             }
                             if (i >= RETRY_NUMBER) {
                                 ALOGE("%s: failed to reopen pcm device, error return", __func__);
+                                out->control_generation = 0;
                                 pthread_mutex_unlock(&adev->tfa9895_lock);
                                 pthread_mutex_unlock(&out->lock);
+                                out_write_done(out, begin_ns);
                                 return -1;
                             }
                         }
@@ -3132,18 +5381,26 @@ false_alarm:
                     pthread_mutex_unlock(&adev->tfa9895_lock);
                 }
                 ALOGVV("%s: writing buffer (%d bytes) to pcm device", __func__, bytes);
+                start_ns = get_monotonic_ns();
+                out_check_underrun_l(out, start_ns);
+                ATRACE_BEGIN("pcm_write");
                 if (pcm_device->resampler && pcm_device->res_buffer)
                     pcm_device->status =
                         pcm_write(pcm_device->pcm, (void *)pcm_device->res_buffer,
                             frames_wr * frame_size);
                 else
                     pcm_device->status = pcm_write(pcm_device->pcm, (void *)buffer, bytes);
+                ATRACE_END();
+                out->last_write_end_ns = get_monotonic_ns();
+                latency_hist_add(&out->pcm_write_time, out->last_write_end_ns - start_ns);
                 if (pcm_device->status != 0)
                     ret = pcm_device->status;
             }
         }
+        /* in frames of the stream: its channel count and format can differ
+         * from a stereo 16 bit PCM config */
         if (ret == 0)
-            out->written += bytes / (out->config.channels * sizeof(short));
+            out->written += bytes / frame_size;
     }
 
 exit:
@@ -3174,26 +5431,84 @@ exit:
     }
 #endif
 
+    out_write_done(out, begin_ns);
     return bytes;
 }
 
+/* Returns the number of frames presented at the codec output at time timestamp,
+ * that is the frames rendered minus those still in the post render pipeline.
+ * must be called with out->lock locked */
+static int out_get_presented_frames_l(struct stream_out *out, uint64_t *frames,
+                                      struct timespec *timestamp)
+{
+    int64_t signed_frames;
+    int64_t latency_frames = render_latency(out->dev, out->usecase) *
+                             out->sample_rate / 1000000LL;
+
+    if (out->usecase == USECASE_AUDIO_PLAYBACK_OFFLOAD) {
+        unsigned long dsp_frames;
+
+        if (out->compr == NULL)
+            return -ENODEV;
+        if (compress_get_tstamp(out->compr, &dsp_frames, &out->sample_rate) < 0)
+            return -EIO;
+        /* the DSP does not timestamp its position: take the time right after
+         * reading it so that both stay paired */
+        clock_gettime(CLOCK_MONOTONIC, timestamp);
+        ALOGVV("%s rendered frames %ld sample_rate %d",
+               __func__, dsp_frames, out->sample_rate);
+        signed_frames = (int64_t)dsp_frames - latency_frames;
+    } else {
+        unsigned int avail;
+        struct pcm_device *pcm_device;
+        size_t kernel_buffer_size;
+
+        /* FIXME: which device to read from? */
+        if (list_empty(&out->pcm_dev_list))
+            return -ENODEV;
+        pcm_device = node_to_item(list_head(&out->pcm_dev_list),
+                                  struct pcm_device, stream_list_node);
+        if (pcm_device->pcm == NULL ||
+                pcm_get_htimestamp(pcm_device->pcm, &avail, timestamp) != 0)
+            return -EIO;
+
+        kernel_buffer_size = out->config.period_size * out->config.period_count;
+        signed_frames = out->written - kernel_buffer_size + avail;
+        /* This adjustment accounts for buffering after app processor.
+           It is based on the latency calibrated for the current route. */
+        signed_frames -= latency_frames;
+    }
+
+    /* It would be unusual for this value to be negative, but check just in case ... */
+    if (signed_frames < 0)
+        return -EAGAIN;
+
+    *frames = signed_frames;
+    return 0;
+}
+
 static int out_get_render_position(const struct audio_stream_out *stream,
                                    uint32_t *dsp_frames)
 {
     struct stream_out *out = (struct stream_out *)stream;
+    uint64_t frames;
+    struct timespec timestamp;
+    int ret;
+
+    if (dsp_frames == NULL)
+        return -EINVAL;
+
     *dsp_frames = 0;
-    if ((out->usecase == USECASE_AUDIO_PLAYBACK_OFFLOAD) && (dsp_frames != NULL)) {
-        pthread_mutex_lock(&out->lock);
-        if (out->compr != NULL) {
-            compress_get_tstamp(out->compr, (unsigned long *)dsp_frames,
-                    &out->sample_rate);
-            ALOGVV("%s rendered frames %d sample_rate %d",
-                   __func__, *dsp_frames, out->sample_rate);
-        }
-        pthread_mutex_unlock(&out->lock);
+    pthread_mutex_lock(&out->lock);
+    ret = out_get_presented_frames_l(out, &frames, &timestamp);
+    pthread_mutex_unlock(&out->lock);
+
+    if (ret == 0)
+        *dsp_frames = (uint32_t)frames;
+    /* the offload position is 0 until the DSP starts rendering */
+    if (out->usecase == USECASE_AUDIO_PLAYBACK_OFFLOAD)
         return 0;
-    } else
-        return -EINVAL;
+    return ret;
 }
 
 static int out_add_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
@@ -3222,49 +5537,13 @@ static int out_get_presentation_position(const struct audio_stream_out *stream,
                                    uint64_t *frames, struct timespec *timestamp)
 {
     struct stream_out *out = (struct stream_out *)stream;
-    int ret = -1;
-    unsigned long dsp_frames;
+    int ret;
 
     pthread_mutex_lock(&out->lock);
-
-    if (out->usecase == USECASE_AUDIO_PLAYBACK_OFFLOAD) {
-        if (out->compr != NULL) {
-            compress_get_tstamp(out->compr, &dsp_frames,
-                    &out->sample_rate);
-            ALOGVV("%s rendered frames %ld sample_rate %d",
-                   __func__, dsp_frames, out->sample_rate);
-            *frames = dsp_frames;
-            ret = 0;
-            /* this is the best we can do */
-            clock_gettime(CLOCK_MONOTONIC, timestamp);
-        }
-    } else {
-        /* FIXME: which device to read from? */
-        if (!list_empty(&out->pcm_dev_list)) {
-            unsigned int avail;
-            struct pcm_device *pcm_device = node_to_item(list_head(&out->pcm_dev_list),
-                                                   struct pcm_device, stream_list_node);
-
-            if (pcm_get_htimestamp(pcm_device->pcm, &avail, timestamp) == 0) {
-                size_t kernel_buffer_size = out->config.period_size * out->config.period_count;
-                int64_t signed_frames = out->written - kernel_buffer_size + avail;
-                /* This adjustment accounts for buffering after app processor.
-                   It is based on estimated DSP latency per use case, rather than exact. */
-                signed_frames -=
-                    (render_latency(out->usecase) * out->sample_rate / 1000000LL);
-
-                /* It would be unusual for this value to be negative, but check just in case ... */
-                if (signed_frames >= 0) {
-                    *frames = signed_frames;
-                    ret = 0;
-                }
-            }
-        }
-    }
-
+    ret = out_get_presented_frames_l(out, frames, timestamp);
     pthread_mutex_unlock(&out->lock);
 
-    return ret;
+    return ret == 0 ? 0 : -1;
 }
 
 static int out_set_callback(struct audio_stream_out *stream,
@@ -3326,9 +5605,21 @@ static int out_drain(struct audio_stream_out* stream, audio_drain_type_t type )
     ALOGV("%s", __func__);
     if (out->usecase == USECASE_AUDIO_PLAYBACK_OFFLOAD) {
         pthread_mutex_lock(&out->lock);
-        if (type == AUDIO_DRAIN_EARLY_NOTIFY)
+        if (type == AUDIO_DRAIN_EARLY_NOTIFY) {
+            /* Open the next track slot right away instead of after the partial
+             * drain: its data and gapless metadata can be queued to the DSP
+             * while the current track plays out, leaving no gap between them.
+             * Only metadata set for the next track is sent here, metadata
+             * left over from the current one would be applied to it. */
+            if (out->compr != NULL && compress_next_track(out->compr) == 0) {
+                if (out->next_track_mdata) {
+                    compress_set_gapless_metadata(out->compr, &out->gapless_mdata);
+                    out->send_new_metadata = 0;
+                    out->next_track_mdata = false;
+                }
+            }
             status = send_offload_cmd_l(out, OFFLOAD_CMD_PARTIAL_DRAIN);
-        else
+        } else
             status = send_offload_cmd_l(out, OFFLOAD_CMD_DRAIN);
         pthread_mutex_unlock(&out->lock);
     }
@@ -3399,7 +5690,8 @@ static size_t in_get_buffer_size(const struct audio_stream *stream)
     return get_input_buffer_size(in->requested_rate,
                                  in_get_format(stream),
                                  audio_channel_count_from_in_mask(in->main_channels),
-                                 in->devices);
+                                 in->devices,
+                                 in->usecase == USECASE_AUDIO_CAPTURE_LOW_LATENCY);
 }
 
 static int in_close_pcm_devices(struct stream_in *in)
@@ -3423,16 +5715,48 @@ static int in_close_pcm_devices(struct stream_in *in)
 }
 
 
+/* must be called with adev->lock_inputs, in->lock and adev->lock locked */
+static void in_clear_warm_standby_l(struct stream_in *in)
+{
+    struct audio_device *adev = in->dev;
+
+    if (!in->warm_standby)
+        return;
+    in->warm_standby = false;
+    pthread_mutex_lock(&adev->warm_standby_lock);
+    if (adev->warm_input == in) {
+        adev->warm_input = NULL;
+        adev->warm_standby_armed = false;
+        pthread_cond_broadcast(&adev->warm_standby_cond);
+    }
+    pthread_mutex_unlock(&adev->warm_standby_lock);
+}
+
 /* must be called with stream and hw device mutex locked */
 static int do_in_standby_l(struct stream_in *in)
 {
     int status = 0;
-
-#ifdef PREPROCESSING_ENABLED
     struct audio_device *adev = in->dev;
-#endif
-    if (!in->standby) {
+    struct pcm_device *pcm_device;
+    struct listnode *node;
+
+    /* a warm stream is in standby but still holds its PCM and route */
+    if (!in->standby || in->warm_standby) {
+        int64_t begin_ns = get_monotonic_ns();
+
+        in_clear_warm_standby_l(in);
 
+        struct pcm *shared_pcm = adev->capture_source.pcm;
+        bool source_busy = in->capture_shared && capture_source_detach_l(in);
+
+        if (source_busy) {
+            /* other streams still read from the PCM: only drop our reference */
+            list_for_each(node, &in->pcm_dev_list) {
+                pcm_device = node_to_item(node, struct pcm_device, stream_list_node);
+                if (pcm_device->pcm == shared_pcm)
+                    pcm_device->pcm = NULL;
+            }
+        }
         in_close_pcm_devices(in);
 
 #ifdef PREPROCESSING_ENABLED
@@ -3442,25 +5766,18 @@ static int do_in_standby_l(struct stream_in *in)
             put_echo_reference(adev, in->echo_reference);
             in->echo_reference = NULL;
         }
-#ifdef HW_AEC_LOOPBACK
-        if (in->hw_echo_reference)
-        {
-            if (in->hw_ref_buf) {
-                free(in->hw_ref_buf);
-                in->hw_ref_buf = NULL;
-            }
-        }
-#endif  // HW_AEC_LOOPBACK
 #endif  // PREPROCESSING_ENABLED
 
-        status = stop_input_stream(in);
-
-        if (in->read_buf) {
-            free(in->read_buf);
-            in->read_buf = NULL;
-        }
+        /* read and reference buffers belong to in->buf_arena, kept until close */
+        if (source_busy) {
+            /* the usecase and routing stay with the remaining streams */
+            in_release_pcm_devices(in);
+            list_init(&in->pcm_dev_list);
+        } else
+            status = stop_input_stream(in);
 
         in->standby = 1;
+        latency_hist_add(&in->standby_time, get_monotonic_ns() - begin_ns);
     }
     return 0;
 }
@@ -3471,7 +5788,7 @@ static int in_standby_l(struct stream_in *in)
     struct audio_device *adev = in->dev;
     int status = 0;
     pthread_mutex_lock(&in->lock);
-    if (!in->standby) {
+    if (!in->standby || in->warm_standby) {
         pthread_mutex_lock(&adev->lock);
         status = do_in_standby_l(in);
         pthread_mutex_unlock(&adev->lock);
@@ -3480,6 +5797,106 @@ static int in_standby_l(struct stream_in *in)
     return status;
 }
 
+/* Warm standby.
+ * Restarting an input after standby reselects the devices, applies the route and
+ * opens the PCM again. When the framework puts an input in standby, its PCM is
+ * only stopped instead: it stays open with its route for adev->warm_standby_ms and
+ * the next in_read() just restarts it, see in_resume_warm_standby_l(). The
+ * warm_standby_thread then completes the standby if the stream was not restarted.
+ * Any routing or effect change, or another input starting, also completes it as
+ * the PCM and route may not suit them. Only an input capturing alone without echo
+ * reference goes to warm standby. */
+
+/* must be called with adev->lock_inputs, in->lock and adev->lock locked */
+static bool in_can_warm_standby_l(struct stream_in *in)
+{
+    struct audio_device *adev = in->dev;
+
+    if (adev->warm_standby_ms <= 0 || !in->capture_shared ||
+            adev->capture_source.num_clients != 1 || in->enable_aec)
+        return false;
+#ifdef PREPROCESSING_ENABLED
+    if (in->echo_reference != NULL)
+        return false;
+#ifdef HW_AEC_LOOPBACK
+    if (in->hw_echo_reference)
+        return false;
+#endif
+#endif
+    return true;
+}
+
+/* must be called with adev->lock_inputs locked */
+static int in_warm_standby_l(struct stream_in *in)
+{
+    struct audio_device *adev = in->dev;
+    struct pcm_device *pcm_device;
+    struct listnode *node;
+    int status = 0;
+
+    pthread_mutex_lock(&in->lock);
+    if (!in->standby) {
+        pthread_mutex_lock(&adev->lock);
+        if (in_can_warm_standby_l(in)) {
+            list_for_each(node, &in->pcm_dev_list) {
+                pcm_device = node_to_item(node, struct pcm_device, stream_list_node);
+                if (pcm_device->pcm != NULL)
+                    pcm_stop(pcm_device->pcm);
+            }
+            in->standby = 1;
+            in->warm_standby = true;
+            pthread_mutex_lock(&adev->warm_standby_lock);
+            adev->warm_input = in;
+            get_deadline(&adev->warm_standby_deadline, adev->warm_standby_ms);
+            adev->warm_standby_armed = true;
+            pthread_cond_broadcast(&adev->warm_standby_cond);
+            pthread_mutex_unlock(&adev->warm_standby_lock);
+            ALOGV("%s: usecase(%d) warm for %d ms", __func__, in->usecase,
+                  adev->warm_standby_ms);
+        } else
+            status = do_in_standby_l(in);
+        pthread_mutex_unlock(&adev->lock);
+    }
+    pthread_mutex_unlock(&in->lock);
+    return status;
+}
+
+/* Restarts a stream from warm standby: the PCM restarts on the next read.
+ * must be called with adev->lock_inputs, in->lock and adev->lock locked */
+static void in_resume_warm_standby_l(struct stream_in *in)
+{
+    in_clear_warm_standby_l(in);
+    in->read_buf_frames = 0;
+    in->proc_buf_frames = 0;
+#ifdef PREPROCESSING_ENABLED
+    in->proc_out_frames = 0;
+#endif
+    in->xrun_clock.last_ns = 0;
+    if (in->capture_shared) {
+        pthread_mutex_lock(&in->dev->capture_source.lock);
+        in->dev->capture_source.xrun_clock.last_ns = 0;
+        pthread_mutex_unlock(&in->dev->capture_source.lock);
+    }
+    if (in->resampler != NULL)
+        in->resampler->reset(in->resampler);
+    ALOGV("%s: usecase(%d)", __func__, in->usecase);
+}
+
+/* Completes the standby of the input in warm standby, if any other than in.
+ * must be called with adev->lock_inputs locked and no stream_in mutex locked */
+static void in_end_warm_standby_l(struct audio_device *adev, struct stream_in *in)
+{
+    struct stream_in *warm = adev->warm_input;
+
+    if (warm == NULL || warm == in)
+        return;
+    pthread_mutex_lock(&warm->lock);
+    pthread_mutex_lock(&adev->lock);
+    do_in_standby_l(warm);
+    pthread_mutex_unlock(&adev->lock);
+    pthread_mutex_unlock(&warm->lock);
+}
+
 static int in_standby(struct audio_stream *stream)
 {
     struct stream_in *in = (struct stream_in *)stream;
@@ -3487,7 +5904,7 @@ static int in_standby(struct audio_stream *stream)
     int status;
     ALOGV("%s: enter", __func__);
     pthread_mutex_lock(&adev->lock_inputs);
-    status = in_standby_l(in);
+    status = in_warm_standby_l(in);
     pthread_mutex_unlock(&adev->lock_inputs);
     ALOGV("%s: exit:  status(%d)", __func__, status);
     return status;
@@ -3495,8 +5912,55 @@ static int in_standby(struct audio_stream *stream)
 
 static int in_dump(const struct audio_stream *stream, int fd)
 {
-    (void)stream;
-    (void)fd;
+    struct stream_in *in = (struct stream_in *)stream;
+    size_t effect_frames = 0;
+    int64_t resampler_delay_ns = 0;
+
+    pthread_mutex_lock(&in->lock);
+    /* frames held between the PCM and the client: a growing backlog means the
+     * capture buffers are too small to absorb the processing */
+    if (in->resampler != NULL)
+        resampler_delay_ns = in->resampler->delay_ns(in->resampler);
+#ifdef PREPROCESSING_ENABLED
+    effect_frames = in->proc_buf_frames + in->proc_out_frames;
+#endif
+    dprintf(fd, "  Capture: overruns %u, read errors %u, frames lost %llu "
+            "(shared ring %llu)\n",
+            in->overruns, in->read_errors, (unsigned long long)in->frames_lost_total,
+            (unsigned long long)in->capture_ring_dropped);
+    dprintf(fd, "  Capture backlog: read buffer %zu frames, resampler %lld us, "
+            "effects %zu frames\n",
+            in->read_buf_frames, (long long)(resampler_delay_ns / 1000), effect_frames);
+    dprintf(fd, "  Start latency: cold %u (last %lld us, avg %lld us, max %lld us), "
+            "warm %u (last %lld us, avg %lld us, max %lld us)%s\n",
+            in->cold_start.count, (long long)(in->cold_start.last_ns / 1000),
+            (long long)(in->cold_start.count ?
+                    in->cold_start.total_ns / in->cold_start.count / 1000 : 0),
+            (long long)(in->cold_start.max_ns / 1000),
+            in->warm_start.count, (long long)(in->warm_start.last_ns / 1000),
+            (long long)(in->warm_start.count ?
+                    in->warm_start.total_ns / in->warm_start.count / 1000 : 0),
+            (long long)(in->warm_start.max_ns / 1000),
+            in->warm_standby ? ", in warm standby" : "");
+    latency_hist_dump(fd, "Read time", &in->read_time);
+    latency_hist_dump(fd, "Blocked in read", &in->pcm_read_time);
+    latency_hist_dump(fd, "Stream lock wait", &in->lock_wait);
+    latency_hist_dump(fd, "Standby time", &in->standby_time);
+
+#ifdef PREPROCESSING_ENABLED
+    if (in->echo_reference != NULL) {
+        struct echo_ref_sync *sync = &in->echo_ref_sync;
+
+        dprintf(fd, "  Echo reference: %s, delay %lld us, alignment error %lld us "
+                "(max %lld us), drift %d ppm, relocks %u\n",
+                sync->locked ? "locked" : "unlocked",
+                (long long)(sync->target_delay_ns / 1000),
+                (long long)(sync->error_ns / 1000),
+                (long long)(sync->max_error_ns / 1000),
+                (int)((sync->ratio - 1.0f) * 1000000), sync->relocks);
+    }
+#endif
+    pthread_mutex_unlock(&in->lock);
 
     return 0;
 }
@@ -3557,6 +6021,9 @@ static int in_set_parameters(struct audio_stream *stream, const char *kvpairs)
                     ret = do_in_standby_l(in);
                 } else
                     ret = select_devices(adev, in->usecase);
+            } else if (in->warm_standby) {
+                /* route the next start on the new device */
+                ret = do_in_standby_l(in);
             }
         }
     }
@@ -3594,8 +6061,10 @@ static ssize_t read_bytes_from_dsp(struct stream_in *in, void* buffer,
     pcm_device = node_to_item(list_head(&in->pcm_dev_list),
                               struct pcm_device, stream_list_node);
 
+    /* negative errors are returned as size_t */
     if (pcm_device->sound_trigger_handle > 0)
-        return adev->sound_trigger_read_samples(pcm_device->sound_trigger_handle, buffer, bytes);
+        return (ssize_t)adev->sound_trigger_read_samples(pcm_device->sound_trigger_handle,
+                                                          buffer, bytes);
     else
         return 0;
 }
@@ -3610,33 +6079,50 @@ static ssize_t in_read(struct audio_stream_in *stream, void *buffer,
     int read_and_process_successful = false;
 
     size_t frames_rq = bytes / audio_stream_in_frame_size(stream);
+    int64_t begin_ns = get_monotonic_ns();
 
+    ATRACE_BEGIN("in_read");
     /* no need to acquire adev->lock_inputs because API contract prevents a close */
-    pthread_mutex_lock(&in->lock);
+    mutex_lock_timed(&in->lock, &in->lock_wait);
     if (in->standby) {
+        int64_t start_begin_ns = get_monotonic_ns();
+
         pthread_mutex_unlock(&in->lock);
-        pthread_mutex_lock(&adev->lock_inputs);
+        mutex_lock_timed(&adev->lock_inputs, &adev->lock_inputs_wait);
+        /* this stream may need the PCM kept by a warm stream */
+        in_end_warm_standby_l(adev, in);
         pthread_mutex_lock(&in->lock);
         if (!in->standby) {
             pthread_mutex_unlock(&adev->lock_inputs);
             goto false_alarm;
         }
-        pthread_mutex_lock(&adev->lock);
-        ret = start_input_stream(in);
+        mutex_lock_timed(&adev->lock, &adev->lock_wait);
+        in->start_warm = in->warm_standby;
+        if (in->warm_standby) {
+            in_resume_warm_standby_l(in);
+            ret = 0;
+        } else
+            ret = start_input_stream(in);
         pthread_mutex_unlock(&adev->lock);
         pthread_mutex_unlock(&adev->lock_inputs);
         if (ret != 0) {
             goto exit;
         }
         in->standby = 0;
+        in->start_pending = true;
+        in->start_begin_ns = start_begin_ns;
     }
 false_alarm:
 
     if (!list_empty(&in->pcm_dev_list)) {
         if (in->usecase == USECASE_AUDIO_CAPTURE_HOTWORD) {
-            bytes = read_bytes_from_dsp(in, buffer, bytes);
-            if (bytes > 0)
+            /* blocks until the sound trigger streaming ring has data: a timeout
+             * returns 0 bytes and keeps the stream open */
+            ssize_t bytes_rd = read_bytes_from_dsp(in, buffer, bytes);
+            if (bytes_rd >= 0) {
+                bytes = bytes_rd;
                 read_and_process_successful = true;
+            }
         } else {
             /*
              * Read PCM and:
@@ -3644,7 +6130,20 @@ false_alarm:
              * - process if pre-processors are attached
              * - discard unwanted channels
              */
-            frames = read_and_process_frames(in, buffer, frames_rq);
+            ssize_t frames_rd = 0;
+
+            /* read_and_process_frames() may return less than asked for: requests
+             * larger than the stream buffers are read in chunks */
+            for (frames = 0; frames < (ssize_t)frames_rq; frames += frames_rd) {
+                frames_rd = read_and_process_frames(in,
+                        (char *)buffer + frames * audio_stream_in_frame_size(stream),
+                        frames_rq - frames);
+                if (frames_rd <= 0) {
+                    if (frames_rd < 0)
+                        frames = frames_rd;
+                    break;
+                }
+            }
             if (frames >= 0)
                 read_and_process_successful = true;
         }
@@ -3657,23 +6156,68 @@ false_alarm:
     if (read_and_process_successful == true && adev->mic_mute)
         memset(buffer, 0, bytes);
 
+    if (read_and_process_successful == true && in->start_pending) {
+        struct start_latency_stats *stats = in->start_warm ? &in->warm_start : &in->cold_start;
+
+        in->start_pending = false;
+        stats->last_ns = get_monotonic_ns() - in->start_begin_ns;
+        stats->total_ns += stats->last_ns;
+        if (stats->last_ns > stats->max_ns)
+            stats->max_ns = stats->last_ns;
+        stats->count++;
+        ALOGV("%s: %s start in %lld us", __func__, in->start_warm ? "warm" : "cold",
+              (long long)(stats->last_ns / 1000));
+    }
+
 exit:
     pthread_mutex_unlock(&in->lock);
 
     if (read_and_process_successful == false) {
-        in_standby(&in->stream.common);
+        /* the frames of this buffer are replaced by the sleep below */
+        pthread_mutex_lock(&in->lock);
+        in->read_errors++;
+        in->frames_lost += frames_rq;
+        in->frames_lost_total += frames_rq;
+        pthread_mutex_unlock(&in->lock);
+        pthread_mutex_lock(&adev->lock_inputs);
+        in_standby_l(in);
+        pthread_mutex_unlock(&adev->lock_inputs);
         ALOGV("%s: read failed - sleeping for buffer duration", __func__);
         usleep(bytes * 1000000 / audio_stream_in_frame_size(stream) /
                in->requested_rate);
     }
+    latency_hist_add(&in->read_time, get_monotonic_ns() - begin_ns);
+    ATRACE_END();
     return bytes;
 }
 
 static uint32_t in_get_input_frames_lost(struct audio_stream_in *stream)
 {
-    (void)stream;
+    struct stream_in *in = (struct stream_in *)stream;
+    struct capture_source *source = &in->dev->capture_source;
+    uint64_t dropped;
+    uint32_t frames_lost;
 
-    return 0;
+    pthread_mutex_lock(&in->lock);
+    /* frames overwritten in the ring of a stream sharing the capture PCM, and
+     * frames discarded by the driver on overruns */
+    pthread_mutex_lock(&source->lock);
+    dropped = in->capture_ring_dropped - in->capture_ring_dropped_reported;
+    in->capture_ring_dropped_reported = in->capture_ring_dropped;
+    dropped += in->capture_overrun_lost;
+    in->capture_overrun_lost = 0;
+    pthread_mutex_unlock(&source->lock);
+    if (dropped != 0) {
+        dropped = in_pcm_to_client_frames(in, dropped);
+        in->frames_lost += dropped;
+        in->frames_lost_total += dropped;
+    }
+
+    frames_lost = in->frames_lost;
+    in->frames_lost = 0;
+    pthread_mutex_unlock(&in->lock);
+
+    return frames_lost;
 }
 
 static int add_remove_audio_effect(const struct audio_stream *stream,
@@ -3696,6 +6240,9 @@ static int add_remove_audio_effect(const struct audio_stream *stream,
     pthread_mutex_lock(&adev->lock_inputs);
     pthread_mutex_lock(&in->lock);
     pthread_mutex_lock(&in->dev->lock);
+    /* effects are configured and their buffers sized at start */
+    if (in->warm_standby)
+        do_in_standby_l(in);
 #ifndef PREPROCESSING_ENABLED
     if ((in->source == AUDIO_SOURCE_VOICE_COMMUNICATION) &&
             in->enable_aec != enable &&
@@ -3797,6 +6344,7 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     struct stream_out *out;
     int i, ret;
     struct pcm_device_profile *pcm_profile;
+    struct snd_compr_caps offload_caps;
 
     ALOGV("%s: enter: sample_rate(%d) channel_mask(%#x) devices(%#x) flags(%#x)",
           __func__, config->sample_rate, config->channel_mask, devices, flags);
@@ -3855,8 +6403,8 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
 
         out->compr_config.codec->id =
                 get_snd_codec_id(config->offload_info.format);
-        out->compr_config.fragment_size = COMPRESS_OFFLOAD_FRAGMENT_SIZE;
-        out->compr_config.fragments = COMPRESS_OFFLOAD_NUM_FRAGMENTS;
+        get_offload_caps(&offload_caps);
+        set_offload_buffer_config(out, &config->offload_info, &offload_caps);
         out->compr_config.codec->sample_rate = config->offload_info.sample_rate;
         out->compr_config.codec->bit_rate =
                     config->offload_info.bit_rate;
@@ -3877,12 +6425,16 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     } else if (out->flags & (AUDIO_OUTPUT_FLAG_DEEP_BUFFER)) {
         out->usecase = USECASE_AUDIO_PLAYBACK_DEEP_BUFFER;
         out->config = pcm_config_deep_buffer;
+        out->long_wakeups = true;
         out->sample_rate = out->config.rate;
         ALOGD("%s: use AUDIO_PLAYBACK_DEEP_BUFFER",__func__);
     } else {
         out->usecase = USECASE_AUDIO_PLAYBACK;
         out->sample_rate = out->config.rate;
     }
+    /* the codec PCM profiles are 16 bit: AudioFlinger converts wider formats */
+    if (out->usecase != USECASE_AUDIO_PLAYBACK_OFFLOAD)
+        out->format = AUDIO_FORMAT_PCM_16_BIT;
 
     if (flags & AUDIO_OUTPUT_FLAG_PRIMARY) {
         if (adev->primary_output == NULL)
@@ -3924,7 +6476,8 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     out->stream.get_presentation_position = out_get_presentation_position;
 
     out->standby = 1;
-    /* out->muted = false; by calloc() */
+    out->gain_target[0] = out->gain_target[1] = 1.0f;
+    out->gain_current[0] = out->gain_current[1] = 1.0f;
     /* out->written = 0; by calloc() */
 
     pthread_mutex_init(&out->lock, (const pthread_mutexattr_t *) NULL);
@@ -3962,6 +6515,7 @@ static void adev_close_output_stream(struct audio_hw_device *dev,
     }
     pthread_cond_destroy(&out->cond);
     pthread_mutex_destroy(&out->lock);
+    free(out->gain_buf);
     free(stream);
     ALOGV("%s: exit", __func__);
 }
@@ -4013,12 +6567,21 @@ static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
             adev->bluetooth_nrec = false;
     }
 
+    ret = str_parms_get_str(parms, AUDIO_PARAMETER_KEY_BT_SCO_WB, value, sizeof(value));
+    if (ret >= 0) {
+        /* applies to the SCO streams started from now on */
+        pthread_mutex_lock(&adev->lock);
+        adev->bt_wb_speech_enabled = strcmp(value, AUDIO_PARAMETER_VALUE_ON) == 0;
+        pthread_mutex_unlock(&adev->lock);
+    }
+
     ret = str_parms_get_str(parms, "screen_state", value, sizeof(value));
     if (ret >= 0) {
-        if (strcmp(value, AUDIO_PARAMETER_VALUE_ON) == 0)
-            adev->screen_off = false;
-        else
-            adev->screen_off = true;
+        /* the deep buffer stream switches its wakeup mode on its next write */
+        pthread_mutex_lock(&adev->lock);
+        adev->screen_off = strcmp(value, AUDIO_PARAMETER_VALUE_ON) != 0;
+        publish_control_change(adev);
+        pthread_mutex_unlock(&adev->lock);
     }
 
     ret = str_parms_get_int(parms, "rotation", &val);
@@ -4073,9 +6636,14 @@ static char* adev_get_parameters(const struct audio_hw_device *dev,
 
 static int adev_init_check(const struct audio_hw_device *dev)
 {
-    (void)dev;
+    struct audio_device *adev = (struct audio_device *)dev;
+    int status;
 
-    return 0;
+    /* a failure of the deferred init is reported if it is already known */
+    pthread_mutex_lock(&adev->init_lock);
+    status = adev->init_phase >= ADEV_INIT_ROUTING ? adev->init_status : 0;
+    pthread_mutex_unlock(&adev->init_lock);
+    return status;
 }
 
 static int adev_set_voice_volume(struct audio_hw_device *dev, float volume)
@@ -4134,6 +6702,7 @@ static int adev_set_mode(struct audio_hw_device *dev, audio_mode_t mode)
         pthread_mutex_lock(&adev->tfa9895_lock);
         adev->tfa9895_mode_change |= 0x1;
         pthread_mutex_unlock(&adev->tfa9895_lock);
+        publish_control_change(adev);
     }
     pthread_mutex_unlock(&adev->lock);
     return 0;
@@ -4175,7 +6744,8 @@ static size_t adev_get_input_buffer_size(const struct audio_hw_device *dev,
     return get_input_buffer_size(config->sample_rate,
                                  config->format,
                                  audio_channel_count_from_in_mask(config->channel_mask),
-                                 AUDIO_DEVICE_IN_BUILTIN_MIC);
+                                 AUDIO_DEVICE_IN_BUILTIN_MIC,
+                                 false);
 }
 
 static int adev_open_input_stream(struct audio_hw_device *dev,
@@ -4240,6 +6810,8 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     /* Update config params with the requested sample rate and channels */
     if (source == AUDIO_SOURCE_HOTWORD) {
         in->usecase = USECASE_AUDIO_CAPTURE_HOTWORD;
+    } else if (flags & AUDIO_INPUT_FLAG_FAST) {
+        in->usecase = USECASE_AUDIO_CAPTURE_LOW_LATENCY;
     } else {
         in->usecase = USECASE_AUDIO_CAPTURE;
     }
@@ -4266,33 +6838,14 @@ static void adev_close_input_stream(struct audio_hw_device *dev,
         free(in->preprocessors[i].channel_configs);
     }
 
-    if (in->read_buf) {
-        free(in->read_buf);
-        in->read_buf = NULL;
-    }
-
-    if (in->proc_buf_in) {
-        free(in->proc_buf_in);
-        in->proc_buf_in = NULL;
-    }
-
-    if (in->proc_buf_out) {
-        free(in->proc_buf_out);
-        in->proc_buf_out = NULL;
-    }
-
-    if (in->ref_buf) {
-        free(in->ref_buf);
-        in->ref_buf = NULL;
-    }
-
     if (in->resampler) {
-        release_resampler(in->resampler);
+        release_stream_resampler(in->resampler);
         in->resampler = NULL;
     }
 #endif
 
     in_standby_l(in);
+    free(in->buf_arena);
     free(stream);
 
     pthread_mutex_unlock(&adev->lock_inputs);
@@ -4302,8 +6855,15 @@ static void adev_close_input_stream(struct audio_hw_device *dev,
 
 static int adev_dump(const audio_hw_device_t *device, int fd)
 {
-    (void)device;
-    (void)fd;
+    struct audio_device *adev = (struct audio_device *)device;
+
+    dprintf(fd, "  Device lock wait from stream threads:\n");
+    latency_hist_dump(fd, "Device lock", &adev->lock_wait);
+    latency_hist_dump(fd, "Inputs lock", &adev->lock_inputs_wait);
+    /* added up when each dummy buffer thread exits, read without its lock which
+     * only lives as long as the thread */
+    dprintf(fd, "  Codec kept powered by the dummy buffer thread: %lld ms\n",
+            (long long)adev->dummybuf_thread_powered_ms);
 
     return 0;
 }
@@ -4311,6 +6871,8 @@ static int adev_dump(const audio_hw_device_t *device, int fd)
 static int adev_close(hw_device_t *device)
 {
     struct audio_device *adev = (struct audio_device *)device;
+    adev_init_thread_close(adev);
+    warm_standby_thread_close(adev);
     audio_device_ref_count--;
     free(adev->snd_dev_ref_cnt);
     free_mixer_list(adev);
@@ -4321,15 +6883,19 @@ static int adev_close(hw_device_t *device)
 static void *dummybuf_thread(void *context)
 {
     ALOGD("%s: enter", __func__);
-    pthread_detach(pthread_self());
     struct audio_device *adev = (struct audio_device *)context;
     struct pcm_config config;
     const char *mixer_ctl_name = "Headphone Jack Switch";
     struct mixer *mixer = NULL;
-    struct mixer_ctl *ctl;
+    struct mixer_ctl *ctl = NULL;
     unsigned char *data = NULL;
     struct pcm *pcm = NULL;
     struct pcm_device_profile *profile = NULL;
+    struct timespec deadline;
+    struct timespec start_ts;
+    struct timespec stop_ts;
+    int retry_num = 0;
+    int64_t powered_ms = 0;
 
     memset(&config, 0, sizeof(struct pcm_config));
     if (adev->dummybuf_thread_devices == AUDIO_DEVICE_OUT_WIRED_HEADPHONE) {
@@ -4340,84 +6906,90 @@ static void *dummybuf_thread(void *context)
         profile = &pcm_device_playback_spk;
 
     memcpy(&config, &profile->config, sizeof(struct pcm_config));
-    /* Use large value for stop_threshold so that automatic
-       trigger for stop is avoided, when this thread fails to write data */
+    /* Start only once the whole buffer is filled and use a large value for
+       stop_threshold so that the DMA keeps cycling over the silence written
+       below: the codec stays clocked without this thread writing again. */
+    config.start_threshold = config.period_size * config.period_count;
     config.stop_threshold = INT_MAX/2;
+    config.avail_min = config.period_size * config.period_count;
+
     pthread_mutex_lock(&adev->dummybuf_thread_lock);
-    pcm = pcm_open(profile->card, profile->id,
-                   (PCM_OUT | PCM_MONOTONIC), &config);
-    if (pcm != NULL && !pcm_is_ready(pcm)) {
-        ALOGE("pcm_open: card=%d, id=%d is not ready", profile->card, profile->id);
-        pcm_close(pcm);
-        pcm = NULL;
-    } else {
-        ALOGD("pcm_open: card=%d, id=%d", profile->card, profile->id);
-    }
+    get_deadline(&deadline, adev->dummybuf_thread_timeout);
 
     if (mixer) {
         ctl = mixer_get_ctl_by_name(mixer, mixer_ctl_name);
-        if (ctl != NULL)
-            mixer_ctl_set_value(ctl, 0, 1);
-        else {
+        if (ctl == NULL) {
             ALOGE("Invalid mixer control: name(%s): skip dummy thread", mixer_ctl_name);
-            adev->dummybuf_thread_active = 1;
             mixer_close(mixer);
-            if (pcm) {
-                pcm_close(pcm);
-                pcm = NULL;
-            }
-            pthread_mutex_unlock(&adev->dummybuf_thread_lock);
-            return NULL;
+            mixer = NULL;
+            goto exit;
         }
+        mixer_ctl_set_value(ctl, 0, 1);
     }
-    pthread_mutex_unlock(&adev->dummybuf_thread_lock);
 
-    while (1) {
-        pthread_mutex_lock(&adev->dummybuf_thread_lock);
-        if (pcm) {
-            if (data == NULL)
-                data = (unsigned char *)calloc(DEEP_BUFFER_OUTPUT_PERIOD_SIZE * 8,
-                            sizeof(unsigned char));
-            if (data) {
-                pcm_write(pcm, (void *)data, DEEP_BUFFER_OUTPUT_PERIOD_SIZE * 8);
-                adev->dummybuf_thread_active = 1;
-            } else {
-                ALOGD("%s: cant open a buffer, retry to open it", __func__);
-            }
-        } else {
-            ALOGD("%s: cant open a output deep stream, retry to open it", __func__);
-            pcm = pcm_open(profile->card, profile->id,
-                   (PCM_OUT | PCM_MONOTONIC), &config);
-            if (pcm != NULL && !pcm_is_ready(pcm)) {
-                ALOGE("pcm_open: card=%d, id=%d is not ready", profile->card, profile->id);
-                pcm_close(pcm);
-                pcm = NULL;
-            } else {
-                ALOGD("pcm_open: card=%d, id=%d", profile->card, profile->id);
-            }
+    while (!adev->dummybuf_thread_cancel) {
+        pcm = pcm_open(profile->card, profile->id,
+                       (PCM_OUT | PCM_MONOTONIC), &config);
+        if (pcm != NULL && pcm_is_ready(pcm))
+            break;
+        ALOGE("pcm_open: card=%d, id=%d is not ready", profile->card, profile->id);
+        if (pcm != NULL) {
+            pcm_close(pcm);
+            pcm = NULL;
         }
+        if (++retry_num > RETRY_NUMBER)
+            goto exit;
+        /* do not spin: wait for the next attempt unless cancelled */
+        get_deadline(&stop_ts, DUMMYBUF_THREAD_RETRY_MS);
+        pthread_cond_timedwait(&adev->dummybuf_thread_cond,
+                               &adev->dummybuf_thread_lock, &stop_ts);
+    }
+    if (pcm == NULL)
+        goto exit;
+    ALOGD("pcm_open: card=%d, id=%d", profile->card, profile->id);
 
-        if (adev->dummybuf_thread_cancel || adev->dummybuf_thread_timeout-- <= 0) {
-            adev->dummybuf_thread_active = 0;
-            adev->dummybuf_thread_cancel = 0;
-            if (pcm) {
-                ALOGD("pcm_close ++ card=%d, id=%d", profile->card, profile->id);
-                pcm_close(pcm);
-                if (mixer) {
-                    mixer_ctl_set_value(ctl, 0, 0);
-                    mixer_close(mixer);
-                }
-                ALOGD("pcm_close -- card=%d, id=%d", profile->card, profile->id);
-                pcm = NULL;
-            }
-            pthread_mutex_unlock(&adev->dummybuf_thread_lock);
+    data = (unsigned char *)calloc(pcm_frames_to_bytes(pcm, pcm_get_buffer_size(pcm)),
+                                   sizeof(unsigned char));
+    if (data == NULL ||
+            pcm_write(pcm, (void *)data, pcm_frames_to_bytes(pcm, pcm_get_buffer_size(pcm))) != 0) {
+        ALOGE("%s: failed to prime silence: %s", __func__, pcm_get_error(pcm));
+        goto exit;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start_ts);
 
+    /* The path is now held open: sleep until timeout or cancel */
+    adev->dummybuf_thread_active = 1;
+    pthread_cond_broadcast(&adev->dummybuf_thread_cond);
+    while (!adev->dummybuf_thread_cancel) {
+        if (pthread_cond_timedwait(&adev->dummybuf_thread_cond,
+                                   &adev->dummybuf_thread_lock, &deadline) == ETIMEDOUT)
             break;
-        }
+    }
 
-        pthread_mutex_unlock(&adev->dummybuf_thread_lock);
-        usleep(3000);
+    clock_gettime(CLOCK_MONOTONIC, &stop_ts);
+    powered_ms = (stop_ts.tv_sec - start_ts.tv_sec) * 1000LL +
+                 (stop_ts.tv_nsec - start_ts.tv_nsec) / 1000000LL;
+    adev->dummybuf_thread_powered_ms += powered_ms;
+    ALOGD("%s: kept card=%d, id=%d powered for %lld ms (%s)", __func__,
+          profile->card, profile->id, (long long)powered_ms,
+          adev->dummybuf_thread_cancel ? "cancelled" : "timeout");
+
+exit:
+    if (pcm) {
+        ALOGD("pcm_close ++ card=%d, id=%d", profile->card, profile->id);
+        pcm_close(pcm);
+        ALOGD("pcm_close -- card=%d, id=%d", profile->card, profile->id);
     }
+    if (mixer) {
+        mixer_ctl_set_value(ctl, 0, 0);
+        mixer_close(mixer);
+    }
+    /* also releases a waiter in adev_open() when the path could not be opened */
+    adev->dummybuf_thread_active = 0;
+    adev->dummybuf_thread_cancel = 0;
+    adev->dummybuf_thread_done = 1;
+    pthread_cond_broadcast(&adev->dummybuf_thread_cond);
+    pthread_mutex_unlock(&adev->dummybuf_thread_lock);
 
     if (data)
         free(data);
@@ -4427,100 +6999,136 @@ static void *dummybuf_thread(void *context)
 
 static void dummybuf_thread_open(struct audio_device *adev)
 {
-    adev->dummybuf_thread_timeout = 6000; /* in 18 sec */
+    pthread_condattr_t attr;
+
+    adev->dummybuf_thread_timeout = DUMMYBUF_THREAD_TIMEOUT_MS;
     adev->dummybuf_thread_cancel = 0;
     adev->dummybuf_thread_active = 0;
+    adev->dummybuf_thread_done = 0;
     pthread_mutex_init(&adev->dummybuf_thread_lock, (const pthread_mutexattr_t *) NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&adev->dummybuf_thread_cond, &attr);
+    pthread_condattr_destroy(&attr);
     if (!adev->dummybuf_thread)
         pthread_create(&adev->dummybuf_thread, (const pthread_attr_t *) NULL, dummybuf_thread, adev);
 }
 
+/* Waits until the dummy buffer thread holds the path open or gave up.
+ * Must be called with dummybuf_thread_lock held.
+ */
+static void dummybuf_thread_wait_active_l(struct audio_device *adev)
+{
+    struct timespec deadline;
+
+    get_deadline(&deadline, DUMMYBUF_THREAD_START_TIMEOUT_MS);
+    while (!adev->dummybuf_thread_active && !adev->dummybuf_thread_done) {
+        if (pthread_cond_timedwait(&adev->dummybuf_thread_cond,
+                                   &adev->dummybuf_thread_lock, &deadline) == ETIMEDOUT)
+            break;
+    }
+}
+
 static void dummybuf_thread_close(struct audio_device *adev)
 {
     ALOGD("%s: enter", __func__);
-    int retry_cnt = 20;
 
     if (adev->dummybuf_thread == 0)
         return;
 
     pthread_mutex_lock(&adev->dummybuf_thread_lock);
     adev->dummybuf_thread_cancel = 1;
+    pthread_cond_broadcast(&adev->dummybuf_thread_cond);
     pthread_mutex_unlock(&adev->dummybuf_thread_lock);
 
-    while (retry_cnt > 0) {
-        pthread_mutex_lock(&adev->dummybuf_thread_lock);
-        if (adev->dummybuf_thread_active == 0) {
-            pthread_mutex_unlock(&adev->dummybuf_thread_lock);
-            break;
-        }
-        pthread_mutex_unlock(&adev->dummybuf_thread_lock);
-        retry_cnt--;
-        usleep(1000);
-    }
-
     pthread_join(adev->dummybuf_thread, (void **) NULL);
+    pthread_cond_destroy(&adev->dummybuf_thread_cond);
     pthread_mutex_destroy(&adev->dummybuf_thread_lock);
     adev->dummybuf_thread = 0;
 }
 
-static int adev_open(const hw_module_t *module, const char *name,
-                     hw_device_t **device)
+/* Completes the standby of the input left in warm standby when its grace
+ * period expires, see in_warm_standby_l() */
+static void *warm_standby_thread(void *context)
 {
-    struct audio_device *adev;
-    int i, ret, retry_count;
+    struct audio_device *adev = (struct audio_device *)context;
+    bool expired;
 
-    ALOGD("%s: enter", __func__);
-    if (strcmp(name, AUDIO_HARDWARE_INTERFACE) != 0) return -EINVAL;
+    prctl(PR_SET_NAME, (unsigned long)"Input warm standby", 0, 0, 0);
 
-    adev = calloc(1, sizeof(struct audio_device));
+    pthread_mutex_lock(&adev->warm_standby_lock);
+    while (!adev->warm_standby_cancel) {
+        if (!adev->warm_standby_armed) {
+            pthread_cond_wait(&adev->warm_standby_cond, &adev->warm_standby_lock);
+            continue;
+        }
+        /* woken up early when the stream restarts or goes to standby again */
+        if (pthread_cond_timedwait(&adev->warm_standby_cond, &adev->warm_standby_lock,
+                                   &adev->warm_standby_deadline) != ETIMEDOUT)
+            continue;
+        adev->warm_standby_armed = false;
+        pthread_mutex_unlock(&adev->warm_standby_lock);
 
-    adev->device.common.tag = HARDWARE_DEVICE_TAG;
-    adev->device.common.version = AUDIO_DEVICE_API_VERSION_2_0;
-    adev->device.common.module = (struct hw_module_t *)module;
-    adev->device.common.close = adev_close;
+        /* lock_inputs keeps the stream from being closed or restarted */
+        pthread_mutex_lock(&adev->lock_inputs);
+        pthread_mutex_lock(&adev->warm_standby_lock);
+        expired = !adev->warm_standby_armed;
+        pthread_mutex_unlock(&adev->warm_standby_lock);
+        if (expired)
+            in_end_warm_standby_l(adev, NULL);
+        pthread_mutex_unlock(&adev->lock_inputs);
 
-    adev->device.init_check = adev_init_check;
-    adev->device.set_voice_volume = adev_set_voice_volume;
-    adev->device.set_master_volume = adev_set_master_volume;
-    adev->device.get_master_volume = adev_get_master_volume;
-    adev->device.set_master_mute = adev_set_master_mute;
-    adev->device.get_master_mute = adev_get_master_mute;
-    adev->device.set_mode = adev_set_mode;
-    adev->device.set_mic_mute = adev_set_mic_mute;
-    adev->device.get_mic_mute = adev_get_mic_mute;
-    adev->device.set_parameters = adev_set_parameters;
-    adev->device.get_parameters = adev_get_parameters;
-    adev->device.get_input_buffer_size = adev_get_input_buffer_size;
-    adev->device.open_output_stream = adev_open_output_stream;
-    adev->device.close_output_stream = adev_close_output_stream;
-    adev->device.open_input_stream = adev_open_input_stream;
-    adev->device.close_input_stream = adev_close_input_stream;
-    adev->device.dump = adev_dump;
+        pthread_mutex_lock(&adev->warm_standby_lock);
+    }
+    pthread_mutex_unlock(&adev->warm_standby_lock);
 
-    /* Set the default route before the PCM stream is opened */
-    adev->mode = AUDIO_MODE_NORMAL;
-    adev->active_input = NULL;
-    adev->primary_output = NULL;
-    adev->voice_volume = 1.0f;
-    adev->tty_mode = TTY_MODE_OFF;
-    adev->bluetooth_nrec = true;
-    adev->in_call = false;
-    /* adev->cur_hdmi_channels = 0;  by calloc() */
-    adev->snd_dev_ref_cnt = calloc(SND_DEVICE_MAX, sizeof(int));
+    return NULL;
+}
 
-    adev->dualmic_config = DUALMIC_CONFIG_NONE;
-    adev->ns_in_voice_rec = false;
+static void warm_standby_thread_open(struct audio_device *adev)
+{
+    pthread_condattr_t attr;
+    char value[PROPERTY_VALUE_MAX];
 
-    list_init(&adev->usecase_list);
+    property_get(INPUT_WARM_STANDBY_PROPERTY, value, "");
+    adev->warm_standby_ms = value[0] != '\0' ? atoi(value) : INPUT_WARM_STANDBY_MS;
+    if (adev->warm_standby_ms <= 0)
+        return;
 
-    if (mixer_init(adev) != 0) {
-        free(adev->snd_dev_ref_cnt);
-        free(adev);
-        ALOGE("%s: Failed to init, aborting.", __func__);
-        *device = NULL;
-        return -EINVAL;
+    adev->warm_input = NULL;
+    adev->warm_standby_armed = false;
+    adev->warm_standby_cancel = false;
+    pthread_mutex_init(&adev->warm_standby_lock, (const pthread_mutexattr_t *) NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&adev->warm_standby_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&adev->warm_standby_thread, (const pthread_attr_t *) NULL,
+                       warm_standby_thread, adev) != 0) {
+        ALOGE("%s: could not create thread, warm standby disabled", __func__);
+        adev->warm_standby_thread = 0;
+        adev->warm_standby_ms = 0;
     }
+}
+
+static void warm_standby_thread_close(struct audio_device *adev)
+{
+    if (adev->warm_standby_thread == 0)
+        return;
+
+    pthread_mutex_lock(&adev->warm_standby_lock);
+    adev->warm_standby_cancel = true;
+    pthread_cond_broadcast(&adev->warm_standby_cond);
+    pthread_mutex_unlock(&adev->warm_standby_lock);
+
+    pthread_join(adev->warm_standby_thread, (void **) NULL);
+    pthread_cond_destroy(&adev->warm_standby_cond);
+    pthread_mutex_destroy(&adev->warm_standby_lock);
+    adev->warm_standby_thread = 0;
+}
 
+static void adev_load_offload_fx_lib(struct audio_device *adev)
+{
     if (access(OFFLOAD_FX_LIBRARY_PATH, R_OK) == 0) {
         adev->offload_fx_lib = dlopen(OFFLOAD_FX_LIBRARY_PATH, RTLD_NOW);
         if (adev->offload_fx_lib == NULL) {
@@ -4535,7 +7143,10 @@ static int adev_open(const hw_module_t *module, const char *name,
                                                         "visualizer_hal_stop_output");
         }
     }
+}
 
+static void adev_load_acoustic_lib(struct audio_device *adev)
+{
     if (access(HTC_ACOUSTIC_LIBRARY_PATH, R_OK) == 0) {
         adev->htc_acoustic_lib = dlopen(HTC_ACOUSTIC_LIBRARY_PATH, RTLD_NOW);
         if (adev->htc_acoustic_lib == NULL) {
@@ -4558,7 +7169,10 @@ static int adev_open(const hw_module_t *module, const char *name,
                 adev->htc_acoustic_spk_reverse(adev->speaker_lr_swap);
         }
     }
+}
 
+static void adev_load_sound_trigger_lib(struct audio_device *adev)
+{
     if (access(SOUND_TRIGGER_HAL_LIBRARY_PATH, R_OK) == 0) {
         adev->sound_trigger_lib = dlopen(SOUND_TRIGGER_HAL_LIBRARY_PATH, RTLD_NOW);
         if (adev->sound_trigger_lib == NULL) {
@@ -4585,27 +7199,20 @@ static int adev_open(const hw_module_t *module, const char *name,
             }
         }
     }
+}
 
-
-    *device = &adev->device.common;
-
+static void adev_config_amplifiers(struct audio_device *adev)
+{
     if (adev->htc_acoustic_init_rt5506 != NULL)
         adev->htc_acoustic_init_rt5506();
 
-    if (audio_device_ref_count == 0) {
+    if (adev->init_first_open) {
         /* For HS GPIO initial config */
         adev->dummybuf_thread_devices = AUDIO_DEVICE_OUT_WIRED_HEADPHONE;
         dummybuf_thread_open(adev);
-        retry_count = RETRY_NUMBER;
-        while (retry_count-- > 0) {
-            pthread_mutex_lock(&adev->dummybuf_thread_lock);
-            if (adev->dummybuf_thread_active != 0) {
-                pthread_mutex_unlock(&adev->dummybuf_thread_lock);
-                break;
-            }
-            pthread_mutex_unlock(&adev->dummybuf_thread_lock);
-            usleep(10000);
-        }
+        pthread_mutex_lock(&adev->dummybuf_thread_lock);
+        dummybuf_thread_wait_active_l(adev);
+        pthread_mutex_unlock(&adev->dummybuf_thread_lock);
         dummybuf_thread_close(adev);
 
         /* For NXP DSP config */
@@ -4614,15 +7221,7 @@ static int adev_open(const hw_module_t *module, const char *name,
             adev->dummybuf_thread_devices = AUDIO_DEVICE_OUT_SPEAKER;
             dummybuf_thread_open(adev);
             pthread_mutex_lock(&adev->dummybuf_thread_lock);
-            retry_count = RETRY_NUMBER;
-            while (retry_count-- > 0) {
-                if (adev->dummybuf_thread_active) {
-                    break;
-                }
-                pthread_mutex_unlock(&adev->dummybuf_thread_lock);
-                usleep(10000);
-                pthread_mutex_lock(&adev->dummybuf_thread_lock);
-            }
+            dummybuf_thread_wait_active_l(adev);
             if (adev->dummybuf_thread_active) {
                 usleep(10000); /* tfa9895 spk amp need more than 1ms i2s signal before giving dsp related i2c commands*/
                 if (pthread_create(&th, NULL, tfa9895_config_thread, (void* )adev) != 0) {
@@ -4633,9 +7232,149 @@ static int adev_open(const hw_module_t *module, const char *name,
             /* Then, dummybuf_thread_close() is called by tfa9895_config_thread() */
         }
     }
+}
+
+static void adev_init_set_phase(struct audio_device *adev, int phase, int status)
+{
+    pthread_mutex_lock(&adev->init_lock);
+    adev->init_phase = phase;
+    if (status != 0)
+        adev->init_status = status;
+    pthread_cond_broadcast(&adev->init_cond);
+    pthread_mutex_unlock(&adev->init_lock);
+}
+
+/* Slow part of the device open, run once adev_open() has returned: mixer_init()
+ * retries a missing card for up to RETRY_NUMBER * RETRY_US, and the optional
+ * libraries are loaded last as only offload and hotword streams use them.
+ * Streams wait in adev_wait_for_init() for the phase they need. */
+static void *adev_init_thread(void *context)
+{
+    struct audio_device *adev = (struct audio_device *)context;
+    int64_t begin_ns = get_monotonic_ns();
+    int64_t mixers_ns;
+    int64_t amplifiers_ns;
+    int64_t libraries_ns;
+
+    if (mixer_init(adev) != 0) {
+        ALOGE("%s: Failed to init mixers after %lld ms", __func__,
+              (long long)((get_monotonic_ns() - begin_ns) / 1000000));
+        adev_init_set_phase(adev, ADEV_INIT_DONE, -ENODEV);
+        return NULL;
+    }
+    mixers_ns = get_monotonic_ns();
+
+    adev_load_acoustic_lib(adev);
+    adev_config_amplifiers(adev);
+    amplifiers_ns = get_monotonic_ns();
+    adev_init_set_phase(adev, ADEV_INIT_ROUTING, 0);
+
+    adev_load_offload_fx_lib(adev);
+    adev_load_sound_trigger_lib(adev);
+    libraries_ns = get_monotonic_ns();
+    adev_init_set_phase(adev, ADEV_INIT_DONE, 0);
+
+    ALOGI("%s: mixers %lld ms, amplifiers %lld ms, libraries %lld ms", __func__,
+          (long long)((mixers_ns - begin_ns) / 1000000),
+          (long long)((amplifiers_ns - mixers_ns) / 1000000),
+          (long long)((libraries_ns - amplifiers_ns) / 1000000));
+    return NULL;
+}
+
+static void adev_init_thread_open(struct audio_device *adev)
+{
+    pthread_mutex_init(&adev->init_lock, (const pthread_mutexattr_t *) NULL);
+    pthread_cond_init(&adev->init_cond, (const pthread_condattr_t *) NULL);
+    adev->init_phase = ADEV_INIT_PENDING;
+    adev->init_status = 0;
+
+    if (pthread_create(&adev->init_thread, NULL, adev_init_thread, adev) != 0) {
+        ALOGE("%s: failed to create init thread, initializing synchronously", __func__);
+        adev_init_thread(adev);
+        return;
+    }
+    adev->init_thread_started = true;
+}
+
+static void adev_init_thread_close(struct audio_device *adev)
+{
+    if (adev->init_thread_started)
+        pthread_join(adev->init_thread, (void **) NULL);
+    pthread_cond_destroy(&adev->init_cond);
+    pthread_mutex_destroy(&adev->init_lock);
+}
+
+static int adev_open(const hw_module_t *module, const char *name,
+                     hw_device_t **device)
+{
+    struct audio_device *adev;
+    int i, ret;
+    int64_t begin_ns = get_monotonic_ns();
+
+    ALOGD("%s: enter", __func__);
+    if (strcmp(name, AUDIO_HARDWARE_INTERFACE) != 0) return -EINVAL;
+
+    adev = calloc(1, sizeof(struct audio_device));
+
+    adev->device.common.tag = HARDWARE_DEVICE_TAG;
+    adev->device.common.version = AUDIO_DEVICE_API_VERSION_2_0;
+    adev->device.common.module = (struct hw_module_t *)module;
+    adev->device.common.close = adev_close;
+
+    adev->device.init_check = adev_init_check;
+    adev->device.set_voice_volume = adev_set_voice_volume;
+    adev->device.set_master_volume = adev_set_master_volume;
+    adev->device.get_master_volume = adev_get_master_volume;
+    adev->device.set_master_mute = adev_set_master_mute;
+    adev->device.get_master_mute = adev_get_master_mute;
+    adev->device.set_mode = adev_set_mode;
+    adev->device.set_mic_mute = adev_set_mic_mute;
+    adev->device.get_mic_mute = adev_get_mic_mute;
+    adev->device.set_parameters = adev_set_parameters;
+    adev->device.get_parameters = adev_get_parameters;
+    adev->device.get_input_buffer_size = adev_get_input_buffer_size;
+    adev->device.open_output_stream = adev_open_output_stream;
+    adev->device.close_output_stream = adev_close_output_stream;
+    adev->device.open_input_stream = adev_open_input_stream;
+    adev->device.close_input_stream = adev_close_input_stream;
+    adev->device.dump = adev_dump;
+
+    /* Set the default route before the PCM stream is opened */
+    adev->mode = AUDIO_MODE_NORMAL;
+    adev->active_input = NULL;
+    adev->primary_output = NULL;
+    adev->voice_volume = 1.0f;
+    adev->tty_mode = TTY_MODE_OFF;
+    adev->bluetooth_nrec = true;
+    adev->in_call = false;
+    /* adev->cur_hdmi_channels = 0;  by calloc() */
+    adev->snd_dev_ref_cnt = calloc(SND_DEVICE_MAX, sizeof(int));
+
+    adev->dualmic_config = DUALMIC_CONFIG_NONE;
+    adev->ns_in_voice_rec = false;
+
+    list_init(&adev->usecase_list);
+    list_init(&adev->mixer_list);
+    /* the profiles are shared by all the devices and read by their streams */
+    if (audio_device_ref_count == 0)
+        pcm_profiles_load(PCM_PROFILES_FILE_PATH);
+    init_pcm_device_table();
+    pthread_mutex_init(&adev->capture_source.lock, (const pthread_mutexattr_t *) NULL);
+    pthread_cond_init(&adev->capture_source.cond, (const pthread_condattr_t *) NULL);
+    list_init(&adev->capture_source.clients);
+    warm_standby_thread_open(adev);
+    /* 0 is reserved for output streams that must check the control plane */
+    adev->control_generation = 1;
+
+    adev->init_first_open = audio_device_ref_count == 0;
+    adev_init_thread_open(adev);
+
+    *device = &adev->device.common;
+
     audio_device_ref_count++;
 
-    ALOGV("%s: exit", __func__);
+    ALOGI("%s: exit after %lld us, hardware init continues in background", __func__,
+          (long long)((get_monotonic_ns() - begin_ns) / 1000));
     return 0;
 }
 
@@ -38,14 +38,55 @@
 
 #define HTC_ACOUSTIC_LIBRARY_PATH "/vendor/lib/libhtcacoustic.so"
 
+/* printf format of the mixer paths file of a card. Can be set from the build
+ * to run the HAL against another mixer description, e.g. on a stub card. */
+#ifndef MIXER_PATHS_FILE_FORMAT
+#define MIXER_PATHS_FILE_FORMAT "/system/etc/mixer_paths_%d.xml"
+#endif
+
+/* Tuning of the PCM device profiles, read once at the first adev_open(). The
+ * profiles compiled in audio_hw.c are the defaults: the file overrides their
+ * card, device and PCM config by name. Bump the version when the format changes. */
+#ifndef PCM_PROFILES_FILE_PATH
+#define PCM_PROFILES_FILE_PATH "/system/etc/audio_pcm_profiles.xml"
+#endif
+#define PCM_PROFILES_VERSION 1
+
 #ifdef PREPROCESSING_ENABLED
 #include <audio_utils/echo_reference.h>
 #define MAX_PREPROCESSORS 3
+/* capture effects are run on blocks of this duration */
+#define PREPROCESSING_BLOCK_MS 10
 struct effect_info_s {
     effect_handle_t effect_itfe;
     size_t num_channel_configs;
     channel_config_t *channel_configs;
 };
+
+/* Echo reference alignment, see push_echo_reference(). The gains apply to the
+ * error in seconds over the elapsed time: the loop settles in about 1 / KP
+ * seconds and only asks for the max correction at 10 ms of error. KI is
+ * KP^2 / 4, for no overshoot. */
+#define ECHO_REF_SYNC_KP 0.1f
+#define ECHO_REF_SYNC_KI 0.0025f
+/* time constant of the low-pass on the alignment error, which jitters with the
+ * timestamps of both sources */
+#define ECHO_REF_SYNC_FILTER_NS 200000000LL
+/* max correction of the reference rate: 1000 ppm */
+#define ECHO_REF_SYNC_MAX_DRIFT 0.001f
+/* alignment errors beyond 50 ms are discontinuities, not drift */
+#define ECHO_REF_SYNC_RELOCK_NS 50000000LL
+
+struct echo_ref_sync {
+    bool locked;
+    int64_t target_delay_ns;    /* echo delay when the reference was locked */
+    int64_t error_ns;           /* low-passed alignment error */
+    int64_t max_error_ns;
+    float drift;                /* integral of the alignment error */
+    float ratio;                /* reference frames consumed per frame handed to the AEC */
+    float phase;                /* fractional read position in the reference */
+    unsigned int relocks;
+};
 #endif
 
 #ifdef __LP64__
@@ -149,6 +190,24 @@ enum {
 #define SCO_STOP_THRESHOLD 336
 #define SCO_AVAILABLE_MIN 1
 
+/* wideband speech runs the SCO PCMs at 16 kHz with periods of the same duration */
+#define SCO_WB_SAMPLING_RATE 16000
+#define SCO_WB_PERIOD_SIZE (SCO_PERIOD_SIZE * SCO_WB_SAMPLING_RATE / SCO_DEFAULT_SAMPLING_RATE)
+#define SCO_WB_START_THRESHOLD (SCO_WB_PERIOD_SIZE * SCO_PERIOD_COUNT - 1)
+#define SCO_WB_STOP_THRESHOLD (SCO_WB_PERIOD_SIZE * SCO_PERIOD_COUNT)
+
+#ifndef AUDIO_PARAMETER_KEY_BT_SCO_WB
+#define AUDIO_PARAMETER_KEY_BT_SCO_WB "bt_wbs"
+#endif
+
+/* Polyphase FIR converting between the SCO rates and the stream rates, see
+ * create_voice_resampler(): taps of the prototype filter per unit of conversion
+ * ratio, its Kaiser window beta (about 70 dB of stopband attenuation) and the
+ * largest integer ratio handled */
+#define VOICE_RESAMPLER_TAPS 48
+#define VOICE_RESAMPLER_KAISER_BETA 7.0
+#define VOICE_RESAMPLER_MAX_RATIO 6
+
 #define PLAYBACK_HDMI_MULTI_PERIOD_SIZE  1024
 #define PLAYBACK_HDMI_MULTI_PERIOD_COUNT 4
 #define PLAYBACK_HDMI_MULTI_DEFAULT_CHANNEL_COUNT 6
@@ -162,6 +221,12 @@ enum {
 
 #define CAPTURE_PERIOD_SIZE 1024
 #define CAPTURE_PERIOD_SIZE_LOW_LATENCY 256
+#define CAPTURE_PERIOD_COUNT_LOW_LATENCY 4
+/* periods buffered for each stream sharing the capture PCM */
+#define CAPTURE_SHARE_RING_PERIODS 4
+/* a capture PCM falling behind its timestamps by more than this fraction of a
+ * period is counted as an overrun */
+#define CAPTURE_OVERRUN_THRESHOLD_DIV 2
 #define CAPTURE_PERIOD_COUNT 2
 #define CAPTURE_DEFAULT_CHANNEL_COUNT 2
 #define CAPTURE_DEFAULT_SAMPLING_RATE 48000
@@ -169,15 +234,55 @@ enum {
 
 #define COMPRESS_CARD       2
 #define COMPRESS_DEVICE     0
-#define COMPRESS_OFFLOAD_FRAGMENT_SIZE (32 * 1024)
+/* Offload buffers are sized from the stream bit rate so that a fragment holds
+ * about COMPRESS_OFFLOAD_FRAGMENT_DURATION_MS of audio (less with video, to keep
+ * A/V sync and seeks responsive), within the size limits below */
+#define COMPRESS_OFFLOAD_FRAGMENT_DURATION_MS 1000
+#define COMPRESS_OFFLOAD_VIDEO_FRAGMENT_DURATION_MS 250
+#define COMPRESS_OFFLOAD_MIN_FRAGMENT_SIZE (4 * 1024)
+#define COMPRESS_OFFLOAD_MAX_FRAGMENT_SIZE (128 * 1024)
 #define COMPRESS_OFFLOAD_NUM_FRAGMENTS 4
+#define COMPRESS_OFFLOAD_MAX_NUM_FRAGMENTS 8
+#define COMPRESS_OFFLOAD_MAX_BUFFER_SIZE (512 * 1024)
+/* assumed bit rates when the offload info does not provide one */
+#define COMPRESS_OFFLOAD_MP3_MAX_BIT_RATE 320000
+#define COMPRESS_OFFLOAD_AAC_BITS_PER_SAMPLE 2
+/* upper bound of a single wait of the offload thread on the DSP */
+#define OFFLOAD_WAIT_TIMEOUT_MS 500
 /* ToDo: Check and update a proper value in msec */
 #define COMPRESS_OFFLOAD_PLAYBACK_LATENCY 96
 #define COMPRESS_PLAYBACK_VOLUME_MAX 0x10000 //NV suggested value
 
+/* duration of the gain ramps of the PCM outputs on volume changes and mute */
+#define OUT_GAIN_RAMP_MS 20
+
+/* Render latency model, in us: the pipeline part is per usecase and the codec and
+ * amplifier part per sound device, from the latency_us attribute of mixer paths */
+#define PLAYBACK_PIPELINE_LATENCY_US 0
+#define PLAYBACK_HDMI_PIPELINE_LATENCY_US 0
+/* offload DSP post-processing and output ring */
+#define COMPRESS_OFFLOAD_PIPELINE_LATENCY_US 10000
+
+/* Periods of the deep buffer output: 20 ms periods and 100 ms of buffer. While
+ * the screen is off the writer is only woken up once a full period is free, with
+ * the screen on once a period of the device profile is free */
 #define DEEP_BUFFER_OUTPUT_SAMPLING_RATE 48000
-#define DEEP_BUFFER_OUTPUT_PERIOD_SIZE 480
-#define DEEP_BUFFER_OUTPUT_PERIOD_COUNT 8
+#define DEEP_BUFFER_OUTPUT_PERIOD_SIZE 960
+#define DEEP_BUFFER_OUTPUT_PERIOD_COUNT 5
+#define DEEP_BUFFER_OUTPUT_START_THRESHOLD DEEP_BUFFER_OUTPUT_PERIOD_SIZE
+#define DEEP_BUFFER_OUTPUT_AVAILABLE_MIN DEEP_BUFFER_OUTPUT_PERIOD_SIZE
+
+/* The dummy buffer thread keeps the codec clocked by holding a PCM open on
+ * silence. It only wakes up on timeout or cancel */
+#define DUMMYBUF_THREAD_TIMEOUT_MS 18000
+#define DUMMYBUF_THREAD_RETRY_MS 10
+#define DUMMYBUF_THREAD_START_TIMEOUT_MS (RETRY_NUMBER * 10)
+
+/* An input put in standby by the framework keeps its PCM open and its route
+ * applied for this long, so that restarting it skips the path bring-up.
+ * Overridden by the INPUT_WARM_STANDBY_PROPERTY, 0 disables it */
+#define INPUT_WARM_STANDBY_MS 500
+#define INPUT_WARM_STANDBY_PROPERTY "audio.input.warm_standby_ms"
 
 #define MAX_SUPPORTED_CHANNEL_MASKS 2
 
@@ -198,6 +303,7 @@ typedef enum {
     /* Capture usecases */
     USECASE_AUDIO_CAPTURE,
     USECASE_AUDIO_CAPTURE_HOTWORD,
+    USECASE_AUDIO_CAPTURE_LOW_LATENCY,
 
     USECASE_VOICE_CALL,
     AUDIO_USECASE_MAX
@@ -234,6 +340,10 @@ typedef enum {
     VOICE_CALL = 0x4,
     PCM_HOTWORD_STREAMING = 0x8
 } usecase_type_t;
+#define USECASE_TYPE_MAX 4 /* number of usecase_type_t bits */
+
+/* sound cards numbered below this are looked up directly, see adev_get_mixer_for_card() */
+#define MIXER_CARD_MAX 8
 
 struct offload_cmd {
     struct listnode node;
@@ -241,6 +351,13 @@ struct offload_cmd {
     int             data[];
 };
 
+/* adev_init_thread() phases, see adev_wait_for_init() */
+enum {
+    ADEV_INIT_PENDING,
+    ADEV_INIT_ROUTING, /* mixers and amplifiers ready: streams can start */
+    ADEV_INIT_DONE,    /* offload effects and sound trigger libraries loaded */
+};
+
 struct pcm_device_profile {
     struct pcm_config config;
     int               card;
@@ -261,11 +378,27 @@ struct pcm_device {
     int                        sound_trigger_handle;
 };
 
+/* Log2 histogram of durations, updated with atomics so that the dumps can read
+ * it while the stream runs: bucket i > 0 counts the durations in
+ * [2^(i-1), 2^i) us, bucket 0 those below 1 us and the last bucket also
+ * counts everything longer. */
+#define LATENCY_HIST_BUCKETS 21
+
+struct latency_hist {
+    volatile int32_t    buckets[LATENCY_HIST_BUCKETS];
+    volatile int32_t    max_us;
+};
+
 struct stream_out {
     struct audio_stream_out     stream;
     pthread_mutex_t             lock; /* see note below on mutex acquisition order */
     pthread_cond_t              cond;
+    /* config of the PCM devices: for the deep buffer usecase, with the
+     * thresholds of its current wakeup mode */
     struct pcm_config           config;
+    /* deep buffer usecase waking its writer once per long period, follows
+     * adev->screen_off from the next write */
+    bool                        long_wakeups;
     struct listnode             pcm_dev_list;
     struct compr_config         compr_config;
     struct compress*            compr;
@@ -278,7 +411,14 @@ struct stream_out {
     audio_usecase_t             usecase;
     /* Array of supported channel mask configurations. +1 so that the last entry is always 0 */
     audio_channel_mask_t        supported_channel_masks[MAX_SUPPORTED_CHANNEL_MASKS + 1];
-    bool                        muted;
+    /* gain of the PCM usecases, applied by out_apply_gain_l(). Index 0 is the
+     * left channel, also used for all channels when there are not two. */
+    float                       gain_target[2];
+    float                       gain_current[2];
+    float                       gain_step[2];
+    unsigned int                gain_ramp_frames; /* frames left in the ramp */
+    int16_t*                    gain_buf;
+    size_t                      gain_buf_size;
     /* total frames written, not cleared when entering standby */
     uint64_t                    written;
     audio_io_handle_t           handle;
@@ -289,11 +429,20 @@ struct stream_out {
     pthread_t                   offload_thread;
     struct listnode             offload_cmd_list;
     bool                        offload_thread_blocked;
+    bool                        offload_wait_pending;
+    unsigned int                offload_write_watermark;
+    /* expected interval between two STREAM_CBK_EVENT_WRITE_READY */
+    unsigned int                offload_wakeup_interval_ms;
+    /* compressed bytes played per second, paces offload_wait_for_watermark() */
+    uint32_t                    offload_byte_rate;
 
     stream_callback_t           offload_callback;
     void*                       offload_cookie;
     struct compr_gapless_mdata  gapless_mdata;
     int                         send_new_metadata;
+    /* gapless_mdata was set by out_set_parameters() and not sent yet: it is
+     * the one of the next track */
+    bool                        next_track_mdata;
 
     struct audio_device*        dev;
 
@@ -305,6 +454,53 @@ struct stream_out {
     // always modified with audio device and stream mutex locked.
     int32_t echo_reference_generation;
 #endif
+    // control_generation is the last adev->control_generation seen by out_write().
+    // 0 forces a full check of the audio device state on the next write.
+    int32_t                     control_generation;
+
+    /* timing, see out_dump() */
+    struct latency_hist         write_time;     /* out_write() */
+    struct latency_hist         pcm_write_time; /* blocked in pcm_write() or compress_write() */
+    struct latency_hist         lock_wait;      /* out->lock in out_write() */
+    struct latency_hist         start_time;     /* start_output_stream() */
+    struct latency_hist         standby_time;   /* do_out_standby_l() */
+    int64_t                     last_write_end_ns; /* 0 after standby */
+    volatile int32_t            underruns;
+};
+
+struct voice_resampler {
+    struct resampler_itfe               itfe; /* must be first */
+    struct resampler_buffer_provider*   provider;
+    uint32_t                            in_rate;
+    uint32_t                            channels;
+    uint32_t                            up;
+    uint32_t                            down;
+    uint32_t                            taps; /* per phase */
+    /* up phases of taps coefficients in Q14, newest sample first */
+    int16_t*                            coefs;
+    /* per channel, the last taps input samples written twice so that they can
+     * always be read contiguously from hist_pos, newest first */
+    int16_t*                            hist;
+    uint32_t                            hist_pos;
+    uint32_t                            phase;
+    /* input frames to take before the next output frame */
+    uint32_t                            pending;
+};
+
+/* time from the first in_read() after standby to the first frames returned */
+struct start_latency_stats {
+    uint32_t    count;
+    int64_t     last_ns;
+    int64_t     total_ns;
+    int64_t     max_ns;
+};
+
+/* Overrun detection on a capture PCM, see capture_clock_lost().
+ * last_ns is 0 until the first read after a (re)start of the PCM */
+struct capture_clock {
+    int64_t                     last_ns;
+    uint64_t                    last_frames;
+    uint64_t                    frames_read;
 };
 
 struct stream_in {
@@ -329,6 +525,47 @@ struct stream_in {
     size_t                              read_buf_size;
     size_t                              read_buf_frames;
 
+    /* read, proc and reference buffers are carved out of buf_arena at
+     * start_input_stream(), see in_alloc_buffers_l() */
+    void *buf_arena;
+    size_t buf_arena_size;
+
+    /* capture PCM sharing, see capture_source_read() */
+    bool                                capture_shared;
+    struct listnode                     capture_client_node;
+    int16_t*                            capture_ring;
+    size_t                              capture_ring_size;
+    size_t                              capture_ring_rd;
+    size_t                              capture_ring_frames;
+    uint64_t                            capture_ring_dropped;
+    uint64_t                            capture_ring_dropped_reported;
+
+    /* capture loss accounting, see capture_clock_lost().
+     * frames_lost is in frames at requested_rate, not yet reported by
+     * in_get_input_frames_lost(). On a shared capture PCM, overruns and
+     * capture_overrun_lost (in PCM frames, not yet reported) are updated with
+     * capture_source.lock held; xrun_clock is only used by unshared PCMs */
+    struct capture_clock                xrun_clock;
+    uint32_t                            frames_lost;
+    uint64_t                            frames_lost_total;
+    uint32_t                            overruns;
+    uint64_t                            capture_overrun_lost;
+    uint32_t                            read_errors;
+
+    /* PCM stopped but kept open with its route, see in_warm_standby_l() */
+    bool                                warm_standby;
+    bool                                start_pending;
+    bool                                start_warm;
+    int64_t                             start_begin_ns;
+    struct start_latency_stats          cold_start;
+    struct start_latency_stats          warm_start;
+
+    /* timing, see in_dump() */
+    struct latency_hist                 read_time;     /* in_read() */
+    struct latency_hist                 pcm_read_time; /* blocked in pcm_read() */
+    struct latency_hist                 lock_wait;     /* in->lock in in_read() */
+    struct latency_hist                 standby_time;  /* do_in_standby_l() */
+
     int16_t *proc_buf_in;
     int16_t *proc_buf_out;
     size_t proc_buf_size;
@@ -339,6 +576,9 @@ struct stream_in {
     int16_t *ref_buf;
     size_t ref_buf_size;
     size_t ref_buf_frames;
+    int16_t *ref_out_buf;
+    size_t ref_out_size;
+    struct echo_ref_sync echo_ref_sync;
 
 #ifdef HW_AEC_LOOPBACK
     bool hw_echo_reference;
@@ -349,6 +589,13 @@ struct stream_in {
     int num_preprocessors;
     struct effect_info_s preprocessors[MAX_PREPROCESSORS];
 
+    /* capture effect chain: in proc_buf_in, one output per effect slot, and the
+     * frames of the last processed block not yet returned by in_read() */
+    int16_t *proc_stage_buf[MAX_PREPROCESSORS];
+    size_t proc_block_frames;
+    int16_t *proc_out_buf;
+    size_t proc_out_frames;
+
     bool aux_channels_changed;
     uint32_t aux_channels;
 #endif
@@ -356,12 +603,74 @@ struct stream_in {
     struct audio_device*                dev;
 };
 
+/* Capture PCM shared by the input streams started on it */
+struct capture_source {
+    pthread_mutex_t             lock; /* see note below on mutex acquisition order */
+    pthread_cond_t              cond; /* signaled when a PCM read completes */
+    bool                        reading; /* a client is blocked in pcm_read() */
+    struct pcm*                 pcm;
+    struct pcm_device_profile*  pcm_profile;
+    struct pcm_config           config;
+    audio_usecase_t             usecase;
+    struct stream_in*           owner; /* stream whose usecase routes the PCM */
+    struct listnode             clients;
+    int                         num_clients;
+    struct capture_clock        xrun_clock;
+};
+
+/* Mixer paths compiled at mixer_init(), see mixer_load_paths() */
+struct mixer_route_ctl {
+    struct mixer_ctl*   ctl;
+    unsigned int        num_values;
+    int                 reset_value; /* value when no path sets the control */
+    int                 cur_value;   /* value last written to the driver */
+    int                 new_value;
+};
+
+struct mixer_route_setting {
+    unsigned int        ctl; /* index in mixer_route.ctls */
+    int                 value;
+};
+
+struct mixer_route_path {
+    struct mixer_route_setting* settings;
+    unsigned int                num_settings;
+};
+
+struct mixer_route {
+    struct mixer_route_ctl*     ctls;
+    unsigned int                num_ctls;
+    struct mixer_route_path     paths[SND_DEVICE_MAX];
+    bool                        enabled[SND_DEVICE_MAX];
+    /* indexes of the sound devices whose path sets at least one control */
+    snd_device_t                routed[SND_DEVICE_MAX];
+    unsigned int                num_routed;
+};
+
+struct mixer_paths_parser {
+    struct audio_device*        adev;
+    struct mixer*               mixer;
+    struct mixer_route*         route;
+    unsigned int                path_depth;
+    snd_device_t                path_device; /* first sound device of the path being read */
+    struct mixer_route_path     path;
+    unsigned int                path_capacity;
+    int                         error;
+};
+
+struct pcm_profiles_parser {
+    int                         version; /* of the <pcm_profiles> root, -1 until read */
+    unsigned int                loaded;
+    unsigned int                rejected;
+};
+
 struct mixer_card {
     struct listnode     adev_list_node;
     struct listnode     uc_list_node[AUDIO_USECASE_MAX];
     int                 card;
     struct mixer*       mixer;
     struct audio_route* audio_route;
+    struct mixer_route* route; /* NULL: paths applied through audio_route */
 };
 
 struct audio_usecase {
@@ -373,6 +682,7 @@ struct audio_usecase {
     snd_device_t            in_snd_device;
     struct audio_stream*    stream;
     struct listnode         mixer_list;
+    struct mixer_card*      mixer_cards[MIXER_CARD_MAX]; /* mixer_list indexed by card */
 };
 
 
@@ -389,8 +699,18 @@ struct audio_device {
     int                     tty_mode;
     bool                    bluetooth_nrec;
     bool                    screen_off;
+    bool                    bt_wb_speech_enabled;
     int*                    snd_dev_ref_cnt;
+    /* codec and amplifier delay of each sound device, in us */
+    int32_t                 snd_dev_latency_us[SND_DEVICE_MAX];
+    /* render latency of each usecase calibrated on its current route, in us */
+    volatile int32_t        render_latency_us[AUDIO_USECASE_MAX];
     struct listnode         usecase_list;
+    /* usecase_list indexed by id, and one usecase of each type, kept in
+     * sync with the list by add_usecase_l() and remove_usecase_l() */
+    struct audio_usecase*   usecases[AUDIO_USECASE_MAX];
+    struct audio_usecase*   usecase_of_type[USECASE_TYPE_MAX];
+    struct mixer_card*      mixer_cards[MIXER_CARD_MAX]; /* mixer_list indexed by card */
     bool                    speaker_lr_swap;
     unsigned int            cur_hdmi_channels;
     int                     dualmic_config;
@@ -409,6 +729,10 @@ struct audio_device {
     // with audio device mutex if needed
     volatile int32_t        echo_reference_generation;
 #endif
+    // control_generation is incremented atomically each time a routing, echo reference or
+    // amplifier mode change is published. out_write() only looks at the audio device state
+    // (and may take its mutex) when it differs from the generation cached by the stream.
+    volatile int32_t        control_generation;
 
     void*                   htc_acoustic_lib;
     int                     (*htc_acoustic_init_rt5506)();
@@ -425,14 +749,45 @@ struct audio_device {
     int                     tfa9895_mode_change;
     pthread_mutex_t         tfa9895_lock;
 
-    int                     dummybuf_thread_timeout;
+    int                     dummybuf_thread_timeout; /* in ms */
     int                     dummybuf_thread_cancel;
     int                     dummybuf_thread_active;
+    int                     dummybuf_thread_done;
+    /* total time the dummy buffer thread kept the codec powered */
+    int64_t                 dummybuf_thread_powered_ms;
     audio_devices_t         dummybuf_thread_devices;
     pthread_mutex_t         dummybuf_thread_lock;
+    pthread_cond_t          dummybuf_thread_cond;
     pthread_t               dummybuf_thread;
 
+    /* input kept in warm standby, written with lock_inputs and
+     * warm_standby_lock locked */
+    struct stream_in*       warm_input;
+    int                     warm_standby_ms;
+    bool                    warm_standby_armed;
+    bool                    warm_standby_cancel;
+    struct timespec         warm_standby_deadline;
+    pthread_mutex_t         warm_standby_lock;
+    pthread_cond_t          warm_standby_cond;
+    pthread_t               warm_standby_thread;
+
     pthread_mutex_t         lock_inputs; /* see note below on mutex acquisition order */
+    /* time the stream threads waited for lock and lock_inputs, see adev_dump() */
+    struct latency_hist     lock_wait;
+    struct latency_hist     lock_inputs_wait;
+
+    struct capture_source   capture_source;
+
+    /* mixers, amplifiers and optional libraries are set up by adev_init_thread()
+     * after adev_open() returns. init_phase and init_status are written with
+     * init_lock locked. */
+    int                     init_phase;
+    int                     init_status;
+    bool                    init_first_open; /* first device opened in the process */
+    bool                    init_thread_started;
+    pthread_mutex_t         init_lock;
+    pthread_cond_t          init_cond;
+    pthread_t               init_thread;
 };
 
 /*
@@ -441,6 +796,11 @@ struct audio_device {
  * stream_in mutex must always be before stream_out mutex
  * if both have to be taken (see get_echo_reference(), put_echo_reference()...)
  * dummybuf_thread mutex is not related to the other mutexes with respect to order.
+ * warm_standby mutex is taken last, and never held while taking another mutex.
+ * capture_source mutex is taken last, after stream_in and audio_device mutexes.
+ * It is never held while blocked in pcm_read(), see capture_source_read().
+ * init mutex is taken last, and never held while taking another mutex. The init
+ * thread never takes the audio_device mutex, so it can be waited for with it held.
  * lock_inputs must be held in order to either close the input stream, or prevent closure.
  */
 
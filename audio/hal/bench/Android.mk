@@ -0,0 +1,43 @@
+LOCAL_PATH := $(call my-dir)
+
+# Host bench of audio.primary.flounder on the fake sound card of fake_audio.h:
+#   make audio_hal_bench && audio_hal_bench -c device/htc/flounder
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	../audio_hw.c \
+	audio_hal_bench.c \
+	fake_tinyalsa.c \
+	fake_tinycompress.c \
+	fake_audio_route.c \
+	fake_audio_utils.c
+
+LOCAL_STATIC_LIBRARIES := \
+	libcutils \
+	liblog \
+	libexpat-host
+
+LOCAL_LDLIBS := -lpthread -ldl -lm -lrt
+
+LOCAL_C_INCLUDES += \
+	$(LOCAL_PATH)/.. \
+	external/tinyalsa/include \
+	external/tinycompress/include \
+	external/expat/lib \
+	$(call include-path-for, audio-utils) \
+	$(call include-path-for, audio-route) \
+	$(call include-path-for, audio-effects)
+
+LOCAL_CFLAGS += -DPREPROCESSING_ENABLED
+LOCAL_CFLAGS += -DHW_AEC_LOOPBACK
+# the configuration files are read from the directory given with -c
+LOCAL_CFLAGS += -DMIXER_PATHS_FILE_FORMAT=\"mixer_paths_%d.xml\"
+LOCAL_CFLAGS += -DPCM_PROFILES_FILE_PATH=\"audio_pcm_profiles.xml\"
+LOCAL_CFLAGS += '-D__unused=__attribute__((__unused__))'
+
+LOCAL_MODULE := audio_hal_bench
+
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
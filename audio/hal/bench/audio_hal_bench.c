@@ -0,0 +1,685 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Host bench of audio.primary.flounder, run on the fake sound card of
+ * fake_audio.h through the audio_hw_device entry points.
+ *
+ *   audio_hal_bench [-c config_dir] [-o output_dir] [-t duration_ms] [scenario...]
+ *
+ * The HAL reads mixer_paths_0.xml and audio_pcm_profiles.xml from config_dir
+ * (the device directory). Each scenario reports, per buffer written, read or
+ * converted, the average and maximum time spent in the HAL, the xruns of the
+ * fake card and the CPU time of the process. The exit status is non zero if a
+ * scenario fails.
+ */
+
+#define LOG_TAG "audio_hal_bench"
+
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cutils/log.h>
+#include <hardware/audio.h>
+#include <hardware/hardware.h>
+
+#include "audio_hw.h"
+#include "fake_audio.h"
+
+#define BENCH_DEFAULT_DURATION_MS   2000
+#define BENCH_SINE_HZ               440
+#define BENCH_OFFLOAD_BIT_RATE      320000
+#define BENCH_OFFLOAD_WRITE_BYTES   4096
+/* longer than the offload buffer takes to play */
+#define BENCH_CALLBACK_TIMEOUT_MS   10000
+
+extern struct audio_module HAL_MODULE_INFO_SYM;
+
+struct bench_result {
+    unsigned int buffers;
+    int64_t total_ns;
+    int64_t max_ns;
+    unsigned int xruns;
+    int64_t cpu_ns;
+    uint32_t frames_lost;
+};
+
+struct bench_scenario {
+    const char *name;
+    int (*run)(struct audio_hw_device *dev, int duration_ms, struct bench_result *result);
+};
+
+static int64_t bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int64_t bench_cpu_ns(void)
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    return ((int64_t)usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000 +
+            ((int64_t)usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000;
+}
+
+static void bench_sleep_ms(int ms)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000;
+    nanosleep(&ts, NULL);
+}
+
+static unsigned int bench_xruns(bool capture)
+{
+    struct fake_pcm_stats stats;
+    unsigned int xruns = 0;
+    unsigned int card, device;
+
+    for (card = 0; card < FAKE_AUDIO_MAX_CARDS; card++) {
+        for (device = 0; device < FAKE_AUDIO_MAX_DEVICES; device++) {
+            if (fake_pcm_get_stats(card, device, capture, &stats) == 0)
+                xruns += stats.xruns;
+        }
+    }
+    return xruns;
+}
+
+static void bench_add_time(struct bench_result *result, int64_t begin_ns)
+{
+    int64_t ns = bench_now_ns() - begin_ns;
+
+    result->buffers++;
+    result->total_ns += ns;
+    if (ns > result->max_ns)
+        result->max_ns = ns;
+}
+
+static void bench_fill_sine(int16_t *buffer, size_t frames, unsigned int channels,
+                            unsigned int rate, unsigned int *phase)
+{
+    size_t i;
+    unsigned int c;
+    int16_t sample;
+
+    for (i = 0; i < frames; i++) {
+        sample = (int16_t)(sin(2 * M_PI * *phase / rate) * 0x3fff);
+        *phase = (*phase + BENCH_SINE_HZ) % rate;
+        for (c = 0; c < channels; c++)
+            buffer[i * channels + c] = sample;
+    }
+}
+
+static void bench_set_routing(struct audio_stream *stream, audio_devices_t devices)
+{
+    char kv[64];
+
+    snprintf(kv, sizeof(kv), "%s=%u", AUDIO_PARAMETER_STREAM_ROUTING, devices);
+    stream->set_parameters(stream, kv);
+}
+
+/* Writes a sine for duration_ms, calling step() once halfway.
+ * As for AudioFlinger, the status of set_parameters() is not checked: the HAL
+ * returns the status of the last key it looked up */
+static int bench_write_pcm(struct audio_hw_device *dev, audio_output_flags_t flags,
+                           int duration_ms,
+                           void (*step)(struct audio_hw_device *dev, struct audio_stream_out *out),
+                           struct bench_result *result)
+{
+    struct audio_config config;
+    struct audio_stream_out *out;
+    int16_t *buffer;
+    size_t bytes;
+    size_t frame_size;
+    unsigned int phase = 0;
+    int64_t begin_ns;
+    int64_t end_ns;
+    bool stepped = false;
+    ssize_t ret;
+    int status;
+
+    memset(&config, 0, sizeof(config));
+    config.sample_rate = 48000;
+    config.channel_mask = AUDIO_CHANNEL_OUT_STEREO;
+    config.format = AUDIO_FORMAT_PCM_16_BIT;
+    status = dev->open_output_stream(dev, 1, AUDIO_DEVICE_OUT_SPEAKER, flags, &config, &out,
+                                     NULL);
+    if (status != 0) {
+        fprintf(stderr, "open_output_stream failed: %d\n", status);
+        return status;
+    }
+    bytes = out->common.get_buffer_size(&out->common);
+    frame_size = audio_stream_out_frame_size(out);
+    buffer = malloc(bytes);
+    if (buffer == NULL) {
+        dev->close_output_stream(dev, out);
+        return -ENOMEM;
+    }
+
+    end_ns = bench_now_ns() + (int64_t)duration_ms * 1000000;
+    while (bench_now_ns() < end_ns) {
+        if (!stepped && step != NULL && bench_now_ns() > end_ns - duration_ms * 500000LL) {
+            step(dev, out);
+            stepped = true;
+        }
+        bench_fill_sine(buffer, bytes / frame_size, 2, config.sample_rate, &phase);
+        begin_ns = bench_now_ns();
+        ret = out->write(out, buffer, bytes);
+        bench_add_time(result, begin_ns);
+        if (ret < 0) {
+            fprintf(stderr, "write failed: %zd\n", ret);
+            status = ret;
+            break;
+        }
+    }
+    out->common.standby(&out->common);
+    dev->close_output_stream(dev, out);
+    free(buffer);
+    return status;
+}
+
+/* Low latency output on the speaker, moved to the headphones, then in standby
+ * and restarted */
+static void bench_step_primary(struct audio_hw_device *dev __unused,
+                               struct audio_stream_out *out)
+{
+    bench_set_routing(&out->common, AUDIO_DEVICE_OUT_WIRED_HEADPHONE);
+    out->common.standby(&out->common);
+}
+
+static int bench_primary(struct audio_hw_device *dev, int duration_ms,
+                         struct bench_result *result)
+{
+    return bench_write_pcm(dev, AUDIO_OUTPUT_FLAG_PRIMARY, duration_ms, bench_step_primary,
+                           result);
+}
+
+/* Deep buffer output, with the screen turned off halfway: the playing PCM must
+ * switch to the long wakeups without being reopened */
+static void bench_step_screen_off(struct audio_hw_device *dev,
+                                  struct audio_stream_out *out __unused)
+{
+    dev->set_parameters(dev, "screen_state=off");
+}
+
+static int bench_deep_buffer(struct audio_hw_device *dev, int duration_ms,
+                             struct bench_result *result)
+{
+    extern struct pcm_config pcm_config_deep_buffer;
+    struct fake_pcm_stats stats;
+    unsigned int card, device;
+    bool switched = false;
+    int status;
+
+    status = bench_write_pcm(dev, AUDIO_OUTPUT_FLAG_DEEP_BUFFER, duration_ms,
+                             bench_step_screen_off, result);
+    dev->set_parameters(dev, "screen_state=on");
+
+    /* the dummy buffer thread of the speaker runs its own PCM device next to the
+     * stream one */
+    for (card = 0; status == 0 && card < FAKE_AUDIO_MAX_CARDS; card++) {
+        for (device = 0; device < FAKE_AUDIO_MAX_DEVICES; device++) {
+            if (fake_pcm_get_stats(card, device, false, &stats) != 0 || stats.opens == 0)
+                continue;
+            if (stats.opens != 1) {
+                fprintf(stderr, "card %u device %u: %u opens\n", card, device, stats.opens);
+                status = -EIO;
+            }
+            if (stats.avail_min == pcm_config_deep_buffer.avail_min)
+                switched = true;
+        }
+    }
+    if (status == 0 && !switched) {
+        fprintf(stderr, "no PCM device switched to avail_min %d\n",
+                pcm_config_deep_buffer.avail_min);
+        status = -EIO;
+    }
+    return status;
+}
+
+static int bench_open_input(struct audio_hw_device *dev, audio_io_handle_t handle,
+                            struct audio_stream_in **in)
+{
+    struct audio_config config;
+    int status;
+
+    memset(&config, 0, sizeof(config));
+    config.sample_rate = 48000;
+    config.channel_mask = AUDIO_CHANNEL_IN_MONO;
+    config.format = AUDIO_FORMAT_PCM_16_BIT;
+    status = dev->open_input_stream(dev, handle, AUDIO_DEVICE_IN_BUILTIN_MIC, &config, in,
+                                    AUDIO_INPUT_FLAG_NONE, NULL, AUDIO_SOURCE_MIC);
+    if (status != 0)
+        fprintf(stderr, "open_input_stream failed: %d\n", status);
+    return status;
+}
+
+/* Reads for duration_ms */
+static int bench_read(struct audio_stream_in *in, int duration_ms, struct bench_result *result)
+{
+    size_t bytes = in->common.get_buffer_size(&in->common);
+    void *buffer;
+    int64_t begin_ns;
+    int64_t end_ns;
+    ssize_t ret;
+    int status = 0;
+
+    buffer = malloc(bytes);
+    if (buffer == NULL)
+        return -ENOMEM;
+    end_ns = bench_now_ns() + (int64_t)duration_ms * 1000000;
+    while (bench_now_ns() < end_ns) {
+        begin_ns = bench_now_ns();
+        ret = in->read(in, buffer, bytes);
+        bench_add_time(result, begin_ns);
+        if (ret < 0) {
+            fprintf(stderr, "read failed: %zd\n", ret);
+            status = ret;
+            break;
+        }
+    }
+    free(buffer);
+    return status;
+}
+
+/* Capture from the built-in mic, then stop reading for longer than the capture
+ * buffer: the frames dropped by the card must be counted as an overrun and
+ * reported by get_input_frames_lost() */
+static int bench_capture(struct audio_hw_device *dev, int duration_ms,
+                         struct bench_result *result)
+{
+    struct audio_stream_in *in;
+    struct stream_in *hal_in;
+    uint32_t overruns;
+    uint32_t frames_lost;
+    int buffer_ms;
+    int status;
+
+    status = bench_open_input(dev, 2, &in);
+    if (status != 0)
+        return status;
+    hal_in = (struct stream_in *)in;
+
+    status = bench_read(in, duration_ms, result);
+    if (status == 0) {
+        result->frames_lost += in->get_input_frames_lost(in);
+        pthread_mutex_lock(&hal_in->lock);
+        overruns = hal_in->overruns;
+        buffer_ms = hal_in->config.period_size * hal_in->config.period_count * 1000 /
+                hal_in->config.rate;
+        pthread_mutex_unlock(&hal_in->lock);
+
+        bench_sleep_ms(buffer_ms * 4);
+        status = bench_read(in, buffer_ms * 2, result);
+    }
+    if (status == 0) {
+        pthread_mutex_lock(&hal_in->lock);
+        overruns = hal_in->overruns - overruns;
+        pthread_mutex_unlock(&hal_in->lock);
+        /* only the frames lost since the first phase come from the forced overrun */
+        frames_lost = in->get_input_frames_lost(in);
+        result->frames_lost += frames_lost;
+        if (overruns == 0 || frames_lost == 0) {
+            fprintf(stderr, "forced overrun not reported: %u overruns, %u frames lost\n",
+                    overruns, frames_lost);
+            status = -EIO;
+        }
+    }
+    in->common.standby(&in->common);
+    dev->close_input_stream(dev, in);
+    return status;
+}
+
+struct bench_reader {
+    pthread_t thread;
+    struct audio_stream_in *in;
+    int duration_ms;
+    struct bench_result result;
+    int status;
+};
+
+static void *bench_reader_loop(void *context)
+{
+    struct bench_reader *reader = (struct bench_reader *)context;
+
+    reader->status = bench_read(reader->in, reader->duration_ms, &reader->result);
+    return NULL;
+}
+
+/* Two streams capturing from the shared capture PCM at the same time */
+static int bench_shared_capture(struct audio_hw_device *dev, int duration_ms,
+                                struct bench_result *result)
+{
+    struct bench_reader readers[2];
+    int status = 0;
+    int i;
+
+    memset(readers, 0, sizeof(readers));
+    for (i = 0; i < 2 && status == 0; i++) {
+        status = bench_open_input(dev, 2 + i, &readers[i].in);
+        readers[i].duration_ms = duration_ms;
+    }
+    for (i = 0; i < 2 && status == 0; i++) {
+        if (pthread_create(&readers[i].thread, NULL, bench_reader_loop, &readers[i]) != 0)
+            status = -ENOMEM;
+    }
+    for (i = 0; i < 2; i++) {
+        if (readers[i].thread != 0) {
+            pthread_join(readers[i].thread, NULL);
+            if (readers[i].status != 0)
+                status = readers[i].status;
+            result->buffers += readers[i].result.buffers;
+            result->total_ns += readers[i].result.total_ns;
+            if (readers[i].result.max_ns > result->max_ns)
+                result->max_ns = readers[i].result.max_ns;
+        }
+        if (readers[i].in != NULL) {
+            result->frames_lost += readers[i].in->get_input_frames_lost(readers[i].in);
+            readers[i].in->common.standby(&readers[i].in->common);
+            dev->close_input_stream(dev, readers[i].in);
+        }
+    }
+    return status;
+}
+
+struct bench_offload {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool write_ready;
+    bool drain_ready;
+};
+
+static int bench_offload_callback(stream_callback_event_t event, void *param __unused,
+                                  void *cookie)
+{
+    struct bench_offload *offload = (struct bench_offload *)cookie;
+
+    pthread_mutex_lock(&offload->lock);
+    if (event == STREAM_CBK_EVENT_WRITE_READY)
+        offload->write_ready = true;
+    else if (event == STREAM_CBK_EVENT_DRAIN_READY)
+        offload->drain_ready = true;
+    pthread_cond_broadcast(&offload->cond);
+    pthread_mutex_unlock(&offload->lock);
+    return 0;
+}
+
+static int bench_offload_wait(struct bench_offload *offload, bool *ready)
+{
+    struct timespec ts;
+    int status = 0;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += BENCH_CALLBACK_TIMEOUT_MS / 1000;
+    pthread_mutex_lock(&offload->lock);
+    while (!*ready && status == 0)
+        status = pthread_cond_timedwait(&offload->cond, &offload->lock, &ts);
+    *ready = false;
+    pthread_mutex_unlock(&offload->lock);
+    return status == 0 ? 0 : -ETIMEDOUT;
+}
+
+/* Non blocking MP3 offload, drained at the end */
+static int bench_offload(struct audio_hw_device *dev, int duration_ms,
+                         struct bench_result *result)
+{
+    struct bench_offload offload;
+    struct audio_config config;
+    struct audio_stream_out *out;
+    char buffer[BENCH_OFFLOAD_WRITE_BYTES];
+    int64_t begin_ns;
+    int64_t end_ns;
+    ssize_t ret;
+    int status;
+
+    memset(&offload, 0, sizeof(offload));
+    pthread_mutex_init(&offload.lock, NULL);
+    pthread_cond_init(&offload.cond, NULL);
+    memset(buffer, 0x55, sizeof(buffer));
+
+    memset(&config, 0, sizeof(config));
+    config.sample_rate = 44100;
+    config.channel_mask = AUDIO_CHANNEL_OUT_STEREO;
+    config.format = AUDIO_FORMAT_MP3;
+    config.offload_info = AUDIO_INFO_INITIALIZER;
+    config.offload_info.sample_rate = config.sample_rate;
+    config.offload_info.channel_mask = config.channel_mask;
+    config.offload_info.format = config.format;
+    config.offload_info.stream_type = AUDIO_STREAM_MUSIC;
+    config.offload_info.bit_rate = BENCH_OFFLOAD_BIT_RATE;
+    status = dev->open_output_stream(dev, 4, AUDIO_DEVICE_OUT_SPEAKER,
+                                     AUDIO_OUTPUT_FLAG_DIRECT |
+                                     AUDIO_OUTPUT_FLAG_COMPRESS_OFFLOAD |
+                                     AUDIO_OUTPUT_FLAG_NON_BLOCKING, &config, &out, NULL);
+    if (status != 0) {
+        fprintf(stderr, "open_output_stream failed: %d\n", status);
+        return status;
+    }
+    out->set_callback(out, bench_offload_callback, &offload);
+
+    end_ns = bench_now_ns() + (int64_t)duration_ms * 1000000;
+    while (bench_now_ns() < end_ns) {
+        begin_ns = bench_now_ns();
+        ret = out->write(out, buffer, sizeof(buffer));
+        bench_add_time(result, begin_ns);
+        if (ret < 0) {
+            fprintf(stderr, "write failed: %zd\n", ret);
+            status = ret;
+            break;
+        }
+        if ((size_t)ret < sizeof(buffer)) {
+            status = bench_offload_wait(&offload, &offload.write_ready);
+            if (status != 0) {
+                fprintf(stderr, "no write ready callback\n");
+                break;
+            }
+        }
+    }
+    if (status == 0) {
+        out->drain(out, AUDIO_DRAIN_ALL);
+        status = bench_offload_wait(&offload, &offload.drain_ready);
+        if (status != 0)
+            fprintf(stderr, "no drain ready callback\n");
+    }
+    out->common.standby(&out->common);
+    dev->close_output_stream(dev, out);
+    pthread_cond_destroy(&offload.cond);
+    pthread_mutex_destroy(&offload.lock);
+    return status;
+}
+
+/* from audio_hw.c */
+void extract_main_channels(int16_t *dst, const int16_t *src, size_t frames,
+                           size_t src_channels, size_t dst_channels);
+
+/* extract_main_channels() on 20 ms buffers at 48 kHz. Only the 2 to 1 and 4 to 2
+ * layouts have a NEON kernel: on the host, and for any other layout, the scalar
+ * loops are measured. */
+static int bench_extract(int duration_ms, size_t src_channels, size_t dst_channels,
+                         struct bench_result *result)
+{
+    const size_t frames = 960;
+    int16_t *src;
+    int16_t *dst;
+    int64_t begin_ns;
+    int64_t end_ns;
+    size_t i;
+    size_t c;
+    int status = 0;
+
+    src = malloc(frames * src_channels * sizeof(int16_t));
+    dst = malloc(frames * dst_channels * sizeof(int16_t));
+    if (src == NULL || dst == NULL) {
+        free(src);
+        free(dst);
+        return -ENOMEM;
+    }
+    for (i = 0; i < frames * src_channels; i++)
+        src[i] = (int16_t)i;
+
+    end_ns = bench_now_ns() + (int64_t)duration_ms * 1000000;
+    while (bench_now_ns() < end_ns) {
+        begin_ns = bench_now_ns();
+        extract_main_channels(dst, src, frames, src_channels, dst_channels);
+        bench_add_time(result, begin_ns);
+    }
+
+    for (i = 0; i < frames && status == 0; i++) {
+        for (c = 0; c < dst_channels; c++) {
+            if (dst[i * dst_channels + c] != src[i * src_channels + c]) {
+                fprintf(stderr, "frame %zu channel %zu: %d instead of %d\n", i, c,
+                        dst[i * dst_channels + c], src[i * src_channels + c]);
+                status = -EIO;
+                break;
+            }
+        }
+    }
+    free(src);
+    free(dst);
+    return status;
+}
+
+static int bench_extract_2to1(struct audio_hw_device *dev __unused, int duration_ms,
+                              struct bench_result *result)
+{
+    return bench_extract(duration_ms, 2, 1, result);
+}
+
+static int bench_extract_4to2(struct audio_hw_device *dev __unused, int duration_ms,
+                              struct bench_result *result)
+{
+    return bench_extract(duration_ms, 4, 2, result);
+}
+
+static int bench_extract_6to4(struct audio_hw_device *dev __unused, int duration_ms,
+                              struct bench_result *result)
+{
+    return bench_extract(duration_ms, 6, 4, result);
+}
+
+static const struct bench_scenario bench_scenarios[] = {
+    { "primary", bench_primary },
+    { "deep_buffer", bench_deep_buffer },
+    { "capture", bench_capture },
+    { "shared_capture", bench_shared_capture },
+    { "offload", bench_offload },
+    { "extract_2to1", bench_extract_2to1 },
+    { "extract_4to2", bench_extract_4to2 },
+    { "extract_6to4", bench_extract_6to4 },
+};
+
+#define BENCH_NUM_SCENARIOS (sizeof(bench_scenarios) / sizeof(bench_scenarios[0]))
+
+static int bench_run(struct audio_hw_device *dev, const struct bench_scenario *scenario,
+                     int duration_ms)
+{
+    struct bench_result result;
+    int64_t cpu_ns;
+    int status;
+
+    memset(&result, 0, sizeof(result));
+    fake_audio_reset_stats();
+    cpu_ns = bench_cpu_ns();
+    status = scenario->run(dev, duration_ms, &result);
+    result.cpu_ns = bench_cpu_ns() - cpu_ns;
+    result.xruns = bench_xruns(false) + bench_xruns(true);
+
+    printf("%-16s %8u %10.1f %10.1f %6u %10.1f %8u  %s\n", scenario->name, result.buffers,
+           result.buffers ? result.total_ns / 1000.0 / result.buffers : 0.0,
+           result.max_ns / 1000.0, result.xruns,
+           result.buffers ? result.cpu_ns / 1000.0 / result.buffers : 0.0,
+           result.frames_lost, status == 0 ? "ok" : "FAILED");
+    return status;
+}
+
+static void bench_usage(const char *name)
+{
+    unsigned int i;
+
+    fprintf(stderr, "usage: %s [-c config_dir] [-o output_dir] [-t duration_ms] "
+            "[scenario...]\nscenarios:", name);
+    for (i = 0; i < BENCH_NUM_SCENARIOS; i++)
+        fprintf(stderr, " %s", bench_scenarios[i].name);
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct hw_module_t *module = (struct hw_module_t *)&HAL_MODULE_INFO_SYM;
+    struct audio_hw_device *dev;
+    int duration_ms = BENCH_DEFAULT_DURATION_MS;
+    unsigned int failures = 0;
+    unsigned int i;
+    int status;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:o:t:h")) != -1) {
+        switch (opt) {
+        case 'c':
+            if (chdir(optarg) != 0) {
+                fprintf(stderr, "%s: %s\n", optarg, strerror(errno));
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'o':
+            fake_audio_set_dir(optarg);
+            break;
+        case 't':
+            duration_ms = atoi(optarg);
+            break;
+        default:
+            bench_usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (duration_ms <= 0) {
+        bench_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    status = module->methods->open(module, AUDIO_HARDWARE_INTERFACE, (struct hw_device_t **)&dev);
+    if (status != 0) {
+        fprintf(stderr, "cannot open %s: %d\n", AUDIO_HARDWARE_INTERFACE, status);
+        return EXIT_FAILURE;
+    }
+
+    printf("%-16s %8s %10s %10s %6s %10s %8s\n", "scenario", "buffers", "avg_us", "max_us",
+           "xruns", "cpu_us", "lost");
+    for (i = 0; i < BENCH_NUM_SCENARIOS; i++) {
+        int arg;
+        bool selected = optind >= argc;
+
+        for (arg = optind; arg < argc && !selected; arg++)
+            selected = strcmp(argv[arg], bench_scenarios[i].name) == 0;
+        if (selected && bench_run(dev, &bench_scenarios[i], duration_ms) != 0)
+            failures++;
+    }
+
+    dev->common.close(&dev->common);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
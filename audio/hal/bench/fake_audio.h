@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FAKE_AUDIO_H
+#define FAKE_AUDIO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* bionic defines it in <sys/cdefs.h>, glibc does not */
+#ifndef __unused
+#define __unused __attribute__((__unused__))
+#endif
+
+/* Stand-in for the flounder sound card, used by audio_hal_bench.
+ *
+ * The PCM and compress devices run on a simulated hardware clock derived
+ * from CLOCK_MONOTONIC: the hardware pointer moves one period at a time at
+ * the configured rate, writes and reads block until the pointer makes room,
+ * and late clients get underruns and overruns as on the real card.
+ * When a directory is set with fake_audio_set_dir(), playback is appended to
+ * pcmC<card>D<device>p.raw, capture is read in a loop from
+ * pcmC<card>D<device>c.raw if it exists (a sine is generated otherwise) and
+ * the mixer controls are saved to mixerC<card>.txt when the mixer is closed.
+ */
+
+#define FAKE_AUDIO_MAX_CARDS    4
+#define FAKE_AUDIO_MAX_DEVICES  32
+
+/* Counters of a PCM or compress device, kept across open/close */
+struct fake_pcm_stats {
+    unsigned int opens;
+    unsigned int xruns;
+    uint64_t frames; /* bytes for compress devices */
+    int avail_min; /* set by the last open or SNDRV_PCM_IOCTL_SW_PARAMS */
+};
+
+void fake_audio_set_dir(const char *dir);
+
+/* capture is true for PCM_IN devices. Returns -EINVAL for unknown devices */
+int fake_pcm_get_stats(unsigned int card, unsigned int device, bool capture,
+                       struct fake_pcm_stats *stats);
+int fake_compress_get_stats(unsigned int card, unsigned int device,
+                            struct fake_pcm_stats *stats);
+void fake_audio_reset_stats(void);
+
+/* Number of audio_route_apply_path() and audio_route_update_mixer() calls */
+void fake_audio_route_get_stats(unsigned int *paths_applied, unsigned int *updates);
+
+/* Internal to the fake backend */
+FILE *fake_audio_open_file(const char *name, const char *mode);
+void fake_compress_reset_stats(void);
+void fake_audio_route_reset_stats(void);
+
+#endif // FAKE_AUDIO_H
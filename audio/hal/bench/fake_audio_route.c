@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "fake_audio_route"
+/*#define LOG_NDEBUG 0*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <cutils/log.h>
+#include <audio_route/audio_route.h>
+
+#include "fake_audio.h"
+
+/* The HAL applies its own compiled paths to the mixer, see mixer_load_paths():
+ * audio_route only has to accept the mixer paths file and count the calls */
+struct audio_route {
+    unsigned int card;
+};
+
+static pthread_mutex_t route_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int route_paths_applied;
+static unsigned int route_updates;
+
+void fake_audio_route_get_stats(unsigned int *paths_applied, unsigned int *updates)
+{
+    pthread_mutex_lock(&route_lock);
+    *paths_applied = route_paths_applied;
+    *updates = route_updates;
+    pthread_mutex_unlock(&route_lock);
+}
+
+void fake_audio_route_reset_stats(void)
+{
+    pthread_mutex_lock(&route_lock);
+    route_paths_applied = 0;
+    route_updates = 0;
+    pthread_mutex_unlock(&route_lock);
+}
+
+struct audio_route *audio_route_init(unsigned int card, const char *xml_path)
+{
+    struct audio_route *ar;
+    FILE *file;
+
+    file = fopen(xml_path, "r");
+    if (file == NULL) {
+        ALOGE("%s: failed to open %s", __func__, xml_path);
+        return NULL;
+    }
+    fclose(file);
+    ar = calloc(1, sizeof(struct audio_route));
+    if (ar != NULL)
+        ar->card = card;
+    return ar;
+}
+
+void audio_route_free(struct audio_route *ar)
+{
+    free(ar);
+}
+
+int audio_route_apply_path(struct audio_route *ar __unused, const char *name __unused)
+{
+    ALOGV("%s: %s", __func__, name);
+    pthread_mutex_lock(&route_lock);
+    route_paths_applied++;
+    pthread_mutex_unlock(&route_lock);
+    return 0;
+}
+
+int audio_route_reset_path(struct audio_route *ar __unused, const char *name __unused)
+{
+    ALOGV("%s: %s", __func__, name);
+    return 0;
+}
+
+int audio_route_update_mixer(struct audio_route *ar __unused)
+{
+    pthread_mutex_lock(&route_lock);
+    route_updates++;
+    pthread_mutex_unlock(&route_lock);
+    return 0;
+}
@@ -0,0 +1,195 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "fake_audio_utils"
+/*#define LOG_NDEBUG 0*/
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cutils/log.h>
+#include <audio_utils/echo_reference.h>
+#include <audio_utils/resampler.h>
+
+#include "fake_audio.h"
+
+/* The host build of libaudioutils has neither the speex resampler nor the
+ * echo reference: a linear interpolator stands in for the first, and echo
+ * cancellation is not available on the bench */
+
+struct fake_resampler {
+    struct resampler_itfe itfe;
+    struct resampler_buffer_provider *provider;
+    uint32_t in_rate;
+    uint32_t out_rate;
+    uint32_t channels;
+    /* position of the next output frame, in 1/out_rate of input frames,
+     * relative to the last input frame kept in prev */
+    uint64_t phase;
+    int16_t *prev;
+    bool primed;
+};
+
+static void fake_resampler_reset(struct resampler_itfe *resampler)
+{
+    struct fake_resampler *rsmp = (struct fake_resampler *)resampler;
+
+    rsmp->phase = 0;
+    rsmp->primed = false;
+}
+
+static int32_t fake_resampler_delay_ns(struct resampler_itfe *resampler)
+{
+    struct fake_resampler *rsmp = (struct fake_resampler *)resampler;
+
+    return (int32_t)(1000000000LL / rsmp->in_rate);
+}
+
+/* Resamples in_frames frames, returns the number of input frames consumed */
+static size_t fake_resampler_run(struct fake_resampler *rsmp, const int16_t *in,
+                                 size_t in_frames, int16_t *out, size_t *out_frames)
+{
+    size_t produced = 0;
+    size_t consumed = 0;
+    uint64_t idx;
+    uint32_t frac;
+    const int16_t *a;
+    const int16_t *b;
+    uint32_t c;
+
+    if (!rsmp->primed && in_frames > 0) {
+        memcpy(rsmp->prev, in, rsmp->channels * sizeof(int16_t));
+        rsmp->primed = true;
+        consumed = 1;
+    }
+    while (produced < *out_frames) {
+        /* interpolate between positions idx and idx + 1, where 0 is prev */
+        idx = rsmp->phase / rsmp->out_rate;
+        frac = rsmp->phase % rsmp->out_rate;
+        if (consumed + idx >= in_frames)
+            break;
+        a = idx == 0 ? rsmp->prev : in + (consumed + idx - 1) * rsmp->channels;
+        b = in + (consumed + idx) * rsmp->channels;
+        for (c = 0; c < rsmp->channels; c++)
+            out[produced * rsmp->channels + c] =
+                    a[c] + (int32_t)(b[c] - a[c]) * (int32_t)frac / (int32_t)rsmp->out_rate;
+        produced++;
+        rsmp->phase += rsmp->in_rate;
+    }
+    /* keep the last input frame read for the next call */
+    idx = rsmp->phase / rsmp->out_rate;
+    if (idx > in_frames - consumed)
+        idx = in_frames - consumed;
+    if (idx > 0) {
+        memcpy(rsmp->prev, in + (consumed + idx - 1) * rsmp->channels,
+               rsmp->channels * sizeof(int16_t));
+        rsmp->phase -= idx * rsmp->out_rate;
+        consumed += idx;
+    }
+    *out_frames = produced;
+    return consumed;
+}
+
+static int fake_resampler_resample_from_input(struct resampler_itfe *resampler, int16_t *in,
+                                              size_t *inFrameCount, int16_t *out,
+                                              size_t *outFrameCount)
+{
+    struct fake_resampler *rsmp = (struct fake_resampler *)resampler;
+
+    if (in == NULL || out == NULL || inFrameCount == NULL || outFrameCount == NULL)
+        return -EINVAL;
+    *inFrameCount = fake_resampler_run(rsmp, in, *inFrameCount, out, outFrameCount);
+    return 0;
+}
+
+static int fake_resampler_resample_from_provider(struct resampler_itfe *resampler,
+                                                 int16_t *out, size_t *outFrameCount)
+{
+    struct fake_resampler *rsmp = (struct fake_resampler *)resampler;
+    struct resampler_buffer buf;
+    size_t wanted = *outFrameCount;
+    size_t done = 0;
+    size_t frames;
+
+    if (rsmp->provider == NULL || out == NULL)
+        return -EINVAL;
+    while (done < wanted) {
+        buf.frame_count = (wanted - done) * rsmp->in_rate / rsmp->out_rate + 2;
+        rsmp->provider->get_next_buffer(rsmp->provider, &buf);
+        if (buf.raw == NULL || buf.frame_count == 0)
+            break;
+        frames = wanted - done;
+        buf.frame_count = fake_resampler_run(rsmp, buf.i16, buf.frame_count,
+                                             out + done * rsmp->channels, &frames);
+        rsmp->provider->release_buffer(rsmp->provider, &buf);
+        done += frames;
+    }
+    *outFrameCount = done;
+    return 0;
+}
+
+int create_resampler(uint32_t inSampleRate, uint32_t outSampleRate, uint32_t channelCount,
+                     uint32_t quality __unused, struct resampler_buffer_provider *provider,
+                     struct resampler_itfe **resampler)
+{
+    struct fake_resampler *rsmp;
+
+    if (resampler == NULL || inSampleRate == 0 || outSampleRate == 0 || channelCount == 0)
+        return -EINVAL;
+    rsmp = calloc(1, sizeof(struct fake_resampler));
+    if (rsmp == NULL)
+        return -ENOMEM;
+    rsmp->prev = calloc(channelCount, sizeof(int16_t));
+    if (rsmp->prev == NULL) {
+        free(rsmp);
+        return -ENOMEM;
+    }
+    rsmp->itfe.reset = fake_resampler_reset;
+    rsmp->itfe.resample_from_provider = fake_resampler_resample_from_provider;
+    rsmp->itfe.resample_from_input = fake_resampler_resample_from_input;
+    rsmp->itfe.delay_ns = fake_resampler_delay_ns;
+    rsmp->provider = provider;
+    rsmp->in_rate = inSampleRate;
+    rsmp->out_rate = outSampleRate;
+    rsmp->channels = channelCount;
+    *resampler = &rsmp->itfe;
+    return 0;
+}
+
+void release_resampler(struct resampler_itfe *resampler)
+{
+    struct fake_resampler *rsmp = (struct fake_resampler *)resampler;
+
+    if (rsmp == NULL)
+        return;
+    free(rsmp->prev);
+    free(rsmp);
+}
+
+int create_echo_reference(audio_format_t rdFormat __unused, uint32_t rdChannelCount __unused,
+                          uint32_t rdSamplingRate __unused, audio_format_t wrFormat __unused,
+                          uint32_t wrChannelCount __unused, uint32_t wrSamplingRate __unused,
+                          struct echo_reference_itfe **echo_reference)
+{
+    *echo_reference = NULL;
+    return -ENODEV;
+}
+
+void release_echo_reference(struct echo_reference_itfe *echo_reference __unused)
+{
+}
@@ -0,0 +1,639 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "fake_tinyalsa"
+/*#define LOG_NDEBUG 0*/
+
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+
+#include <cutils/log.h>
+#include <sound/asound.h>
+#include <tinyalsa/asoundlib.h>
+
+#include "fake_audio.h"
+
+#define FAKE_PCM_SINE_HZ        1000
+#define FAKE_MIXER_CTL_VALUES   2
+
+struct pcm {
+    unsigned int card;
+    unsigned int device;
+    unsigned int flags;
+    struct pcm_config config;
+    unsigned int buffer_size;
+    bool running;
+    /* hardware pointer at start_ns, in frames */
+    uint64_t hw_base;
+    int64_t start_ns;
+    /* application pointer, in frames */
+    uint64_t appl;
+    unsigned int sine_phase;
+    FILE *file;
+    struct fake_pcm_stats *stats;
+    char error[128];
+};
+
+struct mixer_ctl {
+    struct mixer_ctl *next;
+    char *name;
+    enum mixer_ctl_type type;
+    unsigned int num_values;
+    int values[FAKE_MIXER_CTL_VALUES];
+    const char * const *enums;
+    unsigned int num_enums;
+};
+
+struct mixer {
+    unsigned int card;
+    struct mixer_ctl *ctls;
+};
+
+/* Enumerated controls of the codec, the other controls are created as
+ * integers when first looked up */
+static const char * const tdm_mode_enums[] = { "Normal", "LR Swap", "LL Copy", "RR Copy" };
+static const char * const dmic_mux_enums[] = { "DMIC1", "DMIC2" };
+
+static const struct {
+    const char *name;
+    const char * const *enums;
+    unsigned int num_enums;
+} fake_enum_ctls[] = {
+    { "TDM1 Mode", tdm_mode_enums, sizeof(tdm_mode_enums) / sizeof(tdm_mode_enums[0]) },
+    { "Mono DMIC L Mux", dmic_mux_enums, sizeof(dmic_mux_enums) / sizeof(dmic_mux_enums[0]) },
+    { "Mono DMIC R Mux", dmic_mux_enums, sizeof(dmic_mux_enums) / sizeof(dmic_mux_enums[0]) },
+};
+
+static pthread_mutex_t fake_lock = PTHREAD_MUTEX_INITIALIZER;
+static char fake_dir[PATH_MAX];
+static struct fake_pcm_stats pcm_stats[FAKE_AUDIO_MAX_CARDS][FAKE_AUDIO_MAX_DEVICES][2];
+
+static int64_t fake_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void fake_sleep_ns(int64_t ns)
+{
+    struct timespec ts;
+
+    if (ns <= 0)
+        return;
+    ts.tv_sec = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    nanosleep(&ts, NULL);
+}
+
+void fake_audio_set_dir(const char *dir)
+{
+    pthread_mutex_lock(&fake_lock);
+    snprintf(fake_dir, sizeof(fake_dir), "%s", dir != NULL ? dir : "");
+    pthread_mutex_unlock(&fake_lock);
+}
+
+FILE *fake_audio_open_file(const char *name, const char *mode)
+{
+    char path[PATH_MAX + 64];
+
+    pthread_mutex_lock(&fake_lock);
+    if (fake_dir[0] == '\0') {
+        pthread_mutex_unlock(&fake_lock);
+        return NULL;
+    }
+    snprintf(path, sizeof(path), "%s/%s", fake_dir, name);
+    pthread_mutex_unlock(&fake_lock);
+    return fopen(path, mode);
+}
+
+int fake_pcm_get_stats(unsigned int card, unsigned int device, bool capture,
+                       struct fake_pcm_stats *stats)
+{
+    if (card >= FAKE_AUDIO_MAX_CARDS || device >= FAKE_AUDIO_MAX_DEVICES)
+        return -EINVAL;
+    pthread_mutex_lock(&fake_lock);
+    *stats = pcm_stats[card][device][capture ? 1 : 0];
+    pthread_mutex_unlock(&fake_lock);
+    return 0;
+}
+
+void fake_audio_reset_stats(void)
+{
+    pthread_mutex_lock(&fake_lock);
+    memset(pcm_stats, 0, sizeof(pcm_stats));
+    pthread_mutex_unlock(&fake_lock);
+    fake_compress_reset_stats();
+    fake_audio_route_reset_stats();
+}
+
+/* PCM */
+
+unsigned int pcm_format_to_bits(enum pcm_format format)
+{
+    switch (format) {
+    case PCM_FORMAT_S32_LE:
+    case PCM_FORMAT_S24_LE:
+        return 32;
+    case PCM_FORMAT_S24_3LE:
+        return 24;
+    case PCM_FORMAT_S8:
+        return 8;
+    default:
+        return 16;
+    }
+}
+
+unsigned int pcm_frames_to_bytes(struct pcm *pcm, unsigned int frames)
+{
+    return frames * pcm->config.channels * (pcm_format_to_bits(pcm->config.format) >> 3);
+}
+
+unsigned int pcm_bytes_to_frames(struct pcm *pcm, unsigned int bytes)
+{
+    return bytes / (pcm->config.channels * (pcm_format_to_bits(pcm->config.format) >> 3));
+}
+
+/* Hardware pointer at now_ns, moved at period boundaries. The time of the last
+ * boundary is returned in tstamp_ns if not NULL */
+static uint64_t pcm_hw_ptr(struct pcm *pcm, int64_t now_ns, int64_t *tstamp_ns)
+{
+    uint64_t elapsed;
+
+    if (!pcm->running) {
+        if (tstamp_ns != NULL)
+            *tstamp_ns = now_ns;
+        return pcm->hw_base;
+    }
+    elapsed = (uint64_t)(now_ns - pcm->start_ns) * pcm->config.rate / 1000000000;
+    elapsed -= elapsed % pcm->config.period_size;
+    if (tstamp_ns != NULL)
+        *tstamp_ns = pcm->start_ns + (int64_t)(elapsed * 1000000000 / pcm->config.rate);
+    return pcm->hw_base + elapsed;
+}
+
+/* Time until the hardware pointer reaches ptr */
+static int64_t pcm_ns_until(struct pcm *pcm, uint64_t ptr, int64_t now_ns)
+{
+    uint64_t frames;
+
+    if (!pcm->running || ptr <= pcm->hw_base)
+        return 0;
+    frames = ptr - pcm->hw_base;
+    /* round up to the period boundary that makes the frames available */
+    frames = (frames + pcm->config.period_size - 1) / pcm->config.period_size *
+            pcm->config.period_size;
+    return pcm->start_ns + (int64_t)(frames * 1000000000 / pcm->config.rate) - now_ns;
+}
+
+static void pcm_start_clock(struct pcm *pcm, int64_t now_ns)
+{
+    pcm->running = true;
+    pcm->start_ns = now_ns;
+}
+
+static void pcm_stop_clock(struct pcm *pcm, uint64_t hw_ptr)
+{
+    pcm->running = false;
+    pcm->hw_base = hw_ptr;
+}
+
+static void pcm_update_stats(struct pcm *pcm, unsigned int xruns, unsigned int frames)
+{
+    pthread_mutex_lock(&fake_lock);
+    pcm->stats->xruns += xruns;
+    pcm->stats->frames += frames;
+    pthread_mutex_unlock(&fake_lock);
+}
+
+struct pcm *pcm_open(unsigned int card, unsigned int device, unsigned int flags,
+                     struct pcm_config *config)
+{
+    struct pcm *pcm;
+    char name[64];
+
+    pcm = calloc(1, sizeof(struct pcm));
+    if (pcm == NULL)
+        return NULL;
+    pcm->card = card;
+    pcm->device = device;
+    pcm->flags = flags;
+    if (card >= FAKE_AUDIO_MAX_CARDS || device >= FAKE_AUDIO_MAX_DEVICES) {
+        snprintf(pcm->error, sizeof(pcm->error), "cannot open device %u on card %u",
+                 device, card);
+        return pcm;
+    }
+    if (config == NULL || config->channels == 0 || config->rate == 0 ||
+            config->period_size == 0 || config->period_count == 0) {
+        snprintf(pcm->error, sizeof(pcm->error), "cannot set hw params");
+        return pcm;
+    }
+    pcm->config = *config;
+    pcm->buffer_size = config->period_size * config->period_count;
+    /* same defaults as tinyalsa */
+    if (pcm->config.start_threshold == 0)
+        pcm->config.start_threshold = (flags & PCM_IN) ? 1 : pcm->buffer_size / 2;
+    if (pcm->config.stop_threshold == 0)
+        pcm->config.stop_threshold = (flags & PCM_IN) ? pcm->buffer_size * 10 :
+                                                        pcm->buffer_size;
+    if (pcm->config.avail_min == 0)
+        pcm->config.avail_min = config->period_size;
+
+    snprintf(name, sizeof(name), "pcmC%uD%u%c.raw", card, device, (flags & PCM_IN) ? 'c' : 'p');
+    pcm->file = fake_audio_open_file(name, (flags & PCM_IN) ? "rb" : "ab");
+
+    pthread_mutex_lock(&fake_lock);
+    pcm->stats = &pcm_stats[card][device][(flags & PCM_IN) ? 1 : 0];
+    pcm->stats->opens++;
+    pcm->stats->avail_min = pcm->config.avail_min;
+    pthread_mutex_unlock(&fake_lock);
+
+    ALOGV("%s: card %u device %u rate %u channels %u period %u x %u", __func__, card, device,
+          config->rate, config->channels, config->period_size, config->period_count);
+    return pcm;
+}
+
+int pcm_close(struct pcm *pcm)
+{
+    if (pcm == NULL)
+        return -EINVAL;
+    if (pcm->file != NULL)
+        fclose(pcm->file);
+    free(pcm);
+    return 0;
+}
+
+int pcm_is_ready(struct pcm *pcm)
+{
+    return pcm->error[0] == '\0';
+}
+
+const char *pcm_get_error(struct pcm *pcm)
+{
+    return pcm->error;
+}
+
+unsigned int pcm_get_buffer_size(struct pcm *pcm)
+{
+    return pcm->buffer_size;
+}
+
+/* As tinyalsa, only for the mmap streams woken up by the application */
+int pcm_set_avail_min(struct pcm *pcm, int avail_min)
+{
+    if ((~pcm->flags) & (PCM_MMAP | PCM_NOIRQ))
+        return -ENOSYS;
+    pcm->config.avail_min = avail_min;
+    return 0;
+}
+
+/* Only SNDRV_PCM_IOCTL_SW_PARAMS is handled: the thresholds apply from the next
+ * write or read, the PCM keeps running */
+int pcm_ioctl(struct pcm *pcm, int request, ...)
+{
+    struct snd_pcm_sw_params *sparams;
+    va_list ap;
+
+    if (request != (int)SNDRV_PCM_IOCTL_SW_PARAMS) {
+        errno = ENOTTY;
+        return -1;
+    }
+    va_start(ap, request);
+    sparams = va_arg(ap, struct snd_pcm_sw_params *);
+    va_end(ap);
+    if (sparams->avail_min == 0 || sparams->avail_min > pcm->buffer_size ||
+            sparams->start_threshold == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    pcm->config.start_threshold = sparams->start_threshold;
+    pcm->config.stop_threshold = sparams->stop_threshold;
+    pcm->config.avail_min = sparams->avail_min;
+
+    pthread_mutex_lock(&fake_lock);
+    pcm->stats->avail_min = pcm->config.avail_min;
+    pthread_mutex_unlock(&fake_lock);
+    return 0;
+}
+
+int pcm_get_htimestamp(struct pcm *pcm, unsigned int *avail, struct timespec *tstamp)
+{
+    int64_t tstamp_ns;
+    uint64_t hw;
+
+    if (!pcm->running)
+        return -1;
+    hw = pcm_hw_ptr(pcm, fake_now_ns(), &tstamp_ns);
+    if (pcm->flags & PCM_IN) {
+        *avail = hw - pcm->appl > pcm->buffer_size ? pcm->buffer_size : hw - pcm->appl;
+    } else {
+        *avail = hw >= pcm->appl ? pcm->buffer_size :
+                pcm->buffer_size - (unsigned int)(pcm->appl - hw);
+    }
+    tstamp->tv_sec = tstamp_ns / 1000000000;
+    tstamp->tv_nsec = tstamp_ns % 1000000000;
+    return 0;
+}
+
+int pcm_stop(struct pcm *pcm)
+{
+    uint64_t hw = pcm_hw_ptr(pcm, fake_now_ns(), NULL);
+
+    /* the buffered frames are dropped */
+    if (!(pcm->flags & PCM_IN) || hw > pcm->appl)
+        pcm->appl = hw > pcm->appl ? hw : pcm->appl;
+    pcm_stop_clock(pcm, pcm->appl);
+    return 0;
+}
+
+int pcm_write(struct pcm *pcm, const void *data, unsigned int count)
+{
+    unsigned int frames = pcm_bytes_to_frames(pcm, count);
+    unsigned int done = 0;
+    unsigned int chunk;
+    unsigned int space;
+    int64_t now_ns;
+    uint64_t hw;
+    int64_t avail;
+
+    if (!pcm_is_ready(pcm) || (pcm->flags & PCM_IN))
+        return -EINVAL;
+
+    while (done < frames) {
+        now_ns = fake_now_ns();
+        hw = pcm_hw_ptr(pcm, now_ns, NULL);
+        if (pcm->running) {
+            avail = (int64_t)pcm->buffer_size - (int64_t)(pcm->appl - hw);
+            if (avail >= (int64_t)pcm->config.stop_threshold) {
+                /* underrun: tinyalsa prepares the PCM and writes again */
+                ALOGV("%s: card %u device %u underrun", __func__, pcm->card, pcm->device);
+                pcm_update_stats(pcm, 1, 0);
+                pcm_stop_clock(pcm, pcm->appl);
+                hw = pcm->appl;
+            } else if (hw > pcm->appl) {
+                /* stop threshold above the buffer: the card played silence */
+                pcm->appl = hw;
+            }
+        }
+        space = pcm->buffer_size - (unsigned int)(pcm->appl - hw);
+        if (!pcm->running && space == 0) {
+            /* start threshold above the buffer */
+            pcm_start_clock(pcm, now_ns);
+            continue;
+        }
+        if (space == 0 || (space < frames - done && space < (unsigned int)pcm->config.avail_min)) {
+            fake_sleep_ns(pcm_ns_until(pcm, pcm->appl + pcm->config.avail_min -
+                                       pcm->buffer_size, now_ns));
+            continue;
+        }
+        chunk = frames - done < space ? frames - done : space;
+        if (pcm->file != NULL)
+            fwrite((const char *)data + pcm_frames_to_bytes(pcm, done), 1,
+                   pcm_frames_to_bytes(pcm, chunk), pcm->file);
+        pcm->appl += chunk;
+        pcm_update_stats(pcm, 0, chunk);
+        done += chunk;
+        if (!pcm->running && pcm->appl - pcm->hw_base >= pcm->config.start_threshold)
+            pcm_start_clock(pcm, now_ns);
+    }
+    return 0;
+}
+
+/* Fills the capture buffer from the file of the device, or with a sine */
+static void pcm_fill_capture(struct pcm *pcm, void *data, unsigned int frames)
+{
+    unsigned int bytes = pcm_frames_to_bytes(pcm, frames);
+    unsigned int bits = pcm_format_to_bits(pcm->config.format);
+    unsigned int done = 0;
+    unsigned int i, c;
+    size_t n;
+    int32_t sample;
+
+    if (pcm->file != NULL) {
+        while (done < bytes) {
+            n = fread((char *)data + done, 1, bytes - done, pcm->file);
+            if (n == 0) {
+                if (ftell(pcm->file) == 0)
+                    break;
+                rewind(pcm->file);
+            }
+            done += n;
+        }
+        if (done == bytes)
+            return;
+    }
+    for (i = 0; i < frames; i++) {
+        /* -6 dBFS */
+        sample = (int32_t)(sin(2 * M_PI * pcm->sine_phase / pcm->config.rate) * 0x3fffffff);
+        pcm->sine_phase = (pcm->sine_phase + FAKE_PCM_SINE_HZ) % pcm->config.rate;
+        for (c = 0; c < pcm->config.channels; c++) {
+            if (bits == 32)
+                ((int32_t *)data)[i * pcm->config.channels + c] =
+                        pcm->config.format == PCM_FORMAT_S24_LE ? sample >> 8 : sample;
+            else
+                ((int16_t *)data)[i * pcm->config.channels + c] = sample >> 16;
+        }
+    }
+}
+
+int pcm_read(struct pcm *pcm, void *data, unsigned int count)
+{
+    unsigned int frames = pcm_bytes_to_frames(pcm, count);
+    int64_t now_ns;
+    uint64_t hw;
+
+    if (!pcm_is_ready(pcm) || !(pcm->flags & PCM_IN))
+        return -EINVAL;
+
+    if (!pcm->running) {
+        pcm->hw_base = pcm->appl;
+        pcm_start_clock(pcm, fake_now_ns());
+    }
+    for (;;) {
+        now_ns = fake_now_ns();
+        hw = pcm_hw_ptr(pcm, now_ns, NULL);
+        if (hw - pcm->appl > pcm->buffer_size) {
+            if (hw - pcm->appl >= pcm->config.stop_threshold) {
+                /* overrun: tinyalsa prepares the PCM and restarts capture */
+                ALOGV("%s: card %u device %u overrun", __func__, pcm->card, pcm->device);
+                pcm_update_stats(pcm, 1, 0);
+                pcm->hw_base = pcm->appl;
+                pcm_start_clock(pcm, now_ns);
+                continue;
+            }
+            /* stop threshold above the buffer: the oldest frames were overwritten */
+            pcm->appl = hw - pcm->buffer_size;
+        }
+        if (hw - pcm->appl >= frames)
+            break;
+        fake_sleep_ns(pcm_ns_until(pcm, pcm->appl + frames, now_ns));
+    }
+    pcm_fill_capture(pcm, data, frames);
+    pcm->appl += frames;
+    pcm_update_stats(pcm, 0, frames);
+    return 0;
+}
+
+/* Mixer */
+
+struct mixer *mixer_open(unsigned int card)
+{
+    struct mixer *mixer;
+
+    if (card >= FAKE_AUDIO_MAX_CARDS)
+        return NULL;
+    mixer = calloc(1, sizeof(struct mixer));
+    if (mixer != NULL)
+        mixer->card = card;
+    return mixer;
+}
+
+/* Saves the control values to mixerC<card>.txt */
+static void mixer_save(struct mixer *mixer)
+{
+    struct mixer_ctl *ctl;
+    char name[32];
+    unsigned int i;
+    FILE *file;
+
+    snprintf(name, sizeof(name), "mixerC%u.txt", mixer->card);
+    file = fake_audio_open_file(name, "w");
+    if (file == NULL)
+        return;
+    for (ctl = mixer->ctls; ctl != NULL; ctl = ctl->next) {
+        fprintf(file, "%s:", ctl->name);
+        for (i = 0; i < ctl->num_values; i++) {
+            if (ctl->type == MIXER_CTL_TYPE_ENUM)
+                fprintf(file, " %s", ctl->enums[ctl->values[i]]);
+            else
+                fprintf(file, " %d", ctl->values[i]);
+        }
+        fprintf(file, "\n");
+    }
+    fclose(file);
+}
+
+void mixer_close(struct mixer *mixer)
+{
+    struct mixer_ctl *ctl;
+
+    if (mixer == NULL)
+        return;
+    mixer_save(mixer);
+    while (mixer->ctls != NULL) {
+        ctl = mixer->ctls;
+        mixer->ctls = ctl->next;
+        free(ctl->name);
+        free(ctl);
+    }
+    free(mixer);
+}
+
+struct mixer_ctl *mixer_get_ctl_by_name(struct mixer *mixer, const char *name)
+{
+    struct mixer_ctl *ctl;
+    unsigned int i;
+
+    for (ctl = mixer->ctls; ctl != NULL; ctl = ctl->next) {
+        if (strcmp(ctl->name, name) == 0)
+            return ctl;
+    }
+
+    ctl = calloc(1, sizeof(struct mixer_ctl));
+    if (ctl == NULL)
+        return NULL;
+    ctl->name = strdup(name);
+    ctl->type = MIXER_CTL_TYPE_INT;
+    ctl->num_values = FAKE_MIXER_CTL_VALUES;
+    for (i = 0; i < sizeof(fake_enum_ctls) / sizeof(fake_enum_ctls[0]); i++) {
+        if (strcmp(fake_enum_ctls[i].name, name) == 0) {
+            ctl->type = MIXER_CTL_TYPE_ENUM;
+            ctl->num_values = 1;
+            ctl->enums = fake_enum_ctls[i].enums;
+            ctl->num_enums = fake_enum_ctls[i].num_enums;
+            break;
+        }
+    }
+    ctl->next = mixer->ctls;
+    mixer->ctls = ctl;
+    return ctl;
+}
+
+const char *mixer_ctl_get_name(struct mixer_ctl *ctl)
+{
+    return ctl->name;
+}
+
+enum mixer_ctl_type mixer_ctl_get_type(struct mixer_ctl *ctl)
+{
+    return ctl->type;
+}
+
+unsigned int mixer_ctl_get_num_values(struct mixer_ctl *ctl)
+{
+    return ctl->num_values;
+}
+
+unsigned int mixer_ctl_get_num_enums(struct mixer_ctl *ctl)
+{
+    return ctl->num_enums;
+}
+
+const char *mixer_ctl_get_enum_string(struct mixer_ctl *ctl, unsigned int enum_id)
+{
+    if (enum_id >= ctl->num_enums)
+        return NULL;
+    return ctl->enums[enum_id];
+}
+
+int mixer_ctl_get_value(struct mixer_ctl *ctl, unsigned int id)
+{
+    if (id >= ctl->num_values)
+        return -EINVAL;
+    return ctl->values[id];
+}
+
+int mixer_ctl_set_value(struct mixer_ctl *ctl, unsigned int id, int value)
+{
+    if (id >= ctl->num_values ||
+            (ctl->type == MIXER_CTL_TYPE_ENUM && (unsigned int)value >= ctl->num_enums))
+        return -EINVAL;
+    ctl->values[id] = value;
+    return 0;
+}
+
+/* As tinyalsa, for INT and BOOL controls only, from an array of long */
+int mixer_ctl_set_array(struct mixer_ctl *ctl, const void *array, size_t count)
+{
+    const long *values = array;
+    size_t i;
+
+    if (count > ctl->num_values ||
+            (ctl->type != MIXER_CTL_TYPE_INT && ctl->type != MIXER_CTL_TYPE_BOOL))
+        return -EINVAL;
+    for (i = 0; i < count; i++)
+        ctl->values[i] = (int)values[i];
+    return 0;
+}
@@ -0,0 +1,398 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "fake_tinycompress"
+/*#define LOG_NDEBUG 0*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <cutils/log.h>
+#include <tinycompress/tinycompress.h>
+
+#include "fake_audio.h"
+
+/* decoding rate when the stream does not give its bit rate */
+#define FAKE_COMPRESS_DEFAULT_BIT_RATE  128000
+#define FAKE_COMPRESS_DEFAULT_RATE      44100
+/* the DSP reads the buffer by blocks of this duration */
+#define FAKE_COMPRESS_PERIOD_MS         20
+
+/* The DSP consumes the buffer at the bit rate of the stream while it is
+ * started and not paused. Waits are woken by stop, pause and close */
+struct compress {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned int card;
+    unsigned int device;
+    struct compr_config config;
+    unsigned int buffer_size;
+    unsigned int byte_rate;
+    unsigned int sample_rate;
+    bool ready;
+    bool nonblock;
+    bool running;
+    bool paused;
+    /* bytes consumed at start_ns */
+    uint64_t consumed_base;
+    int64_t start_ns;
+    uint64_t written;
+    /* incremented by compress_stop() to abort the drains */
+    unsigned int generation;
+    FILE *file;
+    struct fake_pcm_stats *stats;
+    char error[128];
+};
+
+static pthread_mutex_t compress_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct fake_pcm_stats compress_stats[FAKE_AUDIO_MAX_CARDS][FAKE_AUDIO_MAX_DEVICES];
+
+int fake_compress_get_stats(unsigned int card, unsigned int device,
+                            struct fake_pcm_stats *stats)
+{
+    if (card >= FAKE_AUDIO_MAX_CARDS || device >= FAKE_AUDIO_MAX_DEVICES)
+        return -EINVAL;
+    pthread_mutex_lock(&compress_stats_lock);
+    *stats = compress_stats[card][device];
+    pthread_mutex_unlock(&compress_stats_lock);
+    return 0;
+}
+
+void fake_compress_reset_stats(void)
+{
+    pthread_mutex_lock(&compress_stats_lock);
+    memset(compress_stats, 0, sizeof(compress_stats));
+    pthread_mutex_unlock(&compress_stats_lock);
+}
+
+static int64_t compress_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void compress_deadline(struct timespec *ts, int64_t ns)
+{
+    int64_t deadline_ns = compress_now_ns() + ns;
+
+    ts->tv_sec = deadline_ns / 1000000000;
+    ts->tv_nsec = deadline_ns % 1000000000;
+}
+
+/* Bytes read by the DSP, one period at a time.
+ * must be called with compress->lock locked */
+static uint64_t compress_consumed_l(struct compress *compress)
+{
+    uint64_t period = (uint64_t)compress->byte_rate * FAKE_COMPRESS_PERIOD_MS / 1000;
+    uint64_t consumed;
+
+    if (!compress->running || compress->paused)
+        return compress->consumed_base;
+    consumed = (uint64_t)(compress_now_ns() - compress->start_ns) * compress->byte_rate /
+            1000000000;
+    if (period != 0)
+        consumed -= consumed % period;
+    consumed += compress->consumed_base;
+    if (consumed > compress->written) {
+        /* the DSP starved: it waits for data where it stopped */
+        consumed = compress->written;
+        compress->consumed_base = consumed;
+        compress->start_ns = compress_now_ns();
+    }
+    return consumed;
+}
+
+/* Time for the DSP to consume up to the given number of bytes.
+ * must be called with compress->lock locked */
+static int64_t compress_ns_until_l(struct compress *compress, uint64_t consumed)
+{
+    uint64_t now_consumed = compress_consumed_l(compress);
+
+    if (!compress->running || compress->paused || consumed <= now_consumed)
+        return 0;
+    return (int64_t)((consumed - now_consumed) * 1000000000 / compress->byte_rate) +
+            FAKE_COMPRESS_PERIOD_MS * 1000000;
+}
+
+/* Freezes the DSP position before a change of state.
+ * must be called with compress->lock locked */
+static void compress_freeze_l(struct compress *compress)
+{
+    compress->consumed_base = compress_consumed_l(compress);
+    compress->start_ns = compress_now_ns();
+}
+
+struct compress *compress_open(unsigned int card, unsigned int device,
+                               unsigned int flags, struct compr_config *config)
+{
+    struct compress *compress;
+    pthread_condattr_t attr;
+    char name[64];
+
+    compress = calloc(1, sizeof(struct compress));
+    if (compress == NULL)
+        return NULL;
+    pthread_mutex_init(&compress->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&compress->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    compress->card = card;
+    compress->device = device;
+
+    if (card >= FAKE_AUDIO_MAX_CARDS || device >= FAKE_AUDIO_MAX_DEVICES ||
+            !(flags & COMPRESS_IN)) {
+        snprintf(compress->error, sizeof(compress->error),
+                 "cannot open device %u on card %u", device, card);
+        return compress;
+    }
+    if (config == NULL || config->codec == NULL || config->fragment_size == 0 ||
+            config->fragments == 0) {
+        snprintf(compress->error, sizeof(compress->error), "cannot set codec params");
+        return compress;
+    }
+    compress->config = *config;
+    compress->buffer_size = config->fragment_size * config->fragments;
+    compress->byte_rate = (config->codec->bit_rate != 0 ? config->codec->bit_rate :
+                           FAKE_COMPRESS_DEFAULT_BIT_RATE) / 8;
+    compress->sample_rate = config->codec->sample_rate != 0 ? config->codec->sample_rate :
+                            FAKE_COMPRESS_DEFAULT_RATE;
+    compress->ready = true;
+
+    snprintf(name, sizeof(name), "comprC%uD%u.bin", card, device);
+    compress->file = fake_audio_open_file(name, "ab");
+
+    pthread_mutex_lock(&compress_stats_lock);
+    compress->stats = &compress_stats[card][device];
+    compress->stats->opens++;
+    pthread_mutex_unlock(&compress_stats_lock);
+
+    ALOGV("%s: card %u device %u %u x %u bytes at %u bytes/s", __func__, card, device,
+          config->fragments, config->fragment_size, compress->byte_rate);
+    return compress;
+}
+
+void compress_close(struct compress *compress)
+{
+    if (compress == NULL)
+        return;
+    if (compress->file != NULL)
+        fclose(compress->file);
+    pthread_cond_destroy(&compress->cond);
+    pthread_mutex_destroy(&compress->lock);
+    free(compress);
+}
+
+bool is_compress_ready(struct compress *compress)
+{
+    return compress->ready;
+}
+
+const char *compress_get_error(struct compress *compress)
+{
+    return compress->error;
+}
+
+void compress_nonblock(struct compress *compress, int nonblock)
+{
+    pthread_mutex_lock(&compress->lock);
+    compress->nonblock = nonblock != 0;
+    pthread_mutex_unlock(&compress->lock);
+}
+
+int compress_write(struct compress *compress, const void *buf, unsigned int size)
+{
+    unsigned int done = 0;
+    unsigned int space;
+    unsigned int chunk;
+    struct timespec ts;
+
+    if (!compress->ready)
+        return -1;
+    pthread_mutex_lock(&compress->lock);
+    while (done < size) {
+        space = compress->buffer_size -
+                (unsigned int)(compress->written - compress_consumed_l(compress));
+        if (space < compress->config.fragment_size && space < size - done) {
+            if (compress->nonblock || !compress->running || compress->paused)
+                break;
+            compress_deadline(&ts, compress_ns_until_l(compress, compress->written +
+                    compress->config.fragment_size - compress->buffer_size));
+            pthread_cond_timedwait(&compress->cond, &compress->lock, &ts);
+            continue;
+        }
+        chunk = size - done < space ? size - done : space;
+        if (compress->file != NULL)
+            fwrite((const char *)buf + done, 1, chunk, compress->file);
+        compress->written += chunk;
+        done += chunk;
+    }
+    pthread_mutex_unlock(&compress->lock);
+
+    pthread_mutex_lock(&compress_stats_lock);
+    compress->stats->frames += done;
+    pthread_mutex_unlock(&compress_stats_lock);
+    return done;
+}
+
+int compress_wait(struct compress *compress, int timeout_ms)
+{
+    struct timespec ts;
+    int64_t wait_ns;
+    int ret = 0;
+
+    pthread_mutex_lock(&compress->lock);
+    if (compress->buffer_size - (compress->written - compress_consumed_l(compress)) <
+            compress->config.fragment_size) {
+        wait_ns = compress_ns_until_l(compress, compress->written +
+                                      compress->config.fragment_size - compress->buffer_size);
+        if (wait_ns == 0 || wait_ns > (int64_t)timeout_ms * 1000000)
+            wait_ns = (int64_t)timeout_ms * 1000000;
+        compress_deadline(&ts, wait_ns);
+        if (pthread_cond_timedwait(&compress->cond, &compress->lock, &ts) == ETIMEDOUT &&
+                compress->buffer_size - (compress->written - compress_consumed_l(compress)) <
+                compress->config.fragment_size) {
+            snprintf(compress->error, sizeof(compress->error), "poll timed out");
+            errno = ETIME;
+            ret = -1;
+        }
+    }
+    pthread_mutex_unlock(&compress->lock);
+    return ret;
+}
+
+int compress_get_hpointer(struct compress *compress, unsigned int *avail,
+                          struct timespec *tstamp)
+{
+    uint64_t consumed;
+
+    pthread_mutex_lock(&compress->lock);
+    consumed = compress_consumed_l(compress);
+    *avail = compress->buffer_size - (unsigned int)(compress->written - consumed);
+    tstamp->tv_sec = consumed / compress->byte_rate;
+    tstamp->tv_nsec = (consumed % compress->byte_rate) * 1000000000 / compress->byte_rate;
+    pthread_mutex_unlock(&compress->lock);
+    return 0;
+}
+
+int compress_get_tstamp(struct compress *compress, unsigned long *samples,
+                        unsigned int *sampling_rate)
+{
+    pthread_mutex_lock(&compress->lock);
+    *samples = compress_consumed_l(compress) * compress->sample_rate / compress->byte_rate;
+    *sampling_rate = compress->sample_rate;
+    pthread_mutex_unlock(&compress->lock);
+    return 0;
+}
+
+int compress_start(struct compress *compress)
+{
+    pthread_mutex_lock(&compress->lock);
+    compress->running = true;
+    compress->paused = false;
+    compress->start_ns = compress_now_ns();
+    pthread_mutex_unlock(&compress->lock);
+    return 0;
+}
+
+int compress_stop(struct compress *compress)
+{
+    pthread_mutex_lock(&compress->lock);
+    compress->running = false;
+    compress->paused = false;
+    compress->consumed_base = 0;
+    compress->written = 0;
+    compress->generation++;
+    pthread_cond_broadcast(&compress->cond);
+    pthread_mutex_unlock(&compress->lock);
+    return 0;
+}
+
+int compress_pause(struct compress *compress)
+{
+    pthread_mutex_lock(&compress->lock);
+    if (compress->running && !compress->paused) {
+        compress_freeze_l(compress);
+        compress->paused = true;
+        pthread_cond_broadcast(&compress->cond);
+    }
+    pthread_mutex_unlock(&compress->lock);
+    return 0;
+}
+
+int compress_resume(struct compress *compress)
+{
+    pthread_mutex_lock(&compress->lock);
+    if (compress->paused) {
+        compress->paused = false;
+        compress->start_ns = compress_now_ns();
+        pthread_cond_broadcast(&compress->cond);
+    }
+    pthread_mutex_unlock(&compress->lock);
+    return 0;
+}
+
+/* Waits until the DSP consumed what was written, unless stopped meanwhile */
+static int compress_wait_drained(struct compress *compress)
+{
+    unsigned int generation;
+    struct timespec ts;
+
+    pthread_mutex_lock(&compress->lock);
+    generation = compress->generation;
+    while (compress->running && generation == compress->generation &&
+           compress_consumed_l(compress) < compress->written) {
+        if (compress->paused) {
+            pthread_cond_wait(&compress->cond, &compress->lock);
+            continue;
+        }
+        compress_deadline(&ts, compress_ns_until_l(compress, compress->written));
+        pthread_cond_timedwait(&compress->cond, &compress->lock, &ts);
+    }
+    pthread_mutex_unlock(&compress->lock);
+    return 0;
+}
+
+int compress_drain(struct compress *compress)
+{
+    compress_wait_drained(compress);
+    pthread_mutex_lock(&compress->lock);
+    compress->running = false;
+    pthread_mutex_unlock(&compress->lock);
+    return 0;
+}
+
+int compress_partial_drain(struct compress *compress)
+{
+    return compress_wait_drained(compress);
+}
+
+int compress_next_track(struct compress *compress __unused)
+{
+    return 0;
+}
+
+int compress_set_gapless_metadata(struct compress *compress __unused,
+                                  struct compr_gapless_mdata *mdata __unused)
+{
+    return 0;
+}
@@ -23,6 +23,7 @@
 #include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/prctl.h>
+#include <time.h>
 #include <cutils/log.h>
 #include <cutils/uevent.h>
 
@@ -37,9 +38,12 @@
 
 #define FLOUNDER_VAD_DEV	"/dev/snd/hwC0D0"
 
-#define FLOUNDER_STREAMING_DELAY_USEC	1000
-#define FLOUNDER_STREAMING_READ_RETRY_ATTEMPTS	30
+/* the DSP is polled again after this delay when it had no samples */
+#define FLOUNDER_STREAMING_IDLE_MS	10
 #define FLOUNDER_STREAMING_BUFFER_SIZE	(16 * 1024)
+/* 2 seconds of 16 kHz mono 16 bit samples */
+#define FLOUNDER_STREAMING_RING_SIZE	(64 * 1024)
+#define FLOUNDER_STREAMING_READ_TIMEOUT_MS	50
 
 static const struct sound_trigger_properties hw_properties = {
     "The Android Open Source Project", // implementor
@@ -65,7 +69,9 @@ struct flounder_sound_trigger_device {
     sound_model_callback_t sound_model_callback;
     void *sound_model_cookie;
     pthread_t callback_thread;
+    pthread_t streaming_thread;
     pthread_mutex_t lock;
+    pthread_cond_t streaming_cond;
     int send_sock;
     int term_sock;
     int vad_fd;
@@ -73,10 +79,14 @@ struct flounder_sound_trigger_device {
     struct mixer_ctl *ctl_dsp;
     struct sound_trigger_recognition_config *config;
     int is_streaming;
+    int streaming_thread_running;
+    int streaming_status;
     int opened;
     char *streaming_buf;
-    size_t streaming_buf_read;
-    size_t streaming_buf_len;
+    char *streaming_ring;
+    size_t streaming_ring_read;
+    size_t streaming_ring_len;
+    size_t streaming_dropped;
 };
 
 struct rt_codec_cmd {
@@ -91,14 +101,67 @@ enum {
 
 // Since there's only ever one sound_trigger_device, keep it as a global so that other people can
 // dlopen this lib to get at the streaming audio.
-static struct flounder_sound_trigger_device g_stdev = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static struct flounder_sound_trigger_device g_stdev = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+static pthread_once_t streaming_cond_once = PTHREAD_ONCE_INIT;
+
+// The streaming_cond timed waits use the monotonic clock, see streaming_deadline().
+static void streaming_cond_init(void)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&g_stdev.streaming_cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static void streaming_deadline(struct timespec *ts, int ms)
+{
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+// The stdev should be locked when you call this function. The lock is released while waiting
+// for the streaming thread to exit. is_streaming and the ring are left as they are.
+static void stdev_stop_streaming_thread(struct flounder_sound_trigger_device *stdev)
+{
+    if (stdev->streaming_thread_running) {
+        stdev->streaming_thread_running = 0;
+        pthread_cond_broadcast(&stdev->streaming_cond);
+        pthread_mutex_unlock(&stdev->lock);
+
+        pthread_join(stdev->streaming_thread, (void **)NULL);
+
+        pthread_mutex_lock(&stdev->lock);
+    }
+}
+
+// The stdev should be locked when you call this function. The lock is released while waiting
+// for the streaming thread to exit.
+static void stdev_stop_streaming(struct flounder_sound_trigger_device *stdev)
+{
+    stdev->is_streaming = 0;
+    pthread_cond_broadcast(&stdev->streaming_cond);
+    stdev_stop_streaming_thread(stdev);
+    if (stdev->streaming_dropped)
+        ALOGW("%s: %zu streaming bytes dropped", __func__, stdev->streaming_dropped);
+    stdev->streaming_status = 0;
+    stdev->streaming_ring_read = 0;
+    stdev->streaming_ring_len = 0;
+    stdev->streaming_dropped = 0;
+}
 
 static void stdev_dsp_set_power(struct flounder_sound_trigger_device *stdev,
                                 int val)
 {
-    stdev->is_streaming = 0;
-    stdev->streaming_buf_read = 0;
-    stdev->streaming_buf_len = 0;
+    stdev_stop_streaming(stdev);
     mixer_ctl_set_value(stdev->ctl_dsp, 0, val);
 }
 
@@ -216,34 +279,128 @@ static char *sound_trigger_event_alloc(struct flounder_sound_trigger_device *
 }
 
 // The stdev should be locked when you call this function.
-static int fetch_streaming_buffer(struct flounder_sound_trigger_device * stdev)
+// When the ring is full the oldest bytes are overwritten.
+static void streaming_ring_write(struct flounder_sound_trigger_device *stdev,
+                                 const char *buf, size_t len)
 {
+    size_t write;
+    size_t count;
+
+    if (len > FLOUNDER_STREAMING_RING_SIZE) {
+        stdev->streaming_dropped += len - FLOUNDER_STREAMING_RING_SIZE;
+        buf += len - FLOUNDER_STREAMING_RING_SIZE;
+        len = FLOUNDER_STREAMING_RING_SIZE;
+    }
+    if (stdev->streaming_ring_len + len > FLOUNDER_STREAMING_RING_SIZE) {
+        count = stdev->streaming_ring_len + len - FLOUNDER_STREAMING_RING_SIZE;
+        stdev->streaming_dropped += count;
+        stdev->streaming_ring_read = (stdev->streaming_ring_read + count) %
+                FLOUNDER_STREAMING_RING_SIZE;
+        stdev->streaming_ring_len -= count;
+    }
+
+    write = (stdev->streaming_ring_read + stdev->streaming_ring_len) %
+            FLOUNDER_STREAMING_RING_SIZE;
+    count = FLOUNDER_STREAMING_RING_SIZE - write;
+    if (count > len)
+        count = len;
+    memcpy(stdev->streaming_ring + write, buf, count);
+    memcpy(stdev->streaming_ring, buf + count, len - count);
+    stdev->streaming_ring_len += len;
+}
+
+// The stdev should be locked when you call this function.
+static size_t streaming_ring_read(struct flounder_sound_trigger_device *stdev,
+                                  char *buf, size_t len)
+{
+    size_t count;
+
+    if (len > stdev->streaming_ring_len)
+        len = stdev->streaming_ring_len;
+
+    count = FLOUNDER_STREAMING_RING_SIZE - stdev->streaming_ring_read;
+    if (count > len)
+        count = len;
+    memcpy(buf, stdev->streaming_ring + stdev->streaming_ring_read, count);
+    memcpy(buf + count, stdev->streaming_ring, len - count);
+    stdev->streaming_ring_read = (stdev->streaming_ring_read + len) %
+            FLOUNDER_STREAMING_RING_SIZE;
+    stdev->streaming_ring_len -= len;
+    return len;
+}
+
+// Drains the DSP into the streaming ring from the moment the hotword is detected, so that
+// the audio following it is kept while the upper levels open the capture stream. The DSP is
+// polled without holding the lock: readers only wait for the streaming_cond signal. When the
+// DSP has no samples, the thread waits on streaming_cond so that stopping it is immediate.
+static void *streaming_thread_loop(void *context)
+{
+    struct flounder_sound_trigger_device *stdev =
+               (struct flounder_sound_trigger_device *)context;
     struct rt_codec_cmd cmd;
-    int ret = 0;
-    int i;
+    struct timespec ts;
+    int ret;
+
+    prctl(PR_SET_NAME, (unsigned long)"sound trigger streaming", 0, 0, 0);
 
     cmd.number = FLOUNDER_STREAMING_BUFFER_SIZE / sizeof(int);
     cmd.buf = (int*) stdev->streaming_buf;
 
-    ALOGV("%s: Fetching bytes", __func__);
-    for (i = 0; i < FLOUNDER_STREAMING_READ_RETRY_ATTEMPTS; i++) {
+    pthread_mutex_lock(&stdev->lock);
+    while (stdev->is_streaming && stdev->streaming_thread_running) {
+        pthread_mutex_unlock(&stdev->lock);
+
         ret = ioctl(stdev->vad_fd, RT_READ_CODEC_DSP_IOCTL, &cmd);
+        if (ret < 0)
+            ret = -errno;
+
+        pthread_mutex_lock(&stdev->lock);
+        if (ret < 0) {
+            ALOGE("%s: IOCTL failed with code %d", __func__, ret);
+            stdev->streaming_status = ret;
+            pthread_cond_broadcast(&stdev->streaming_cond);
+            // Unless stdev_stop_streaming() is already joining it, nobody waits for this
+            // thread: let streaming restart with a new one.
+            if (stdev->streaming_thread_running) {
+                stdev->streaming_thread_running = 0;
+                pthread_detach(pthread_self());
+            }
+            break;
+        }
         if (ret == 0) {
-            usleep(FLOUNDER_STREAMING_DELAY_USEC);
-        } else if (ret < 0) {
-            ALOGV("%s: IOCTL failed with code %d", __func__, ret);
-            return ret;
-        } else {
+            streaming_deadline(&ts, FLOUNDER_STREAMING_IDLE_MS);
+            while (stdev->is_streaming && stdev->streaming_thread_running &&
+                   pthread_cond_timedwait(&stdev->streaming_cond, &stdev->lock, &ts) != ETIMEDOUT)
+                ;
+            continue;
+        }
+        if (stdev->is_streaming) {
             // The IOCTL returns the number of int16 samples that were read, so we need to multipy
             // it by 2 .
             ALOGV("%s: IOCTL captured %d samples", __func__, ret);
-            stdev->streaming_buf_read = 0;
-            stdev->streaming_buf_len = ret << 1;
-            return 0;
+            streaming_ring_write(stdev, stdev->streaming_buf, ret << 1);
+            pthread_cond_broadcast(&stdev->streaming_cond);
         }
     }
-    ALOGV("%s: Timeout waiting for data from dsp", __func__);
-    return 0;
+    pthread_mutex_unlock(&stdev->lock);
+
+    return NULL;
+}
+
+// The stdev should be locked when you call this function.
+static void stdev_start_streaming(struct flounder_sound_trigger_device *stdev)
+{
+    stdev->is_streaming = 1;
+    if (stdev->streaming_thread_running)
+        return;
+    stdev->streaming_status = 0;
+    if (pthread_create(&stdev->streaming_thread, (const pthread_attr_t *) NULL,
+                       streaming_thread_loop, stdev) != 0) {
+        ALOGE("%s: Error creating streaming thread", __func__);
+        stdev->streaming_status = -ENOMEM;
+        return;
+    }
+    stdev->streaming_thread_running = 1;
 }
 
 static void *callback_thread_loop(void *context)
@@ -305,16 +462,18 @@ static void *callback_thread_loop(void *context)
                     event = (struct sound_trigger_phrase_recognition_event *)
                             sound_trigger_event_alloc(stdev);
                     if (event) {
-                        stdev->is_streaming = 1;
+                        // Start reading data from the DSP while the upper levels do their thing.
+                        // Without capture_requested, the DSP buffers the audio until the
+                        // stream is opened with sound_trigger_open_for_streaming().
+                        if (stdev->config && stdev->config->capture_requested)
+                            stdev_start_streaming(stdev);
+                        else
+                            stdev->is_streaming = 1;
                         ALOGI("%s send callback model %d", __func__,
                               stdev->model_handle);
                         stdev->recognition_callback(&event->common,
                                                     stdev->recognition_cookie);
                         free(event);
-                        // Start reading data from the DSP while the upper levels do their thing.
-                        if (stdev->config && stdev->config->capture_requested) {
-                            fetch_streaming_buffer(stdev);
-                        }
                     }
                     goto found;
                 }
@@ -530,6 +689,9 @@ int sound_trigger_open_for_streaming()
         ret = -EBUSY;
         goto exit;
     }
+    // Drain the DSP into the ring if nothing does yet: the thread is not started on detection
+    // without capture_requested, and is stopped each time the stream is closed.
+    stdev_start_streaming(stdev);
     // TODO: Probably want to get something from whoever called us to bind to it/assert that it's a
     // valid connection. Perhaps returning a more
     // meaningful handle would be a good idea as well.
@@ -543,7 +705,7 @@ __attribute__ ((visibility ("default")))
 size_t sound_trigger_read_samples(int audio_handle, void *buffer, size_t  buffer_len)
 {
     struct flounder_sound_trigger_device *stdev = &g_stdev;
-    int i;
+    struct timespec ts;
     size_t ret = 0;
 
     if (audio_handle <= 0) {
@@ -564,18 +726,21 @@ size_t sound_trigger_read_samples(int audio_handle, void *buffer, size_t  buffer
         goto exit;
     }
 
-    if (stdev->streaming_buf_read == stdev->streaming_buf_len) {
-        ret = fetch_streaming_buffer(stdev);
+    // Wait for the streaming thread to fill the request, and return what has been captured
+    // when the timeout expires.
+    streaming_deadline(&ts, FLOUNDER_STREAMING_READ_TIMEOUT_MS);
+    while (stdev->is_streaming && stdev->streaming_status == 0 &&
+           stdev->streaming_ring_len < buffer_len) {
+        if (pthread_cond_timedwait(&stdev->streaming_cond, &stdev->lock, &ts) == ETIMEDOUT)
+            break;
     }
 
-    if (!ret) {
-        ret = stdev->streaming_buf_len - stdev->streaming_buf_read;
-        if (ret > buffer_len)
-            ret = buffer_len;
-        memcpy(buffer, stdev->streaming_buf + stdev->streaming_buf_read, ret);
-        stdev->streaming_buf_read += ret;
-        ALOGV("%s: Sent %zu bytes to buffer", __func__, ret);
+    if (stdev->streaming_ring_len == 0 && stdev->streaming_status < 0) {
+        ret = stdev->streaming_status;
+        goto exit;
     }
+    ret = streaming_ring_read(stdev, (char *)buffer, buffer_len);
+    ALOGV("%s: Sent %zu bytes to buffer", __func__, ret);
 
 exit:
     pthread_mutex_unlock(&stdev->lock);
@@ -585,8 +750,15 @@ exit:
 __attribute__ ((visibility ("default")))
 int sound_trigger_close_for_streaming(int audio_handle __unused)
 {
+    struct flounder_sound_trigger_device *stdev = &g_stdev;
+
     // TODO: Power down the DSP? I think we shouldn't in case we want to open this mic for streaming
     // for the voice search?
+    // Only stop draining the DSP while nobody reads: streaming stays open so that the stream
+    // can be opened again, and the thread restarts then.
+    pthread_mutex_lock(&stdev->lock);
+    stdev_stop_streaming_thread(stdev);
+    pthread_mutex_unlock(&stdev->lock);
     return 0;
 }
 
@@ -602,8 +774,9 @@ static int stdev_close(hw_device_t *device)
         ret = -EFAULT;
         goto exit;
     }
-    free(stdev->streaming_buf);
     stdev_close_mixer(stdev);
+    free(stdev->streaming_buf);
+    free(stdev->streaming_ring);
     stdev->model_handle = 0;
     stdev->send_sock = 0;
     stdev->term_sock = 0;
@@ -624,6 +797,7 @@ static int stdev_open(const hw_module_t *module, const char *name,
         return -EINVAL;
 
     stdev = &g_stdev;
+    pthread_once(&streaming_cond_once, streaming_cond_init);
     pthread_mutex_lock(&stdev->lock);
 
     if (stdev->opened) {
@@ -633,7 +807,10 @@ static int stdev_open(const hw_module_t *module, const char *name,
     }
 
     stdev->streaming_buf = malloc(FLOUNDER_STREAMING_BUFFER_SIZE);
-    if (!stdev->streaming_buf) {
+    stdev->streaming_ring = malloc(FLOUNDER_STREAMING_RING_SIZE);
+    if (!stdev->streaming_buf || !stdev->streaming_ring) {
+        free(stdev->streaming_buf);
+        free(stdev->streaming_ring);
         ret = -ENOMEM;
         goto exit;
     }
@@ -642,6 +819,7 @@ static int stdev_open(const hw_module_t *module, const char *name,
     if (ret) {
         ALOGE("Error mixer init");
         free(stdev->streaming_buf);
+        free(stdev->streaming_ring);
         goto exit;
     }
 
@@ -655,8 +833,6 @@ static int stdev_open(const hw_module_t *module, const char *name,
     stdev->device.start_recognition = stdev_start_recognition;
     stdev->device.stop_recognition = stdev_stop_recognition;
     stdev->send_sock = stdev->term_sock = -1;
-    stdev->streaming_buf_read = 0;
-    stdev->streaming_buf_len = 0;
     stdev->opened = true;
 
     *device = &stdev->device.common; /* same address as stdev */